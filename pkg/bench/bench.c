@@ -0,0 +1,113 @@
+//
+// bench.c -- helpers shared by the libaf_util benchmarks
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "bench.h"
+
+/* the library leaves the debug level to the application */
+uint32_t g_debugLevel = 0;
+
+static uint64_t s_syslogCount;
+
+/* syslog stub; formats like the real thing so logging benchmarks include
+   the formatting cost, but never sends anything */
+void vsyslog(int priority, const char *format, va_list ap)
+{
+    char buf[1024];
+    vsnprintf(buf, sizeof(buf), format, ap);
+    __atomic_fetch_add(&s_syslogCount, 1, __ATOMIC_RELAXED);
+}
+
+void syslog(int priority, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vsyslog(priority, format, ap);
+    va_end(ap);
+}
+
+/* fortified builds call these instead */
+void __vsyslog_chk(int priority, int flag, const char *format, va_list ap)
+{
+    vsyslog(priority, format, ap);
+}
+
+void __syslog_chk(int priority, int flag, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vsyslog(priority, format, ap);
+    va_end(ap);
+}
+
+uint64_t bench_syslog_count(void)
+{
+    return __atomic_load_n(&s_syslogCount, __ATOMIC_RELAXED);
+}
+
+#ifdef __GLIBC__
+/* glibc lets the application interpose the allocator; count the calls and
+   pass them on to the real one */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t s_allocCount;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&s_allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&s_allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&s_allocCount, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int64_t bench_alloc_count(void)
+{
+    return (int64_t)__atomic_load_n(&s_allocCount, __ATOMIC_RELAXED);
+}
+#else
+int64_t bench_alloc_count(void)
+{
+    return -1;
+}
+#endif
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_print_header(void)
+{
+    printf("benchmark,param,threads,ops,seconds,ns_per_op,mops_per_sec,mb_per_sec,allocs_per_op\n");
+}
+
+void bench_report(const char *benchmark, const char *param, int threads, double ops,
+                  double seconds, double bytes, int64_t allocs)
+{
+    printf("%s,%s,%d,%.0f,%.6f,%.2f,%.3f,%.2f,%.3f\n", benchmark, param, threads, ops, seconds,
+           seconds * 1e9 * threads / ops, ops / seconds / 1e6, bytes / seconds / 1e6,
+           allocs < 0 ? -1.0 : allocs / ops);
+    fflush(stdout);
+}
@@ -0,0 +1,38 @@
+//
+// bench.h -- helpers shared by the libaf_util benchmarks
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+/* Every benchmark prints CSV rows in the same format:
+
+   benchmark,param,threads,ops,seconds,ns_per_op,mops_per_sec,mb_per_sec,allocs_per_op
+
+   ns_per_op is wall clock time per operation per thread. mb_per_sec is 0
+   when the benchmark doesn't process a byte stream. allocs_per_op counts
+   calls to malloc, calloc, and realloc, and is -1 if they can't be counted
+   on this C library.
+
+   syslog is replaced by a stub that formats the message and throws it
+   away, so the benchmarks run without a syslog daemon. */
+
+void bench_print_header(void);
+
+/* returns a monotonic time stamp in seconds */
+double bench_now(void);
+
+/* returns the number of heap allocations made so far, or -1 if unknown */
+int64_t bench_alloc_count(void);
+
+/* returns the number of syslog calls made so far */
+uint64_t bench_syslog_count(void);
+
+void bench_report(const char *benchmark, const char *param, int threads, double ops,
+                  double seconds, double bytes, int64_t allocs);
+
+#endif // __BENCH_H__
@@ -0,0 +1,299 @@
+//
+// mempool_bench.c -- af_mempool benchmarks
+//
+// Single thread: alloc/free pairs and bursts on fixed and expanding pools,
+// the inline fast path, bulk alloc/free, and allocations from an exhausted
+// pool, whose error log is rate limited. Contention: a plain pool wrapped
+// in a global mutex against the thread safe and lock free pool modes at 1
+// to N threads, where each thread repeatedly allocates a burst of units,
+// writes to them, and frees them.
+//
+// usage: mempool_bench [maxThreads] [iterations]
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "af_mempool.h"
+#include "af_mempool_fast.h"
+#include "bench.h"
+
+#define UNIT_SIZE  64
+#define NUM_UNITS  256
+#define BURST      8
+#define MAX_BURST  64
+
+typedef enum {
+    VARIANT_MUTEX = 0,
+    VARIANT_THREAD_SAFE,
+    VARIANT_LOCK_FREE,
+    NUM_VARIANTS
+} variant_t;
+
+static const char *s_variantNames[NUM_VARIANTS] = { "mempool_mutex", "mempool_thread_safe", "mempool_lock_free" };
+static const uint32_t s_variantFlags[NUM_VARIANTS] = {
+    0, AF_MEMPOOL_FLAG_THREAD_SAFE, AF_MEMPOOL_FLAG_LOCK_FREE
+};
+
+static af_mempool_t *s_pool;
+static variant_t s_variant;
+static long s_iterations;
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t s_barrier;
+
+static inline void *bench_alloc(void)
+{
+    void *unit;
+    if (s_variant == VARIANT_MUTEX) {
+        pthread_mutex_lock(&s_mutex);
+        unit = af_mempool_alloc(s_pool);
+        pthread_mutex_unlock(&s_mutex);
+    } else {
+        unit = af_mempool_alloc(s_pool);
+    }
+    return unit;
+}
+
+static inline void bench_free(void *unit)
+{
+    if (s_variant == VARIANT_MUTEX) {
+        pthread_mutex_lock(&s_mutex);
+        af_mempool_free(unit);
+        pthread_mutex_unlock(&s_mutex);
+    } else {
+        af_mempool_free(unit);
+    }
+}
+
+static void *bench_thread(void *arg)
+{
+    void *units[BURST];
+    long i;
+    int j;
+
+    pthread_barrier_wait(&s_barrier);
+    for (i = 0; i < s_iterations; i++) {
+        for (j = 0; j < BURST; j++) {
+            units[j] = bench_alloc();
+            if (units[j] == NULL) {
+                fprintf(stderr, "alloc failed\n");
+                exit(1);
+            }
+            *(volatile uint32_t *)units[j] = j;
+        }
+        for (j = 0; j < BURST; j++) {
+            bench_free(units[j]);
+        }
+    }
+    return NULL;
+}
+
+static int run_contention(variant_t variant, int numThreads)
+{
+    pthread_t threads[numThreads];
+    char param[32];
+    int i;
+
+    s_variant = variant;
+    s_pool = af_mempool_create(NUM_UNITS, UNIT_SIZE, AF_MEMPOOL_FLAG_EXPAND | s_variantFlags[variant]);
+    if (s_pool == NULL) {
+        fprintf(stderr, "%s: af_mempool_create failed\n", s_variantNames[variant]);
+        return -1;
+    }
+
+    pthread_barrier_init(&s_barrier, NULL, numThreads + 1);
+    for (i = 0; i < numThreads; i++) {
+        pthread_create(&threads[i], NULL, bench_thread, NULL);
+    }
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    pthread_barrier_wait(&s_barrier);
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    pthread_barrier_destroy(&s_barrier);
+
+    af_mempool_destroy(s_pool);
+
+    /* one op is an alloc and its matching free */
+    snprintf(param, sizeof(param), "burst=%d", BURST);
+    bench_report(s_variantNames[variant], param, numThreads, (double)s_iterations * BURST * numThreads,
+                 elapsed, 0, allocs);
+    return 0;
+}
+
+/* single thread alloc/free of bursts of burst units; an expanding pool
+   starts small and grows to the burst size during the first iteration */
+static void run_single(const char *name, int expand, int burst)
+{
+    void *units[MAX_BURST];
+    char param[32];
+    long i;
+    int j;
+
+    af_mempool_t *mp = (expand ?
+                        af_mempool_create(4, UNIT_SIZE, AF_MEMPOOL_FLAG_EXPAND) :
+                        af_mempool_create(MAX_BURST, UNIT_SIZE, 0));
+    if (mp == NULL) {
+        fprintf(stderr, "%s: af_mempool_create failed\n", name);
+        return;
+    }
+
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    for (i = 0; i < s_iterations; i++) {
+        for (j = 0; j < burst; j++) {
+            units[j] = af_mempool_alloc(mp);
+            *(volatile uint32_t *)units[j] = j;
+        }
+        for (j = 0; j < burst; j++) {
+            af_mempool_free(units[j]);
+        }
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    af_mempool_destroy(mp);
+
+    snprintf(param, sizeof(param), "burst=%d", burst);
+    bench_report(name, param, 1, (double)s_iterations * burst, elapsed, 0, allocs);
+}
+
+/* same as run_single on a fixed pool but with the inline functions; the
+   pool has room for one more burst so its block never becomes idle or full */
+static void run_fast(int burst)
+{
+    void *units[MAX_BURST];
+    char param[32];
+    long i;
+    int j;
+
+    af_mempool_t *mp = af_mempool_create(MAX_BURST * 2 + 2, UNIT_SIZE, 0);
+    if (mp == NULL) {
+        fprintf(stderr, "mempool_fast: af_mempool_create failed\n");
+        return;
+    }
+    void *keep = af_mempool_alloc(mp);
+
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    for (i = 0; i < s_iterations; i++) {
+        for (j = 0; j < burst; j++) {
+            units[j] = af_mempool_alloc_fast(mp);
+            *(volatile uint32_t *)units[j] = j;
+        }
+        for (j = 0; j < burst; j++) {
+            af_mempool_free_fast(units[j]);
+        }
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    af_mempool_free(keep);
+    af_mempool_destroy(mp);
+
+    snprintf(param, sizeof(param), "burst=%d", burst);
+    bench_report("mempool_fast", param, 1, (double)s_iterations * burst, elapsed, 0, allocs);
+}
+
+static void run_bulk(int burst)
+{
+    void *units[MAX_BURST];
+    char param[32];
+    long i;
+    int j;
+
+    af_mempool_t *mp = af_mempool_create(MAX_BURST, UNIT_SIZE, 0);
+    if (mp == NULL) {
+        fprintf(stderr, "mempool_bulk: af_mempool_create failed\n");
+        return;
+    }
+
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    for (i = 0; i < s_iterations; i++) {
+        af_mempool_alloc_bulk(mp, units, burst);
+        for (j = 0; j < burst; j++) {
+            *(volatile uint32_t *)units[j] = j;
+        }
+        af_mempool_free_bulk(units, burst);
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    af_mempool_destroy(mp);
+
+    snprintf(param, sizeof(param), "burst=%d", burst);
+    bench_report("mempool_bulk", param, 1, (double)s_iterations * burst, elapsed, 0, allocs);
+}
+
+/* allocations from a full pool that can't expand; each one fails and
+   logs, so this measures the error path and how many syslog records the
+   rate limiter lets through */
+static void run_exhausted(void)
+{
+    char param[64];
+    long i;
+
+    af_mempool_t *mp = af_mempool_create(1, UNIT_SIZE, 0);
+    if (mp == NULL) {
+        fprintf(stderr, "mempool_exhausted: af_mempool_create failed\n");
+        return;
+    }
+    void *unit = af_mempool_alloc(mp);
+
+    uint64_t records = bench_syslog_count();
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    for (i = 0; i < s_iterations; i++) {
+        if (af_mempool_alloc(mp) != NULL) {
+            fprintf(stderr, "mempool_exhausted: allocation succeeded\n");
+            break;
+        }
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    records = bench_syslog_count() - records;
+    af_mempool_free(unit);
+    af_mempool_destroy(mp);
+
+    snprintf(param, sizeof(param), "records=%llu", (unsigned long long)records);
+    bench_report("mempool_exhausted", param, 1, s_iterations, elapsed, 0, allocs);
+}
+
+int main(int argc, char *argv[])
+{
+    int maxThreads = (argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    s_iterations = (argc > 2 ? atol(argv[2]) : 200000);
+    if (maxThreads < 1 || s_iterations < 1) {
+        fprintf(stderr, "usage: %s [maxThreads] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    bench_print_header();
+
+    run_single("mempool_fixed", 0, 1);
+    run_single("mempool_fixed", 0, MAX_BURST);
+    run_single("mempool_expanding", 1, 1);
+    run_single("mempool_expanding", 1, MAX_BURST);
+    run_fast(1);
+    run_fast(MAX_BURST);
+    run_bulk(16);
+    run_bulk(MAX_BURST);
+    run_exhausted();
+
+    int v, t;
+    for (v = 0; v < NUM_VARIANTS; v++) {
+        for (t = 1; t <= maxThreads; t++) {
+            if (run_contention(v, t) < 0) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
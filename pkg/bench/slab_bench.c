@@ -0,0 +1,162 @@
+//
+// slab_bench.c -- af_slab versus malloc for mixed size allocations
+//
+// Each thread keeps a working set of live objects and repeatedly replaces
+// a random one with a new object of random size. Most sizes are small,
+// with a tail of medium and oversized requests.
+//
+// usage: slab_bench [maxThreads] [iterations]
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "af_mempool.h"
+#include "af_slab.h"
+#include "bench.h"
+
+#define WORKING_SET    1024
+#define UNITS_PER_BLOCK 256
+
+typedef enum {
+    VARIANT_MALLOC = 0,
+    VARIANT_SLAB,
+    VARIANT_SLAB_THREAD_SAFE,
+    NUM_VARIANTS
+} variant_t;
+
+static const char *s_variantNames[NUM_VARIANTS] = { "slab_malloc", "slab", "slab_thread_safe" };
+
+static af_slab_t *s_slab;
+static variant_t s_variant;
+static long s_iterations;
+static pthread_barrier_t s_barrier;
+
+static inline uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* 70% 1-128 bytes, 25% 129-2048 bytes, 5% 2049-8192 bytes */
+static inline size_t random_size(uint32_t *state)
+{
+    uint32_t r = xorshift32(state);
+    uint32_t pick = r % 100;
+    r = xorshift32(state);
+    if (pick < 70) {
+        return 1 + r % 128;
+    } else if (pick < 95) {
+        return 129 + r % (2048 - 128);
+    }
+    return 2049 + r % (8192 - 2048);
+}
+
+static void *bench_thread(void *arg)
+{
+    void *live[WORKING_SET];
+    uint32_t state = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    long i;
+
+    memset(live, 0, sizeof(live));
+    pthread_barrier_wait(&s_barrier);
+    for (i = 0; i < s_iterations; i++) {
+        uint32_t slot = xorshift32(&state) % WORKING_SET;
+        size_t size = random_size(&state);
+        if (s_variant == VARIANT_MALLOC) {
+            free(live[slot]);
+            live[slot] = malloc(size);
+        } else {
+            if (live[slot]) {
+                af_slab_free(live[slot]);
+            }
+            live[slot] = af_slab_alloc(s_slab, size);
+        }
+        if (live[slot] == NULL) {
+            fprintf(stderr, "alloc failed\n");
+            exit(1);
+        }
+        *(volatile uint8_t *)live[slot] = (uint8_t)i;
+    }
+
+    for (i = 0; i < WORKING_SET; i++) {
+        if (s_variant == VARIANT_MALLOC) {
+            free(live[i]);
+        } else if (live[i]) {
+            af_slab_free(live[i]);
+        }
+    }
+    return NULL;
+}
+
+static int run(variant_t variant, int numThreads)
+{
+    pthread_t threads[numThreads];
+    int i;
+
+    s_variant = variant;
+    if (variant != VARIANT_MALLOC) {
+        s_slab = af_slab_create(NULL, 0, UNITS_PER_BLOCK,
+                                variant == VARIANT_SLAB_THREAD_SAFE ? AF_MEMPOOL_FLAG_THREAD_SAFE : 0);
+        if (s_slab == NULL) {
+            fprintf(stderr, "%s: af_slab_create failed\n", s_variantNames[variant]);
+            return -1;
+        }
+    }
+
+    pthread_barrier_init(&s_barrier, NULL, numThreads + 1);
+    for (i = 0; i < numThreads; i++) {
+        pthread_create(&threads[i], NULL, bench_thread, (void *)(uintptr_t)(i + 1));
+    }
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    pthread_barrier_wait(&s_barrier);
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    pthread_barrier_destroy(&s_barrier);
+
+    if (s_slab) {
+        af_slab_destroy(s_slab);
+        s_slab = NULL;
+    }
+
+    /* one op is a free and an allocation */
+    bench_report(s_variantNames[variant], "mixed", numThreads, (double)s_iterations * numThreads,
+                 elapsed, 0, allocs);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int maxThreads = (argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    s_iterations = (argc > 2 ? atol(argv[2]) : 1000000);
+    if (maxThreads < 1 || s_iterations < 1) {
+        fprintf(stderr, "usage: %s [maxThreads] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    bench_print_header();
+    int t;
+    for (t = 1; t <= maxThreads; t++) {
+        run(VARIANT_MALLOC, t);
+        if (t == 1) {
+            /* the plain slab isn't thread safe */
+            run(VARIANT_SLAB, t);
+        }
+        run(VARIANT_SLAB_THREAD_SAFE, t);
+    }
+    return 0;
+}
@@ -0,0 +1,655 @@
+//
+// util_bench.c -- benchmarks for the af_util hex, log buffer, and key value
+// pair file routines
+//
+// The hex benchmarks convert random buffers of several sizes. The log
+// benchmarks format buffers with af_log_buffer and
+// af_util_convert_data_to_hex_with_name into the stubbed syslog. The key
+// value pair benchmarks parse generated files of increasing length into
+// fixed size pairs and into views with af_util_kvp_open. The
+// /dev/log transport case sends to a socket read by a thread standing in
+// for syslogd. The metrics cases measure recording a counter and a
+// histogram value. The command cases run /bin/true with system(3),
+// af_spawn, af_util_system, and the af_exec helper from a process with a
+// large resident set. The file cases poll a /proc file by opening it
+// each time and through a persistent handle, and read 56 /proc files one
+// by one and as a batch. The cache cases check and read a small file with
+// the af_util file cache off and on.
+//
+// usage: util_bench [iterations]
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "af_util.h"
+#define AF_LOG_MODULE "util_bench"
+#include "af_log.h"
+#include "af_metrics.h"
+#include "af_spawn.h"
+#include "af_exec.h"
+#include "bench.h"
+
+#define MAX_BUF_SIZE 65536
+#define NUM_KEYS     16
+
+static const size_t s_hexSizes[] = { 16, 64, 256, 4096, 65536 };
+static const size_t s_logSizes[] = { 16, 64, 256, 4096 };
+static const int s_kvpLines[] = { 1000, 10000, 100000 };
+
+#define ARRAY_SIZE(_a) (sizeof(_a) / sizeof((_a)[0]))
+
+static long s_iterations;
+static uint8_t s_data[MAX_BUF_SIZE];
+static uint8_t s_decoded[MAX_BUF_SIZE];
+static char s_hex[MAX_BUF_SIZE * 2 + 1];
+
+/* scale the iteration count so each case processes about the same number
+   of bytes, with a floor so large cases still run a few times */
+static long iterations_for(size_t size)
+{
+    long n = s_iterations * 64 / (long)size;
+    return (n < 16 ? 16 : n);
+}
+
+static void run_hex(void)
+{
+    char param[64];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s_hexSizes); i++) {
+        size_t size = s_hexSizes[i];
+        long n = iterations_for(size), j;
+        snprintf(param, sizeof(param), "size=%zu", size);
+
+        int64_t allocs = bench_alloc_count();
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_buffer_to_hex(s_hex, sizeof(s_hex), s_data, size);
+        }
+        double elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        bench_report("hex_encode", param, 1, n, elapsed, (double)n * size, allocs);
+
+        allocs = bench_alloc_count();
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_hex_to_buffer(s_decoded, sizeof(s_decoded), s_hex, size * 2);
+        }
+        elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        bench_report("hex_decode", param, 1, n, elapsed, (double)n * size, allocs);
+
+        allocs = bench_alloc_count();
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_hex_to_buffer_strict(s_decoded, sizeof(s_decoded), s_hex, size * 2, NULL);
+        }
+        elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        bench_report("hex_decode_strict", param, 1, n, elapsed, (double)n * size, allocs);
+
+        if (memcmp(s_data, s_decoded, size)) {
+            fprintf(stderr, "hex round trip mismatch at size %zu\n", size);
+            exit(1);
+        }
+    }
+}
+
+/* converts the whole buffer through 4k output windows, the way a caller
+   streaming to or from a socket would */
+#define STREAM_WINDOW 4096
+
+static void run_hex_stream(void)
+{
+    char window[STREAM_WINDOW];
+    char param[64];
+    size_t size = MAX_BUF_SIZE;
+    long n = iterations_for(size), j;
+    snprintf(param, sizeof(param), "size=%zu;window=%d", size, STREAM_WINDOW);
+
+    int64_t allocs = bench_alloc_count();
+    double start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_hex_encoder_t enc;
+        size_t pos = 0, used;
+        af_util_hex_encoder_init(&enc);
+        while (pos < size) {
+            af_util_hex_encode_chunk(&enc, window, sizeof(window), s_data + pos, size - pos, &used);
+            pos += used;
+        }
+    }
+    double elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    bench_report("hex_encode_stream", param, 1, n, elapsed, (double)n * size, allocs);
+
+    af_util_buffer_to_hex(s_hex, sizeof(s_hex), s_data, size);
+    allocs = bench_alloc_count();
+    start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_hex_decoder_t dec;
+        size_t pos = 0, used;
+        af_util_hex_decoder_init(&dec, 1);
+        while (pos < size * 2) {
+            if (af_util_hex_decode_chunk(&dec, (uint8_t *)window, sizeof(window), s_hex + pos, size * 2 - pos, &used) < 0) {
+                fprintf(stderr, "af_util_hex_decode_chunk failed\n");
+                exit(1);
+            }
+            pos += used;
+        }
+    }
+    elapsed = bench_now() - start;
+    allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+    bench_report("hex_decode_stream", param, 1, n, elapsed, (double)n * size, allocs);
+}
+
+static void run_log(void)
+{
+    char param[64];
+    int i;
+
+    g_debugLevel = LOG_DEBUG1;
+    for (i = 0; i < ARRAY_SIZE(s_logSizes); i++) {
+        size_t size = s_logSizes[i];
+        long n = iterations_for(size), j;
+        snprintf(param, sizeof(param), "size=%zu", size);
+
+        int w;
+        for (w = 0; w < 2; w++) {
+            int bytesPerRecord = (w ? AF_LOG_BUFFER_MAX_BYTES_PER_RECORD : 32);
+            int64_t allocs = bench_alloc_count();
+            uint64_t records = bench_syslog_count();
+            double start = bench_now();
+            for (j = 0; j < n; j++) {
+                af_log_buffer_wide(LOG_DEBUG1, "bench", s_data, size, bytesPerRecord);
+            }
+            double elapsed = bench_now() - start;
+            allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+            records = bench_syslog_count() - records;
+            /* the number of syslog records per call goes in the param column
+               so row formatting changes show up in the results */
+            snprintf(param, sizeof(param), "size=%zu;records=%llu", size, (unsigned long long)(records / n));
+            bench_report(w ? "log_buffer_wide" : "log_buffer", param, 1, n, elapsed, (double)n * size, allocs);
+        }
+        snprintf(param, sizeof(param), "size=%zu", size);
+
+        int64_t allocs = bench_alloc_count();
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_convert_data_to_hex_with_name("bench", s_data, size, s_hex, sizeof(s_hex));
+        }
+        double elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        bench_report("hex_with_name", param, 1, n, elapsed, (double)n * size, allocs);
+    }
+    g_debugLevel = LOG_DEBUG_OFF;
+}
+
+/* stands in for syslogd, counting the messages sent to its socket */
+static int s_devLogSock = -1;
+static int s_devLogStop;
+static uint64_t s_devLogReceived;
+
+static void *devlog_thread(void *arg)
+{
+    char buf[1024];
+    while (!__atomic_load_n(&s_devLogStop, __ATOMIC_ACQUIRE)) {
+        if (recv(s_devLogSock, buf, sizeof(buf), 0) > 0) {
+            __atomic_add_fetch(&s_devLogReceived, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int devlog_start(const char *path, pthread_t *thread)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct timeval tv = { 0, 100000 };
+    int size = 1 << 20;
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    s_devLogSock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (s_devLogSock < 0 || bind(s_devLogSock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("devlog socket");
+        return -1;
+    }
+    setsockopt(s_devLogSock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(s_devLogSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    s_devLogStop = 0;
+    return pthread_create(thread, NULL, devlog_thread, NULL);
+}
+
+static void devlog_stop(const char *path, pthread_t thread)
+{
+    __atomic_store_n(&s_devLogStop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    close(s_devLogSock);
+    unlink(path);
+}
+
+/* caller side cost of an AFLOG_INFO message, logged synchronously,
+   through the async ring with each overflow policy, recorded in a binary
+   log file, and sent straight to the syslogd stand-in's socket */
+static void run_log_async(void)
+{
+    static const struct {
+        const char *name;
+        int async;
+        uint32_t overflow;
+        int binary;
+        uint32_t transport;
+    } modes[] = {
+        { "aflog_sync", 0, 0, 0, AF_LOG_TRANSPORT_SYSLOG },
+        { "aflog_async_drop", 1, AF_LOG_OVERFLOW_DROP, 0, AF_LOG_TRANSPORT_SYSLOG },
+        { "aflog_async_block", 1, AF_LOG_OVERFLOW_BLOCK, 0, AF_LOG_TRANSPORT_SYSLOG },
+        { "aflog_binary_drop", 1, AF_LOG_OVERFLOW_DROP, 1, AF_LOG_TRANSPORT_SYSLOG },
+        { "aflog_binary_block", 1, AF_LOG_OVERFLOW_BLOCK, 1, AF_LOG_TRANSPORT_SYSLOG },
+        { "aflog_devlog_block", 1, AF_LOG_OVERFLOW_BLOCK, 0, AF_LOG_TRANSPORT_DEVLOG },
+    };
+    char path[] = "/tmp/util_bench_log_XXXXXX";
+    char sockPath[sizeof(path) + 5];
+    long n = s_iterations * 4, j;
+    int mode;
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+    snprintf(sockPath, sizeof(sockPath), "%s.sock", path);
+
+    for (mode = 0; mode < ARRAY_SIZE(modes); mode++) {
+        pthread_t devLogThread;
+        int devLog = (modes[mode].transport == AF_LOG_TRANSPORT_DEVLOG);
+        if (devLog && devlog_start(sockPath, &devLogThread) != 0) {
+            break;
+        }
+        if (modes[mode].async) {
+            af_log_async_config_t config = {
+                0, modes[mode].overflow, modes[mode].binary ? path : NULL, 0,
+                modes[mode].transport, sockPath, "util_bench", 0
+            };
+            if (af_log_start_async(&config) < 0) {
+                fprintf(stderr, "af_log_start_async failed\n");
+                break;
+            }
+        }
+        uint64_t dropped = af_log_num_dropped();
+        int64_t allocs = bench_alloc_count();
+        double start = bench_now();
+        if (modes[mode].binary) {
+            for (j = 0; j < n; j++) {
+                AF_LOG_BINARY_OUTPUT(LOG_INFO, "I bench_message:j=%ld,name=%s,value=%d", j, "bench", (int)(j & 0xff));
+            }
+        } else {
+            for (j = 0; j < n; j++) {
+                AFLOG_INFO("bench_message:j=%ld,name=%s,value=%d", j, "bench", (int)(j & 0xff));
+            }
+        }
+        double elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        dropped = af_log_num_dropped() - dropped;
+        af_log_stop_async();
+
+        char param[64];
+        if (devLog) {
+            devlog_stop(sockPath, devLogThread);
+            snprintf(param, sizeof(param), "dropped=%llu;received=%llu", (unsigned long long)dropped, (unsigned long long)s_devLogReceived);
+        } else {
+            snprintf(param, sizeof(param), "dropped=%llu", (unsigned long long)dropped);
+        }
+        bench_report(modes[mode].name, param, 1, n, elapsed, 0, allocs);
+    }
+    unlink(path);
+}
+
+/* cost of a disabled AFLOG_DEBUG1 in a module, when the module follows
+   g_debugLevel and when its own level turns it off */
+static void run_log_level(void)
+{
+    long n = s_iterations * 100, j;
+    int mode;
+
+    for (mode = 0; mode < 2; mode++) {
+        g_debugLevel = (mode ? LOG_DEBUG4 : LOG_DEBUG_OFF);
+        af_log_set_module_level("util_bench", mode ? LOG_DEBUG_OFF : AF_LOG_LEVEL_DEFAULT);
+        uint64_t records = bench_syslog_count();
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            AFLOG_DEBUG1("bench_debug:j=%ld", j);
+        }
+        double elapsed = bench_now() - start;
+        if (bench_syslog_count() != records) {
+            fprintf(stderr, "disabled AFLOG_DEBUG1 logged\n");
+        }
+        bench_report("aflog_debug_disabled", mode ? "level=module_off" : "level=default", 1, n, elapsed, 0, 0);
+    }
+    af_log_set_module_level("util_bench", AF_LOG_LEVEL_DEFAULT);
+    g_debugLevel = LOG_DEBUG_OFF;
+}
+
+/* cost of the metrics calls the library makes on its hot paths */
+static void run_metrics(void)
+{
+    long n = s_iterations * 100, j;
+
+    double start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_metrics_add(AF_METRIC_MEMPOOL_ALLOC, 1);
+    }
+    bench_report("metrics_add", "-", 1, n, bench_now() - start, 0, 0);
+
+    start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_metrics_observe(AF_METRIC_LOG_NS, j);
+    }
+    bench_report("metrics_observe", "-", 1, n, bench_now() - start, 0, 0);
+
+    int timing;
+    for (timing = 0; timing < 2; timing++) {
+        af_metrics_set_timing(timing);
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            uint64_t t = af_metrics_timer_start();
+            af_metrics_timer_stop(AF_METRIC_LOG_NS, t);
+        }
+        bench_report("metrics_timer", timing ? "timing=on" : "timing=off", 1, n, bench_now() - start, 0, 0);
+    }
+    af_metrics_set_timing(0);
+}
+
+#define COMMAND_RSS (256 * 1024 * 1024)
+
+static void run_command(void)
+{
+    long n = s_iterations / 500, j;
+    char *argv[] = { "/bin/true", NULL };
+    int rss;
+
+    if (n < 1) {
+        n = 1;
+    }
+    /* started while the process is small */
+    int haveExec = (af_exec_start(NULL) == 0);
+    for (rss = 0; rss < 2; rss++) {
+        char *mem = NULL;
+        if (rss) {
+            /* resident memory makes fork copy more page tables */
+            mem = (char *)malloc(COMMAND_RSS);
+            if (mem == NULL) {
+                break;
+            }
+            memset(mem, 1, COMMAND_RSS);
+        }
+        const char *param = (rss ? "rss=256MB" : "rss=small");
+
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            if (system("/bin/true") != 0) {
+                fprintf(stderr, "system failed\n");
+            }
+        }
+        bench_report("command_system", param, 1, n, bench_now() - start, 0, 0);
+
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            if (af_spawn_run(argv, NULL) != 0) {
+                fprintf(stderr, "af_spawn_run failed\n");
+            }
+        }
+        bench_report("command_spawn", param, 1, n, bench_now() - start, 0, 0);
+
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            if (af_util_system("/bin/true") != 0) {
+                fprintf(stderr, "af_util_system failed\n");
+            }
+        }
+        bench_report("command_af_util_system", param, 1, n, bench_now() - start, 0, 0);
+
+        if (haveExec) {
+            af_exec_result_t result;
+            start = bench_now();
+            for (j = 0; j < n; j++) {
+                if (af_exec_run("/bin/true", 0, NULL, 0, &result) < 0 || result.status != 0) {
+                    fprintf(stderr, "af_exec_run failed\n");
+                }
+            }
+            bench_report("command_exec", param, 1, n, bench_now() - start, 0, 0);
+        }
+        free(mem);
+    }
+    af_exec_stop();
+}
+
+#define POLL_FILE "/proc/self/stat"
+
+static void run_file_read(void)
+{
+    long n = s_iterations, j;
+    char buf[1024];
+
+    double start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_util_read_file(POLL_FILE, buf, sizeof(buf));
+    }
+    bench_report("file_read", "open_each_time", 1, n, bench_now() - start, 0, 0);
+
+    af_util_file_t *file = af_util_file_open(POLL_FILE);
+    if (file == NULL) {
+        return;
+    }
+    start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_util_file_read(file, buf, sizeof(buf));
+    }
+    bench_report("file_read", "handle", 1, n, bench_now() - start, 0, 0);
+    af_util_file_close(file);
+}
+
+#define BATCH_FILES 56
+
+static void run_file_batch(void)
+{
+    static const char *names[] = {
+        "/proc/uptime", "/proc/loadavg", "/proc/self/stat", "/proc/self/statm",
+        "/proc/version", "/proc/self/status", "/proc/stat", "/proc/meminfo"
+    };
+    static char bufs[BATCH_FILES][1024];
+    af_util_read_request_t reqs[BATCH_FILES];
+    long n = s_iterations / 100, j;
+    int i;
+
+    if (n < 1) {
+        n = 1;
+    }
+    for (i = 0; i < BATCH_FILES; i++) {
+        reqs[i].filename = names[i % (sizeof(names) / sizeof(names[0]))];
+        reqs[i].buf = bufs[i];
+        reqs[i].size = sizeof(bufs[i]);
+    }
+
+    double start = bench_now();
+    for (j = 0; j < n; j++) {
+        for (i = 0; i < BATCH_FILES; i++) {
+            af_util_read_file(reqs[i].filename, reqs[i].buf, reqs[i].size);
+        }
+    }
+    bench_report("file_batch", "sequential", 1, n, bench_now() - start, 0, 0);
+
+    af_util_file_batch_t *batch = af_util_file_batch_create(BATCH_FILES);
+    if (batch == NULL) {
+        return;
+    }
+    start = bench_now();
+    for (j = 0; j < n; j++) {
+        af_util_file_batch_read(batch, reqs, BATCH_FILES);
+    }
+    bench_report("file_batch", "batch", 1, n, bench_now() - start, 0, 0);
+    for (i = 0; i < BATCH_FILES; i++) {
+        if (reqs[i].result < 0) {
+            fprintf(stderr, "batch read of %s failed: %d\n", reqs[i].filename, reqs[i].err);
+            break;
+        }
+    }
+    af_util_file_batch_destroy(batch);
+}
+
+static void run_file_cache(void)
+{
+    long n = s_iterations, j;
+    char path[] = "/tmp/util_bench_cache_XXXXXX";
+    char buf[256];
+    int cached;
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    if (write(fd, "enabled=1\n", 10) != 10) {
+        perror("write");
+    }
+    close(fd);
+
+    for (cached = 0; cached < 2; cached++) {
+        if (cached && af_util_cache_enable(64) < 0) {
+            break;
+        }
+        const char *param = (cached ? "cache=on" : "cache=off");
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_file_exists(path);
+        }
+        bench_report("file_cache_exists", param, 1, n, bench_now() - start, 0, 0);
+
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_util_read_file(path, buf, sizeof(buf));
+        }
+        bench_report("file_cache_read", param, 1, n, bench_now() - start, 0, 0);
+    }
+    af_util_cache_disable();
+    unlink(path);
+}
+
+static int write_kvp_file(const char *path, int numLines, af_key_value_pair_t *pairs)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < numLines; i++) {
+        if (i % 8 == 0) {
+            fprintf(f, "# comment line %d\n", i);
+        } else {
+            fprintf(f, "%s='value_%d'\n", pairs[i % NUM_KEYS].key, i);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void run_kvp(void)
+{
+    af_key_value_pair_t pairs[NUM_KEYS];
+    af_kvp_view_t views[NUM_KEYS];
+    char path[] = "/tmp/util_bench_XXXXXX";
+    char param[64];
+    int i;
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        snprintf(pairs[i].key, sizeof(pairs[i].key), "BENCH_KEY_%02d", i);
+        views[i].key = pairs[i].key;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s_kvpLines); i++) {
+        int numLines = s_kvpLines[i];
+        if (write_kvp_file(path, numLines, pairs) < 0) {
+            perror("write_kvp_file");
+            break;
+        }
+        long size = numLines * 24L;
+        long n = s_iterations * 64 / size, j;
+        if (n < 4) {
+            n = 4;
+        }
+        snprintf(param, sizeof(param), "lines=%d", numLines);
+
+        int64_t allocs = bench_alloc_count();
+        double start = bench_now();
+        for (j = 0; j < n; j++) {
+            if (af_util_parse_key_value_pair_file(path, pairs, NUM_KEYS) < 0) {
+                fprintf(stderr, "af_util_parse_key_value_pair_file failed\n");
+                break;
+            }
+        }
+        double elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        /* one op is one line parsed */
+        bench_report("kvp_parse", param, 1, (double)n * numLines, elapsed, 0, allocs);
+
+        allocs = bench_alloc_count();
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            af_kvp_file_t *file = af_util_kvp_open(path, views, NUM_KEYS);
+            if (file == NULL) {
+                fprintf(stderr, "af_util_kvp_open failed\n");
+                break;
+            }
+            af_util_kvp_close(file);
+        }
+        elapsed = bench_now() - start;
+        allocs = (allocs < 0 ? -1 : bench_alloc_count() - allocs);
+        bench_report("kvp_view", param, 1, (double)n * numLines, elapsed, 0, allocs);
+    }
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    s_iterations = (argc > 1 ? atol(argv[1]) : 100000);
+    if (s_iterations < 1) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int i;
+    srandom(1);
+    for (i = 0; i < sizeof(s_data); i++) {
+        s_data[i] = random();
+    }
+
+    bench_print_header();
+    run_hex();
+    run_hex_stream();
+    run_log();
+    run_log_async();
+    run_log_level();
+    run_metrics();
+    run_command();
+    run_file_read();
+    run_file_batch();
+    run_file_cache();
+    run_kvp();
+    return 0;
+}
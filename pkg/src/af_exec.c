@@ -0,0 +1,578 @@
+//
+// af_exec.c -- runs shell commands in a helper process
+//
+// The helper is connected to this process by a socket pair. For each
+// command the caller makes a new socket pair and sends one end to the
+// helper with the request, so the reply comes back on a socket only the
+// caller reads, and callers in different threads don't need to sort out
+// each other's replies.
+//
+// The helper is single threaded. It polls the control socket, the output
+// pipes of the running commands, and a signalfd for SIGCHLD, and doesn't
+// log: the logging state it inherited belongs to the parent.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define AF_LOG_MODULE "util"
+#include "af_log.h"
+#include "af_exec.h"
+
+#define DEFAULT_MAX_RUNNING 4
+#define DEFAULT_TIMEOUT_MS  30000
+#define DEFAULT_MAX_OUTPUT  4096
+#define MAX_RUNNING         64
+
+typedef struct {
+    uint32_t timeoutMs;
+    /* followed by the command, NUL terminated */
+} prv_request_t;
+
+typedef struct {
+    int32_t status;
+    int32_t err;          /* errno if the command couldn't be started */
+    uint32_t timedOut;
+    uint32_t outputLen;   /* bytes that follow */
+    uint64_t totalLen;    /* bytes the command wrote */
+} prv_reply_t;
+
+typedef struct {
+    pid_t pid;            /* 0 if the slot is free */
+    int outFd;            /* -1 once closed */
+    int replyFd;
+    int timedOut;
+    int status;
+    uint64_t deadline;    /* milliseconds on the monotonic clock */
+    uint32_t outputLen;
+    uint64_t totalLen;
+    char *output;
+} prv_command_t;
+
+static pthread_rwlock_t s_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int s_ctrl = -1;
+static pid_t s_helper;
+static int s_useForSystem;
+
+/* helper state */
+static prv_command_t *s_commands;
+static uint32_t s_maxRunning;
+static uint32_t s_numRunning;
+static uint32_t s_timeoutMs;
+static uint32_t s_maxOutput;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void send_reply(int fd, prv_reply_t *reply, const char *output)
+{
+    struct iovec iov[2] = {
+        { reply, sizeof(*reply) },
+        { (void *)output, reply->outputLen }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    /* the caller may have gone away; nothing to do about it */
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static void command_start(prv_command_t *c, const char *cmd, uint32_t timeoutMs, int replyFd)
+{
+    int pipeFds[2];
+    prv_reply_t reply;
+
+    memset(&reply, 0, sizeof(reply));
+    if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+        reply.err = errno;
+        send_reply(replyFd, &reply, NULL);
+        close(replyFd);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* undo what the helper and its parent did to signals */
+        sigset_t mask;
+        int sig;
+        for (sig = 1; sig < NSIG; sig++) {
+            signal(sig, SIG_DFL);
+        }
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        setpgid(0, 0);
+
+        int nullFd = open("/dev/null", O_RDONLY);
+        if (nullFd >= 0) {
+            dup2(nullFd, 0);
+        }
+        dup2(pipeFds[1], 1);
+        dup2(pipeFds[1], 2);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(pipeFds[1]);
+    if (pid < 0) {
+        reply.err = errno;
+        send_reply(replyFd, &reply, NULL);
+        close(pipeFds[0]);
+        close(replyFd);
+        return;
+    }
+    /* in case the child hasn't set it yet when we have to kill it */
+    setpgid(pid, pid);
+    fcntl(pipeFds[0], F_SETFL, O_NONBLOCK);
+
+    c->pid = pid;
+    c->outFd = pipeFds[0];
+    c->replyFd = replyFd;
+    c->timedOut = 0;
+    c->status = 0;
+    c->deadline = now_ms() + (timeoutMs ? timeoutMs : s_timeoutMs);
+    c->outputLen = 0;
+    c->totalLen = 0;
+    s_numRunning++;
+}
+
+/* reads what's in the command's pipe, keeping what fits */
+static void command_read(prv_command_t *c)
+{
+    char discard[4096];
+    while (c->outFd >= 0) {
+        char *buf = discard;
+        size_t size = sizeof(discard);
+        if (c->outputLen < s_maxOutput) {
+            buf = c->output + c->outputLen;
+            size = s_maxOutput - c->outputLen;
+        }
+        ssize_t n = read(c->outFd, buf, size);
+        if (n > 0) {
+            if (buf != discard) {
+                c->outputLen += n;
+            }
+            c->totalLen += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0) {
+                close(c->outFd);
+                c->outFd = -1;
+            }
+            break;
+        }
+    }
+}
+
+static void command_finish(prv_command_t *c)
+{
+    /* everything the shell wrote is in the pipe by now; anything it left
+       running in the background doesn't hold up the reply */
+    command_read(c);
+    if (c->outFd >= 0) {
+        close(c->outFd);
+        c->outFd = -1;
+    }
+
+    prv_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = c->status;
+    reply.timedOut = c->timedOut;
+    reply.outputLen = c->outputLen;
+    reply.totalLen = c->totalLen;
+    send_reply(c->replyFd, &reply, c->output);
+    close(c->replyFd);
+    c->pid = 0;
+    s_numRunning--;
+}
+
+static void reap(void)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        uint32_t i;
+        for (i = 0; i < s_maxRunning; i++) {
+            if (s_commands[i].pid == pid) {
+                s_commands[i].status = status;
+                command_finish(&s_commands[i]);
+                break;
+            }
+        }
+    }
+}
+
+/* receives a request and starts it; returns -1 when the parent has closed
+   the control socket */
+static int receive_request(int ctrl)
+{
+    static char buf[sizeof(prv_request_t) + AF_EXEC_MAX_COMMAND];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(ctrl, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return (n < 0 && errno == EINTR ? 0 : -1);
+    }
+
+    int replyFd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&replyFd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (replyFd < 0) {
+        return 0;
+    }
+    if (n < sizeof(prv_request_t) + 1) {
+        close(replyFd);
+        return 0;
+    }
+    buf[n] = '\0';
+
+    prv_request_t req;
+    memcpy(&req, buf, sizeof(req));
+    uint32_t i;
+    for (i = 0; i < s_maxRunning; i++) {
+        if (s_commands[i].pid == 0) {
+            command_start(&s_commands[i], buf + sizeof(req), req.timeoutMs, replyFd);
+            break;
+        }
+    }
+    return 0;
+}
+
+static void helper_main(int ctrl)
+{
+    struct pollfd fds[MAX_RUNNING + 2];
+    int running = 1;
+    sigset_t mask;
+
+    /* don't hold on to anything the parent had open */
+    int fd, maxFd = sysconf(_SC_OPEN_MAX);
+    for (fd = 3; fd < maxFd && fd < 65536; fd++) {
+        if (fd != ctrl) {
+            close(fd);
+        }
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigFd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigFd < 0) {
+        _exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+
+    while (running || s_numRunning > 0) {
+        int n = 0;
+        fds[n].fd = sigFd;
+        fds[n++].events = POLLIN;
+        if (running && s_numRunning < s_maxRunning) {
+            fds[n].fd = ctrl;
+            fds[n++].events = POLLIN;
+        }
+
+        uint64_t now = now_ms();
+        int timeout = -1;
+        uint32_t i;
+        for (i = 0; i < s_maxRunning; i++) {
+            prv_command_t *c = &s_commands[i];
+            if (c->pid == 0) {
+                continue;
+            }
+            if (c->outFd >= 0) {
+                fds[n].fd = c->outFd;
+                fds[n++].events = POLLIN;
+            }
+            if (!c->timedOut) {
+                if (now >= c->deadline) {
+                    kill(-c->pid, SIGKILL);
+                    c->timedOut = 1;
+                } else if (timeout < 0 || c->deadline - now < timeout) {
+                    timeout = c->deadline - now;
+                }
+            }
+        }
+
+        if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+            _exit(1);
+        }
+
+        for (i = 0; i < s_maxRunning; i++) {
+            if (s_commands[i].pid && s_commands[i].outFd >= 0) {
+                command_read(&s_commands[i]);
+            }
+        }
+
+        struct signalfd_siginfo si;
+        while (read(sigFd, &si, sizeof(si)) > 0) {
+            ;
+        }
+        reap();
+
+        if (running && n > 1 && fds[1].fd == ctrl && fds[1].revents) {
+            if (receive_request(ctrl) < 0) {
+                running = 0;
+            }
+        }
+    }
+    _exit(0);
+}
+
+int af_exec_start(const af_exec_config_t *config)
+{
+    af_exec_config_t defaults;
+    if (config == NULL) {
+        memset(&defaults, 0, sizeof(defaults));
+        config = &defaults;
+    }
+    if (config->maxRunning > MAX_RUNNING || config->maxOutput > AF_EXEC_MAX_OUTPUT) {
+        AFLOG_ERR("af_exec_start_param:maxRunning=%u,maxOutput=%u", config->maxRunning, config->maxOutput);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&s_lock);
+    if (s_ctrl >= 0) {
+        pthread_rwlock_unlock(&s_lock);
+        AFLOG_ERR("af_exec_start_running");
+        errno = EALREADY;
+        return -1;
+    }
+
+    s_maxRunning = (config->maxRunning ? config->maxRunning : DEFAULT_MAX_RUNNING);
+    s_timeoutMs = (config->timeoutMs ? config->timeoutMs : DEFAULT_TIMEOUT_MS);
+    s_maxOutput = (config->maxOutput ? config->maxOutput : DEFAULT_MAX_OUTPUT);
+
+    /* allocated here so the helper doesn't have to */
+    s_commands = (prv_command_t *)calloc(s_maxRunning, sizeof(prv_command_t));
+    char *output = (char *)malloc(s_maxRunning * s_maxOutput);
+    int fds[2] = { -1, -1 };
+    if (s_commands == NULL || output == NULL || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        int err = (s_commands && output ? errno : ENOMEM);
+        pthread_rwlock_unlock(&s_lock);
+        AFLOG_ERR("af_exec_start_alloc:errno=%d", err);
+        free(s_commands);
+        free(output);
+        s_commands = NULL;
+        errno = err;
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < s_maxRunning; i++) {
+        s_commands[i].output = output + i * s_maxOutput;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        helper_main(fds[1]);
+    }
+    int err = errno;
+    close(fds[1]);
+
+    /* the parent doesn't use the helper state */
+    free(s_commands);
+    free(output);
+    s_commands = NULL;
+
+    if (pid < 0) {
+        pthread_rwlock_unlock(&s_lock);
+        close(fds[0]);
+        AFLOG_ERR("af_exec_start_fork:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+    s_ctrl = fds[0];
+    s_helper = pid;
+    __atomic_store_n(&s_useForSystem, config->useForSystem != 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&s_lock);
+
+    AFLOG_INFO("af_exec_started:pid=%d,maxRunning=%u,timeoutMs=%u", pid, s_maxRunning, s_timeoutMs);
+    return 0;
+}
+
+void af_exec_stop(void)
+{
+    pthread_rwlock_wrlock(&s_lock);
+    int ctrl = s_ctrl;
+    pid_t pid = s_helper;
+    s_ctrl = -1;
+    s_helper = 0;
+    __atomic_store_n(&s_useForSystem, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&s_lock);
+
+    if (ctrl >= 0) {
+        close(ctrl);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+            ;
+        }
+    }
+}
+
+/* forgets a helper whose control socket has closed and reaps it, unless
+   af_exec_stop or another caller has already done so */
+static void helper_died(pid_t pid)
+{
+    pthread_rwlock_wrlock(&s_lock);
+    int forget = (s_ctrl >= 0 && s_helper == pid);
+    if (forget) {
+        close(s_ctrl);
+        s_ctrl = -1;
+        s_helper = 0;
+        __atomic_store_n(&s_useForSystem, 0, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s_lock);
+
+    if (forget) {
+        AFLOG_ERR("af_exec_helper_died:pid=%d", pid);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+            ;
+        }
+    }
+}
+
+int af_exec_used_for_system(void)
+{
+    return __atomic_load_n(&s_useForSystem, __ATOMIC_RELAXED);
+}
+
+int af_exec_run(const char *cmd, uint32_t timeoutMs, char *output, size_t outputSize, af_exec_result_t *result)
+{
+    if (cmd == NULL || result == NULL) {
+        AFLOG_ERR("af_exec_run_param:cmd_NULL=%d,result_NULL=%d", cmd == NULL, result == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t len = strlen(cmd) + 1;
+    if (len > AF_EXEC_MAX_COMMAND) {
+        AFLOG_ERR("af_exec_run_too_long:len=%zu", len);
+        errno = E2BIG;
+        return -1;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        int err = errno;
+        AFLOG_ERR("af_exec_run_socketpair:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+
+    prv_request_t req = { timeoutMs };
+    struct iovec iov[2] = {
+        { &req, sizeof(req) },
+        { (void *)cmd, len }
+    };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fds[1], sizeof(int));
+
+    /* the send blocks while the helper is too busy to take requests, so
+       it's made on a duplicate of the control socket without the lock */
+    int ctrl = -1, err = ESRCH;
+    pid_t helper = 0;
+    pthread_rwlock_rdlock(&s_lock);
+    if (s_ctrl >= 0) {
+        ctrl = fcntl(s_ctrl, F_DUPFD_CLOEXEC, 0);
+        err = errno;
+        helper = s_helper;
+    }
+    pthread_rwlock_unlock(&s_lock);
+
+    ssize_t n = -1;
+    if (ctrl >= 0) {
+        do {
+            n = sendmsg(ctrl, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        err = (n < 0 ? (errno == ECONNRESET ? EPIPE : errno) : 0);
+        close(ctrl);
+    }
+    close(fds[1]);
+    if (n < 0) {
+        close(fds[0]);
+        if (err == EPIPE) {
+            helper_died(helper);
+        } else if (err != ESRCH) {
+            AFLOG_ERR("af_exec_run_send:errno=%d", err);
+        }
+        errno = err;
+        return -1;
+    }
+
+    /* read the reply header and the output up to what the caller wants */
+    prv_reply_t reply;
+    char discard[1];
+    struct iovec replyIov[2] = {
+        { &reply, sizeof(reply) },
+        { output ? output : discard, output && outputSize ? outputSize - 1 : 0 }
+    };
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = replyIov;
+    msg.msg_iovlen = 2;
+    do {
+        n = recvmsg(fds[0], &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    err = errno;
+    close(fds[0]);
+
+    if (n < (ssize_t)sizeof(reply)) {
+        /* the helper closed our socket without replying */
+        err = (n < 0 ? err : EPIPE);
+        AFLOG_ERR("af_exec_run_reply:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+    if (output && outputSize) {
+        output[n - sizeof(reply)] = '\0';
+    }
+    if (reply.err) {
+        AFLOG_ERR("af_exec_run_start:errno=%d", reply.err);
+        errno = reply.err;
+        return -1;
+    }
+
+    result->status = reply.status;
+    result->timedOut = reply.timedOut;
+    result->outputLen = reply.totalLen;
+    AFLOG_DEBUG2("af_exec_run:status=%d,timedOut=%d,outputLen=%zu", result->status, result->timedOut, result->outputLen);
+    return 0;
+}
@@ -0,0 +1,65 @@
+//
+// af_exec.h -- runs shell commands in a helper process
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __AF_EXEC_H__
+#define __AF_EXEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* af_exec_start forks a helper process that runs commands for this one.
+   Call it early, while the process is still small and before it starts
+   threads or asynchronous logging; after that, commands are started by
+   the helper, so the process is never forked again however large it
+   grows.
+
+   Each command is run with /bin/sh -c in its own process group, with
+   standard input from /dev/null and standard output and error captured
+   together. The helper runs up to maxRunning commands at once; further
+   requests wait their turn. A command still running after its timeout is
+   killed with its process group.
+
+   If useForSystem is set, af_util_system sends its commands to the
+   helper; their output is discarded. */
+
+#define AF_EXEC_MAX_COMMAND 16384   /* longest command, including the NUL */
+#define AF_EXEC_MAX_OUTPUT  65536   /* most output returned for a command */
+
+typedef struct {
+    uint32_t maxRunning;   /* commands run at once; 0 means 4 */
+    uint32_t timeoutMs;    /* timeout for commands that don't give one; 0 means 30 seconds */
+    uint32_t maxOutput;    /* output returned per command; 0 means 4096 */
+    int useForSystem;
+} af_exec_config_t;
+
+typedef struct {
+    int status;            /* wait status of the shell, as from waitpid */
+    int timedOut;          /* the command was killed because it timed out */
+    size_t outputLen;      /* bytes of output the command wrote, which can be
+                              more than were returned */
+} af_exec_result_t;
+
+/* starts the helper. config may be NULL for the defaults. returns -1 with
+   errno set on failure, including EALREADY if the helper is running */
+int af_exec_start(const af_exec_config_t *config);
+
+/* stops the helper after the commands it's running finish */
+void af_exec_stop(void);
+
+/* returns nonzero if the helper is running and af_util_system uses it */
+int af_exec_used_for_system(void);
+
+/* runs cmd in the helper and waits for it. timeoutMs 0 means the
+   configured timeout. Up to outputSize - 1 bytes of output are copied to
+   output, which is NUL terminated; output may be NULL. result gets the
+   status. returns 0 if the command ran, or -1 with errno set: ESRCH if
+   the helper isn't running, E2BIG if the command is too long, and EPIPE
+   if the helper died. A helper found dead is reaped and forgotten, so
+   later calls fail with ESRCH, af_util_system runs its commands itself,
+   and af_exec_start can start a new helper */
+int af_exec_run(const char *cmd, uint32_t timeoutMs, char *output, size_t outputSize, af_exec_result_t *result);
+
+#endif // __AF_EXEC_H__
@@ -0,0 +1,1060 @@
+//
+// af_log.c -- log output for the AFLOG_* macros
+//
+// Messages go straight to syslog unless af_log_start_async has been
+// called. In async mode the calling thread formats the message into a
+// slot of a bounded multi-producer ring and a background thread drains
+// the ring to syslog, so a slow syslog daemon, or the libc syslog lock,
+// never holds up the caller.
+//
+// In binary mode the background thread appends records to a file instead.
+// Messages logged through af_log_binary are recorded without being
+// formatted: the site's ID, a timestamp, and the arguments packed as
+// described in log_binary.h. The definition of each site is written to
+// the file by the background thread the first time it sees the site.
+//
+// With the /dev/log transport the background thread skips syslog(3) and
+// sends the messages itself on a datagram socket it keeps connected,
+// several at a time with sendmmsg. Each message is sent as three pieces:
+// the priority, the timestamp and ident, which change at most once a
+// second, and the message, so nothing is formatted per message.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#define _GNU_SOURCE                 /* sendmmsg, program_invocation_short_name */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "af_log.h"
+#include "log_binary.h"
+#include "af_metrics.h"
+
+#define DEFAULT_NUM_SLOTS 1024
+#define DRAIN_IDLE_MS     100      /* longest the drain thread sleeps without a wakeup */
+#define BLOCK_WAIT_MS     10       /* longest a blocked producer waits before retrying */
+#define BINARY_BUF_SIZE   65536    /* binary records are written to the file in batches up to this size */
+#define DRAIN_BATCH       64       /* messages released, and sent to /dev/log, at a time */
+#define DEVLOG_PATH       "/dev/log"
+#define DEVLOG_RETRY_SECS 1        /* how often to try to reconnect while syslogd is away */
+
+/* site states */
+#define SITE_NEW          0
+#define SITE_REGISTERING  1        /* another thread is parsing the format */
+#define SITE_READY        2
+#define SITE_TEXT         3        /* format can't be recorded in binary */
+
+/* seq is the ring position the slot is ready for: a producer may fill the
+   slot when seq equals the enqueue position, and the consumer may read it
+   when seq is one past its dequeue position */
+typedef struct {
+    uint64_t seq;
+    int priority;
+    uint32_t len;
+    char msg[AF_LOG_ASYNC_MSG_SIZE];
+} prv_slot_t;
+
+typedef struct {
+    prv_slot_t *slots;
+    uint32_t mask;
+    uint32_t overflow;
+    uint64_t enqPos __attribute__((aligned(64)));  /* next position to reserve */
+    uint64_t deqPos __attribute__((aligned(64)));  /* next position to drain; drain thread only */
+    uint64_t numDrained;             /* messages written out; read by af_log_flush */
+    uint64_t numDropped;
+    uint64_t numDroppedReported;     /* drain thread only */
+
+    pthread_t thread;
+    pthread_mutex_t lock;            /* protects the condition variables and stop */
+    pthread_cond_t drainCond;        /* wakes the drain thread */
+    pthread_cond_t spaceCond;        /* wakes blocked producers */
+    pthread_cond_t flushCond;        /* wakes af_log_flush */
+    int sleeping;                    /* drain thread is waiting on drainCond */
+    int numBlocked;                  /* producers waiting on spaceCond */
+    int stop;
+
+    /* binary mode; everything but binary is used by the drain thread only */
+    int binary;
+    int fd;
+    char *path;
+    char *rotatePath;
+    uint64_t maxBytes;
+    uint64_t fileBytes;
+    uint32_t fileRecords;            /* messages in the current file */
+    char *buf;
+    uint32_t bufLen;
+    int writeFailed;
+    af_log_site_t *sitesWritten;     /* newest site whose definition is in the file */
+
+    /* /dev/log transport; drain thread only */
+    int devLog;
+    int sock;
+    struct sockaddr_un devLogAddr;
+    time_t lastConnect;              /* monotonic time of the last failed connect */
+    int facility;
+    char priHeader[8][8];            /* "<PRI>" for each priority with the facility */
+    char ident[48];                  /* "ident[pid]: " */
+    time_t stampSecs;
+    char stamp[80];                  /* "Mmm dd hh:mm:ss ident[pid]: " for stampSecs */
+    uint32_t stampLen;
+} prv_async_t;
+
+static prv_async_t *s_async;
+static pthread_mutex_t s_moduleLock = PTHREAD_MUTEX_INITIALIZER;
+static af_log_module_t *s_modules;  /* protected by s_moduleLock */
+static af_log_site_t *s_sites;      /* registered sites, newest first */
+static uint32_t s_lastSiteId;
+static pthread_once_t s_forkOnce = PTHREAD_ONCE_INIT;
+
+/* writes one message out; called by the drain thread or by the logging
+   thread itself when logging is synchronous */
+static void log_output(int priority, const char *msg)
+{
+    syslog(priority, "%s", msg);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void deadline(struct timespec *ts, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += (long)ms * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec += ts->tv_nsec / 1000000000;
+        ts->tv_nsec %= 1000000000;
+    }
+}
+
+/* reserves a slot; returns NULL if the ring is full and the policy is to drop */
+static prv_slot_t *ring_reserve(prv_async_t *a)
+{
+    uint64_t pos = __atomic_load_n(&a->enqPos, __ATOMIC_RELAXED);
+    while (1) {
+        prv_slot_t *slot = &a->slots[pos & a->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&a->enqPos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            /* the slot still holds a message from the previous lap; full */
+            if (a->overflow == AF_LOG_OVERFLOW_DROP) {
+                __atomic_fetch_add(&a->numDropped, 1, __ATOMIC_RELAXED);
+                AF_METRIC_INC(AF_METRIC_LOG_DROPPED);
+                return NULL;
+            }
+            struct timespec ts;
+            deadline(&ts, BLOCK_WAIT_MS);
+            pthread_mutex_lock(&a->lock);
+            a->numBlocked++;
+            pthread_cond_signal(&a->drainCond);
+            pthread_cond_timedwait(&a->spaceCond, &a->lock, &ts);
+            a->numBlocked--;
+            pthread_mutex_unlock(&a->lock);
+            pos = __atomic_load_n(&a->enqPos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&a->enqPos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void ring_publish(prv_async_t *a, prv_slot_t *slot)
+{
+    uint64_t pos = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    /* sequentially consistent so that either the drain thread sees the
+       message before it sleeps or we see that it's sleeping */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&a->lock);
+        pthread_cond_signal(&a->drainCond);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+static int binary_open(prv_async_t *a);
+
+static void binary_flush(prv_async_t *a)
+{
+    uint32_t pos = 0;
+    while (pos < a->bufLen) {
+        ssize_t n = write(a->fd, a->buf + pos, a->bufLen - pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* report the first failure only; a full disk would otherwise
+               log once per batch */
+            if (!a->writeFailed) {
+                AFLOG_ERR("af_log_binary_write:errno=%d", errno);
+                a->writeFailed = 1;
+            }
+            break;
+        }
+        pos += n;
+    }
+    if (pos == a->bufLen) {
+        a->writeFailed = 0;
+    }
+    a->fileBytes += pos;
+    a->bufLen = 0;
+}
+
+/* starts a new file if a record of len bytes would take the current one
+   past maxBytes; every file gets at least one record, so a record is
+   never held back */
+static void binary_rotate_for(prv_async_t *a, uint32_t len)
+{
+    if (a->maxBytes == 0 || a->fileRecords == 0 || a->fileBytes + a->bufLen + len <= a->maxBytes) {
+        return;
+    }
+    binary_flush(a);
+    close(a->fd);
+    if (rename(a->path, a->rotatePath) < 0) {
+        AFLOG_ERR("af_log_binary_rename:errno=%d", errno);
+    }
+    if (binary_open(a) < 0) {
+        /* keep going with no file; writes fail quietly until the next stop */
+        a->fd = -1;
+        a->maxBytes = 0;
+    }
+}
+
+static void binary_append(prv_async_t *a, const void *data, uint32_t len)
+{
+    if (a->bufLen + len > BINARY_BUF_SIZE) {
+        binary_flush(a);
+    }
+    memcpy(a->buf + a->bufLen, data, len);
+    a->bufLen += len;
+}
+
+static void binary_append_text(prv_async_t *a, int priority, const char *msg)
+{
+    log_binary_record_t rec;
+    uint32_t len = strlen(msg);
+    if (len > AF_LOG_ASYNC_MSG_SIZE - sizeof(rec)) {
+        len = AF_LOG_ASYNC_MSG_SIZE - sizeof(rec);
+    }
+    rec.len = sizeof(rec) + len;
+    rec.kind = LOG_BINARY_KIND_TEXT;
+    rec.priority = priority;
+    rec.siteId = 0;
+    rec.timestamp = now_ns();
+    binary_rotate_for(a, rec.len);
+    binary_append(a, &rec, sizeof(rec));
+    binary_append(a, msg, len);
+    a->fileRecords++;
+}
+
+/* writes the definitions of the sites registered since the last call */
+static void binary_append_sites(prv_async_t *a)
+{
+    af_log_site_t *head = __atomic_load_n(&s_sites, __ATOMIC_ACQUIRE), *site;
+
+    for (site = head; site != a->sitesWritten; site = site->next) {
+        log_binary_record_t rec;
+        uint32_t len = strlen(site->format) + 1;
+        rec.len = sizeof(rec) + len;
+        rec.kind = LOG_BINARY_KIND_SITE;
+        rec.priority = site->priority;
+        rec.siteId = site->id;
+        rec.timestamp = 0;
+        binary_append(a, &rec, sizeof(rec));
+        binary_append(a, site->format, len);
+    }
+    a->sitesWritten = head;
+}
+
+/* opens the file and starts a session with the header and every site
+   registered so far, so each file can be decoded on its own */
+static int binary_open(prv_async_t *a)
+{
+    a->fd = open(a->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (a->fd < 0) {
+        int err = errno;
+        AFLOG_ERR("af_log_binary_open:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+    struct stat st;
+    a->fileBytes = (fstat(a->fd, &st) == 0 ? st.st_size : 0);
+
+    log_binary_file_header_t header;
+    memcpy(header.magic, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN);
+    header.byteOrder = LOG_BINARY_BYTE_ORDER;
+    header.version = LOG_BINARY_VERSION;
+    binary_append(a, &header, sizeof(header));
+    a->sitesWritten = NULL;
+    a->fileRecords = 0;
+    binary_append_sites(a);
+    return 0;
+}
+
+/* connects to syslogd's socket; gives up without trying if the last
+   attempt failed less than DEVLOG_RETRY_SECS ago */
+static int devlog_connect(prv_async_t *a)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (a->lastConnect && now.tv_sec - a->lastConnect < DEVLOG_RETRY_SECS) {
+        return -1;
+    }
+
+    a->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (a->sock < 0) {
+        a->lastConnect = now.tv_sec;
+        return -1;
+    }
+    if (connect(a->sock, (struct sockaddr *)&a->devLogAddr, sizeof(a->devLogAddr)) < 0) {
+        close(a->sock);
+        a->sock = -1;
+        /* 0 means no failure, so keep it nonzero */
+        a->lastConnect = (now.tv_sec ? now.tv_sec : 1);
+        return -1;
+    }
+    a->lastConnect = 0;
+    return 0;
+}
+
+/* rebuilds the timestamp and ident part of the header if the second has changed */
+static void devlog_update_stamp(prv_async_t *a)
+{
+    time_t now = time(NULL);
+    if (now == a->stampSecs && a->stampLen) {
+        return;
+    }
+    struct tm tm;
+    localtime_r(&now, &tm);
+    size_t len = strftime(a->stamp, sizeof(a->stamp), "%h %e %T ", &tm);
+    a->stampLen = len + snprintf(a->stamp + len, sizeof(a->stamp) - len, "%s", a->ident);
+    a->stampSecs = now;
+}
+
+/* sends n messages to syslogd. If the send fails because syslogd went away
+   it reconnects and sends the rest; if it can't reconnect the messages go
+   through syslog(3) instead so they aren't lost. */
+static void devlog_send(prv_async_t *a, prv_slot_t **slots, uint32_t n)
+{
+    struct mmsghdr msgs[DRAIN_BATCH];
+    struct iovec iov[DRAIN_BATCH][3];
+    char pri[DRAIN_BATCH][16];
+    uint32_t i, sent = 0;
+
+    devlog_update_stamp(a);
+    for (i = 0; i < n; i++) {
+        int priority = slots[i]->priority;
+        if ((priority & ~LOG_PRIMASK) == 0) {
+            iov[i][0].iov_base = a->priHeader[priority];
+            iov[i][0].iov_len = strlen(a->priHeader[priority]);
+        } else {
+            iov[i][0].iov_base = pri[i];
+            iov[i][0].iov_len = snprintf(pri[i], sizeof(pri[i]), "<%d>", priority);
+        }
+        iov[i][1].iov_base = a->stamp;
+        iov[i][1].iov_len = a->stampLen;
+        iov[i][2].iov_base = slots[i]->msg;
+        iov[i][2].iov_len = slots[i]->len;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 3;
+    }
+
+    int reconnected = 0;
+    while (sent < n) {
+        if (a->sock < 0 && devlog_connect(a) < 0) {
+            break;
+        }
+        int r = sendmmsg(a->sock, msgs + sent, n - sent, 0);
+        if (r > 0) {
+            sent += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EMSGSIZE) {
+            /* too long for the socket; syslog(3) would lose it too */
+            sent++;
+        } else if (!reconnected) {
+            /* syslogd restarted or went away; connect to the new socket */
+            close(a->sock);
+            a->sock = -1;
+            reconnected = 1;
+        } else {
+            close(a->sock);
+            a->sock = -1;
+            break;
+        }
+    }
+
+    for (i = sent; i < n; i++) {
+        log_output(slots[i]->priority, slots[i]->msg);
+    }
+}
+
+static void output_batch(prv_async_t *a, prv_slot_t **slots, uint32_t n)
+{
+    uint32_t i;
+    if (a->binary) {
+        /* the batch's sites were registered before their messages were
+           queued, so their definitions go in ahead of the events */
+        binary_append_sites(a);
+        for (i = 0; i < n; i++) {
+            binary_rotate_for(a, slots[i]->len);
+            binary_append(a, slots[i]->msg, slots[i]->len);
+            a->fileRecords++;
+        }
+    } else if (a->devLog) {
+        devlog_send(a, slots, n);
+    } else {
+        for (i = 0; i < n; i++) {
+            log_output(slots[i]->priority, slots[i]->msg);
+        }
+    }
+}
+
+/* writes out every published message; returns the number written */
+static uint32_t ring_drain(prv_async_t *a)
+{
+    uint32_t count = 0;
+    while (1) {
+        /* collect a batch of published messages, write them out, then
+           hand their slots back to the producers */
+        prv_slot_t *batch[DRAIN_BATCH];
+        uint32_t n = 0, i;
+        while (n < DRAIN_BATCH) {
+            prv_slot_t *slot = &a->slots[(a->deqPos + n) & a->mask];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != a->deqPos + n + 1) {
+                break;
+            }
+            batch[n++] = slot;
+        }
+        if (n == 0) {
+            break;
+        }
+        output_batch(a, batch, n);
+        for (i = 0; i < n; i++) {
+            __atomic_store_n(&batch[i]->seq, a->deqPos + i + a->mask + 1, __ATOMIC_RELEASE);
+        }
+        a->deqPos += n;
+        count += n;
+    }
+
+    uint64_t numDropped = __atomic_load_n(&a->numDropped, __ATOMIC_RELAXED);
+    if (numDropped != a->numDroppedReported) {
+        prv_slot_t notice, *slot = &notice;
+        notice.priority = LOG_WARNING;
+        notice.len = snprintf(notice.msg, sizeof(notice.msg), "W af_log_dropped:count=%llu", (unsigned long long)(numDropped - a->numDroppedReported));
+        if (a->binary) {
+            binary_append_text(a, LOG_WARNING, notice.msg);
+        } else {
+            output_batch(a, &slot, 1);
+        }
+        a->numDroppedReported = numDropped;
+    }
+
+    if (a->binary && a->bufLen) {
+        binary_flush(a);
+    }
+
+    if (count) {
+        __atomic_add_fetch(&a->numDrained, count, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&a->lock);
+        if (a->numBlocked) {
+            pthread_cond_broadcast(&a->spaceCond);
+        }
+        pthread_cond_broadcast(&a->flushCond);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return count;
+}
+
+static void *drain_thread(void *arg)
+{
+    prv_async_t *a = (prv_async_t *)arg;
+
+    while (1) {
+        if (ring_drain(a)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        if (a->stop) {
+            pthread_mutex_unlock(&a->lock);
+            break;
+        }
+        __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+        prv_slot_t *slot = &a->slots[a->deqPos & a->mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != a->deqPos + 1) {
+            struct timespec ts;
+            deadline(&ts, DRAIN_IDLE_MS);
+            pthread_cond_timedwait(&a->drainCond, &a->lock, &ts);
+        }
+        __atomic_store_n(&a->sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    /* write out anything published while stopping */
+    ring_drain(a);
+    return NULL;
+}
+
+static void log_vprintf(int priority, const char *format, va_list ap)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    if (a == NULL || pthread_equal(pthread_self(), a->thread)) {
+        vsyslog(priority, format, ap);
+        return;
+    }
+
+    prv_slot_t *slot = ring_reserve(a);
+    if (slot == NULL) {
+        return;
+    }
+    if (a->binary) {
+        /* text record; the message isn't NUL terminated */
+        log_binary_record_t rec;
+        char *msg = slot->msg + sizeof(rec);
+        uint32_t size = sizeof(slot->msg) - sizeof(rec);
+        int len = vsnprintf(msg, size, format, ap);
+        len = (len < 0 ? 0 : (len >= size ? size - 1 : len));
+        rec.len = sizeof(rec) + len;
+        rec.kind = LOG_BINARY_KIND_TEXT;
+        rec.priority = priority;
+        rec.siteId = 0;
+        rec.timestamp = now_ns();
+        memcpy(slot->msg, &rec, sizeof(rec));
+        slot->len = rec.len;
+    } else {
+        int len = vsnprintf(slot->msg, sizeof(slot->msg), format, ap);
+        slot->len = (len < 0 ? 0 : (len >= sizeof(slot->msg) ? sizeof(slot->msg) - 1 : len));
+    }
+    slot->priority = priority;
+    ring_publish(a, slot);
+}
+
+void af_log_vprintf(int priority, const char *format, va_list ap)
+{
+    AF_METRIC_INC(AF_METRIC_LOG_MESSAGES);
+    AF_METRIC_TIMER_START(start);
+    log_vprintf(priority, format, ap);
+    AF_METRIC_TIMER_STOP(AF_METRIC_LOG_NS, start);
+}
+
+void af_log_printf(int priority, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    af_log_vprintf(priority, format, ap);
+    va_end(ap);
+}
+
+/* parses the site's format and adds it to the site list; returns the
+   site's new state */
+static int site_register(af_log_site_t *site)
+{
+    int state = SITE_NEW;
+    if (!__atomic_compare_exchange_n(&site->state, &state, SITE_REGISTERING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return state;
+    }
+
+    int numArgs = -1;
+    if (strlen(site->format) < LOG_BINARY_MAX_FORMAT) {
+        numArgs = log_binary_parse_format(site->format, site->types, AF_LOG_BINARY_MAX_ARGS, NULL, NULL);
+    }
+    if (numArgs < 0) {
+        __atomic_store_n(&site->state, SITE_TEXT, __ATOMIC_RELEASE);
+        return SITE_TEXT;
+    }
+
+    int i, argBytes = 0;
+    for (i = 0; i < numArgs; i++) {
+        argBytes += log_binary_arg_size(site->types[i]);
+    }
+    site->numArgs = numArgs;
+    site->argBytes = argBytes;
+    site->id = __atomic_add_fetch(&s_lastSiteId, 1, __ATOMIC_RELAXED);
+
+    site->next = __atomic_load_n(&s_sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s_sites, &site->next, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __atomic_store_n(&site->state, SITE_READY, __ATOMIC_RELEASE);
+    return SITE_READY;
+}
+
+void af_log_binary(af_log_site_t *site, ...)
+{
+    va_list ap;
+    va_start(ap, site);
+
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+    if (a != NULL && a->binary && state == SITE_NEW) {
+        state = site_register(site);
+    }
+    if (a == NULL || !a->binary || state != SITE_READY || pthread_equal(pthread_self(), a->thread)) {
+        af_log_vprintf(site->priority, site->format, ap);
+        va_end(ap);
+        return;
+    }
+    AF_METRIC_INC(AF_METRIC_LOG_MESSAGES);
+
+    prv_slot_t *slot = ring_reserve(a);
+    if (slot == NULL) {
+        va_end(ap);
+        return;
+    }
+
+    /* the fixed size arguments always fit; strings get what's left */
+    log_binary_record_t rec;
+    char *p = slot->msg + sizeof(rec);
+    uint32_t left = site->argBytes;
+    int i;
+    for (i = 0; i < site->numArgs; i++) {
+        uint8_t type = site->types[i];
+        int64_t v;
+        switch (type) {
+            case LOG_BINARY_ARG_INT :
+            case LOG_BINARY_ARG_INT | LOG_BINARY_ARG_UNSIGNED : {
+                int iv = va_arg(ap, int);
+                memcpy(p, &iv, sizeof(iv));
+                p += sizeof(iv);
+                left -= sizeof(iv);
+                continue;
+            }
+            case LOG_BINARY_ARG_STRING : {
+                const char *s = va_arg(ap, const char *);
+                if (s == NULL) {
+                    s = "(null)";
+                }
+                left -= sizeof(uint16_t);
+                uint16_t len = strnlen(s, slot->msg + sizeof(slot->msg) - p - sizeof(len) - left);
+                memcpy(p, &len, sizeof(len));
+                memcpy(p + sizeof(len), s, len);
+                p += sizeof(len) + len;
+                continue;
+            }
+            case LOG_BINARY_ARG_DOUBLE : {
+                double d = va_arg(ap, double);
+                memcpy(p, &d, sizeof(d));
+                p += sizeof(d);
+                left -= sizeof(d);
+                continue;
+            }
+            case LOG_BINARY_ARG_PTR :
+                v = (uintptr_t)va_arg(ap, void *);
+                break;
+            case LOG_BINARY_ARG_LONG :
+                v = va_arg(ap, long);
+                break;
+            case LOG_BINARY_ARG_LONG | LOG_BINARY_ARG_UNSIGNED :
+                v = va_arg(ap, unsigned long);
+                break;
+            case LOG_BINARY_ARG_LLONG :
+            case LOG_BINARY_ARG_LLONG | LOG_BINARY_ARG_UNSIGNED :
+                v = va_arg(ap, long long);
+                break;
+            case LOG_BINARY_ARG_SIZE :
+            case LOG_BINARY_ARG_SIZE | LOG_BINARY_ARG_UNSIGNED :
+                v = va_arg(ap, size_t);
+                break;
+            case LOG_BINARY_ARG_INTMAX :
+            case LOG_BINARY_ARG_INTMAX | LOG_BINARY_ARG_UNSIGNED :
+                v = va_arg(ap, intmax_t);
+                break;
+            default :
+                v = va_arg(ap, ptrdiff_t);
+                break;
+        }
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        left -= sizeof(v);
+    }
+    va_end(ap);
+
+    rec.len = p - slot->msg;
+    rec.kind = LOG_BINARY_KIND_EVENT;
+    rec.priority = site->priority;
+    rec.siteId = site->id;
+    rec.timestamp = now_ns();
+    memcpy(slot->msg, &rec, sizeof(rec));
+    slot->len = rec.len;
+    slot->priority = site->priority;
+    ring_publish(a, slot);
+}
+
+static void async_free(prv_async_t *a)
+{
+    if (a->fd >= 0) {
+        close(a->fd);
+    }
+    if (a->sock >= 0) {
+        close(a->sock);
+    }
+    free(a->buf);
+    free(a->path);
+    free(a->slots);
+    free(a);
+}
+
+/* sets up the /dev/log transport; a failure to connect isn't an error, as
+   syslogd may not have started yet */
+static int devlog_init(prv_async_t *a, const af_log_async_config_t *config)
+{
+    const char *path = (config->devLogPath ? config->devLogPath : DEVLOG_PATH);
+    const char *ident = (config->ident ? config->ident : program_invocation_short_name);
+    int i;
+
+    if (strlen(path) >= sizeof(a->devLogAddr.sun_path)) {
+        AFLOG_ERR("af_log_start_async_devlog_path:len=%zu", strlen(path));
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    a->devLogAddr.sun_family = AF_UNIX;
+    strcpy(a->devLogAddr.sun_path, path);
+
+    a->facility = (config->facility ? config->facility : LOG_USER);
+    for (i = 0; i < 8; i++) {
+        snprintf(a->priHeader[i], sizeof(a->priHeader[i]), "<%d>", a->facility | i);
+    }
+    snprintf(a->ident, sizeof(a->ident), "%.32s[%d]: ", ident, (int)getpid());
+    a->devLog = 1;
+    devlog_connect(a);
+    return 0;
+}
+
+/* the drain thread doesn't survive a fork, so the child goes back to
+   logging synchronously; messages still queued belong to the parent */
+static void fork_child(void)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    if (a != NULL) {
+        __atomic_store_n(&s_async, NULL, __ATOMIC_RELEASE);
+        async_free(a);
+    }
+}
+
+static void register_fork_handler(void)
+{
+    pthread_atfork(NULL, NULL, fork_child);
+}
+
+int af_log_start_async(const af_log_async_config_t *config)
+{
+    uint32_t numSlots = (config && config->numSlots ? config->numSlots : DEFAULT_NUM_SLOTS);
+    uint32_t overflow = (config ? config->overflow : AF_LOG_OVERFLOW_DROP);
+    uint32_t transport = (config ? config->transport : AF_LOG_TRANSPORT_SYSLOG);
+
+    if ((numSlots & (numSlots - 1)) != 0 || numSlots < 2 ||
+        (overflow != AF_LOG_OVERFLOW_DROP && overflow != AF_LOG_OVERFLOW_BLOCK) ||
+        (transport != AF_LOG_TRANSPORT_SYSLOG && transport != AF_LOG_TRANSPORT_DEVLOG)) {
+        AFLOG_ERR("af_log_start_async_param:numSlots=%d,overflow=%d,transport=%d", numSlots, overflow, transport);
+        errno = EINVAL;
+        return -1;
+    }
+    if (__atomic_load_n(&s_async, __ATOMIC_ACQUIRE) != NULL) {
+        AFLOG_ERR("af_log_start_async_started");
+        errno = EBUSY;
+        return -1;
+    }
+    pthread_once(&s_forkOnce, register_fork_handler);
+
+    prv_async_t *a = (prv_async_t *)calloc(1, sizeof(prv_async_t));
+    if (a == NULL) {
+        AFLOG_ERR("af_log_start_async_calloc:errno=%d", errno);
+        return -1;
+    }
+    a->slots = (prv_slot_t *)calloc(numSlots, sizeof(prv_slot_t));
+    if (a->slots == NULL) {
+        AFLOG_ERR("af_log_start_async_slots:errno=%d", errno);
+        free(a);
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < numSlots; i++) {
+        a->slots[i].seq = i;
+    }
+    a->mask = numSlots - 1;
+    a->overflow = overflow;
+    a->fd = -1;
+    a->sock = -1;
+    if (config && config->binaryPath) {
+        size_t len = strlen(config->binaryPath);
+        a->path = (char *)malloc(len * 2 + 4);
+        a->buf = (char *)malloc(BINARY_BUF_SIZE);
+        if (a->path == NULL || a->buf == NULL) {
+            AFLOG_ERR("af_log_start_async_binary:errno=%d", errno);
+            async_free(a);
+            return -1;
+        }
+        memcpy(a->path, config->binaryPath, len + 1);
+        a->rotatePath = a->path + len + 1;
+        memcpy(a->rotatePath, config->binaryPath, len);
+        memcpy(a->rotatePath + len, ".1", 3);
+        a->maxBytes = config->binaryMaxBytes;
+        a->binary = 1;
+        if (binary_open(a) < 0) {
+            int err = errno;
+            async_free(a);
+            errno = err;
+            return -1;
+        }
+    } else if (transport == AF_LOG_TRANSPORT_DEVLOG && devlog_init(a, config) < 0) {
+        async_free(a);
+        return -1;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->drainCond, NULL);
+    pthread_cond_init(&a->spaceCond, NULL);
+    pthread_cond_init(&a->flushCond, NULL);
+
+    int err = pthread_create(&a->thread, NULL, drain_thread, a);
+    if (err != 0) {
+        AFLOG_ERR("af_log_start_async_thread:err=%d", err);
+        async_free(a);
+        errno = err;
+        return -1;
+    }
+
+    __atomic_store_n(&s_async, a, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void af_log_flush(void)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    if (a == NULL || pthread_equal(pthread_self(), a->thread)) {
+        return;
+    }
+
+    /* wait until everything reserved so far has been written out; dropped
+       messages were never reserved */
+    uint64_t target = __atomic_load_n(&a->enqPos, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&a->lock);
+    while (__atomic_load_n(&a->numDrained, __ATOMIC_ACQUIRE) < target) {
+        struct timespec ts;
+        deadline(&ts, DRAIN_IDLE_MS);
+        pthread_cond_signal(&a->drainCond);
+        pthread_cond_timedwait(&a->flushCond, &a->lock, &ts);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+void af_log_stop_async(void)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    if (a == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    a->stop = 1;
+    pthread_cond_signal(&a->drainCond);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+
+    __atomic_store_n(&s_async, NULL, __ATOMIC_RELEASE);
+    pthread_cond_destroy(&a->flushCond);
+    pthread_cond_destroy(&a->spaceCond);
+    pthread_cond_destroy(&a->drainCond);
+    pthread_mutex_destroy(&a->lock);
+    async_free(a);
+}
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* A token bucket kept as the time the bucket will be full again (the
+   generic cell rate algorithm), so it fits in one word that can be updated
+   with compare and swap. The time wraps every 49 days; a value further
+   ahead than the interval can only be left over from before a wrap and
+   counts as a full bucket. */
+int af_log_ratelimit(af_log_ratelimit_t *rl, uint32_t burst, uint32_t intervalMs, uint32_t *suppressed)
+{
+    uint32_t now = now_ms();
+    uint32_t step = intervalMs / (burst ? burst : 1);
+    if (step == 0) {
+        step = 1;
+    }
+    uint32_t limit = (intervalMs > step ? intervalMs - step : 0);
+
+    uint32_t tat = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED);
+    uint32_t newTat;
+    do {
+        uint32_t ahead = tat - now;
+        if ((int32_t)ahead < 0 || ahead > intervalMs) {
+            ahead = 0;
+        }
+        if (ahead > limit) {
+            __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        newTat = now + ahead + step;
+    } while (!__atomic_compare_exchange_n(&rl->tat, &tat, newTat, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *suppressed = (__atomic_load_n(&rl->suppressed, __ATOMIC_RELAXED) ? __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED) : 0);
+    return 1;
+}
+
+int af_log_sample(af_log_ratelimit_t *rl, uint32_t n)
+{
+    uint32_t count = __atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED);
+    return (n <= 1 || count % n == 0);
+}
+
+void af_log_suppressed(int priority, const char *format, uint32_t suppressed)
+{
+    af_log_printf(priority, "%.*s:suppressed=%u", (int)strcspn(format, ":"), format, suppressed);
+}
+
+void af_log_register_module(af_log_module_t *module)
+{
+    pthread_mutex_lock(&s_moduleLock);
+    /* a module that's already been given a level passes it on to files
+       loaded later */
+    af_log_module_t *m;
+    for (m = s_modules; m; m = m->next) {
+        if (strcmp(m->name, module->name) == 0) {
+            module->level = m->level;
+            break;
+        }
+    }
+    module->next = s_modules;
+    s_modules = module;
+    pthread_mutex_unlock(&s_moduleLock);
+}
+
+int af_log_set_module_level(const char *name, int level)
+{
+    if (name == NULL || level < AF_LOG_LEVEL_DEFAULT || level > LOG_DEBUG4) {
+        AFLOG_ERR("af_log_set_module_level_param:name_NULL=%d,level=%d", name == NULL, level);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int found = 0;
+    af_log_module_t *m;
+    pthread_mutex_lock(&s_moduleLock);
+    for (m = s_modules; m; m = m->next) {
+        if (strcmp(m->name, name) == 0) {
+            __atomic_store_n(&m->level, level, __ATOMIC_RELAXED);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&s_moduleLock);
+
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+int af_log_get_module_level(const char *name)
+{
+    int level = AF_LOG_LEVEL_DEFAULT - 1;
+    af_log_module_t *m;
+
+    pthread_mutex_lock(&s_moduleLock);
+    for (m = s_modules; m; m = m->next) {
+        if (name && strcmp(m->name, name) == 0) {
+            level = __atomic_load_n(&m->level, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_moduleLock);
+
+    if (level < AF_LOG_LEVEL_DEFAULT) {
+        errno = ENOENT;
+    }
+    return level;
+}
+
+int af_log_load_module_levels(const char *path)
+{
+    if (path == NULL) {
+        AFLOG_ERR("af_log_load_module_levels_param");
+        errno = EINVAL;
+        return -1;
+    }
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        int err = errno;
+        AFLOG_ERR("af_log_load_module_levels_open:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+
+    char line[128];
+    int lineNum = 0, numSet = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[64], value[16];
+        lineNum++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, " %63[^= \t] = %15s", name, value) != 2) {
+            AFLOG_ERR("af_log_load_module_levels_syntax:line=%d", lineNum);
+            continue;
+        }
+
+        int level;
+        char *end;
+        if (strcmp(value, "default") == 0) {
+            level = AF_LOG_LEVEL_DEFAULT;
+        } else {
+            level = strtol(value, &end, 10);
+            if (*end != '\0' || level < LOG_DEBUG_OFF || level > LOG_DEBUG4) {
+                AFLOG_ERR("af_log_load_module_levels_level:line=%d", lineNum);
+                continue;
+            }
+        }
+        if (af_log_set_module_level(name, level) < 0) {
+            AFLOG_WARNING("af_log_load_module_levels_module:line=%d,name=%s:module not found; ignoring", lineNum, name);
+            continue;
+        }
+        numSet++;
+    }
+    fclose(f);
+    return numSet;
+}
+
+uint64_t af_log_num_dropped(void)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    return (a ? __atomic_load_n(&a->numDropped, __ATOMIC_RELAXED) : 0);
+}
+
+uint32_t af_log_max_msg_len(void)
+{
+    prv_async_t *a = __atomic_load_n(&s_async, __ATOMIC_ACQUIRE);
+    if (a == NULL || pthread_equal(pthread_self(), a->thread)) {
+        return 0;
+    }
+    /* text records in binary mode start with the record header */
+    return AF_LOG_ASYNC_MSG_SIZE - 1 - (a->binary ? sizeof(log_binary_record_t) : 0);
+}
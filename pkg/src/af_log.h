@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <syslog.h>
 
 extern uint32_t g_debugLevel;
@@ -35,32 +36,286 @@ extern uint32_t g_debugLevel;
 #define AFLOG_DEBUG3 printf
 #define AFLOG_DEBUG4 printf
 
+#define AFLOG_INFO_RL printf
+#define AFLOG_NOTICE_RL printf
+#define AFLOG_WARNING_RL printf
+#define AFLOG_ERR_RL printf
+#define AFLOG_CRIT_RL printf
+#define AFLOG_DEBUG1_RL printf
+#define AFLOG_INFO_SAMPLED(_n, ...) printf(__VA_ARGS__)
+#define AFLOG_NOTICE_SAMPLED(_n, ...) printf(__VA_ARGS__)
+#define AFLOG_WARNING_SAMPLED(_n, ...) printf(__VA_ARGS__)
+#define AFLOG_ERR_SAMPLED(_n, ...) printf(__VA_ARGS__)
+#define AFLOG_CRIT_SAMPLED(_n, ...) printf(__VA_ARGS__)
+#define AFLOG_DEBUG1_SAMPLED(_n, ...) printf(__VA_ARGS__)
+
 #else // CHECK_FORMAT
 
-#define AFLOG_INFO(_fmt, ...) syslog(LOG_INFO,"I "_fmt,##__VA_ARGS__)
-#define AFLOG_NOTICE(_fmt, ...) syslog(LOG_NOTICE,"N "_fmt, ##__VA_ARGS__)
-#define AFLOG_WARNING(_fmt, ...) syslog(LOG_WARNING,"W "_fmt, ##__VA_ARGS__)
-#define AFLOG_ERR(_fmt, ...) syslog(LOG_ERR,"E "_fmt,##__VA_ARGS__)
-#define AFLOG_CRIT(_fmt, ...) syslog(LOG_CRIT,"C "_fmt,##__VA_ARGS__)
-#define AFLOG_DEBUG1(_fmt, ...) if (g_debugLevel>=LOG_DEBUG1) syslog(LOG_DEBUG,"1 "_fmt,##__VA_ARGS__)
+/* The macros write through af_log_printf, which calls syslog unless
+   af_log_start_async has been called. Define AF_LOG_USE_SYSLOG to have
+   them call syslog directly, or AF_LOG_BINARY to have them write through
+   af_log_binary, which records the raw arguments instead of formatting
+   them when binary logging is on. AF_LOG_BINARY also keeps AFLOG_DEBUG2
+   through AFLOG_DEBUG4 in release builds, still gated by g_debugLevel, so
+   they can be turned on in the field. */
+#if defined(AF_LOG_BINARY)
+#define AF_LOG_OUTPUT AF_LOG_BINARY_OUTPUT
+#elif defined(AF_LOG_USE_SYSLOG)
+#define AF_LOG_OUTPUT syslog
+#else
+#define AF_LOG_OUTPUT af_log_printf
+#endif
+
+#define AFLOG_INFO(_fmt, ...) AF_LOG_OUTPUT(LOG_INFO,"I "_fmt,##__VA_ARGS__)
+#define AFLOG_NOTICE(_fmt, ...) AF_LOG_OUTPUT(LOG_NOTICE,"N "_fmt, ##__VA_ARGS__)
+#define AFLOG_WARNING(_fmt, ...) AF_LOG_OUTPUT(LOG_WARNING,"W "_fmt, ##__VA_ARGS__)
+#define AFLOG_ERR(_fmt, ...) AF_LOG_OUTPUT(LOG_ERR,"E "_fmt,##__VA_ARGS__)
+#define AFLOG_CRIT(_fmt, ...) AF_LOG_OUTPUT(LOG_CRIT,"C "_fmt,##__VA_ARGS__)
+#define AFLOG_DEBUG1(_fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG1) AF_LOG_OUTPUT(LOG_DEBUG,"1 "_fmt,##__VA_ARGS__)
 
-#ifdef BUILD_TARGET_RELEASE
+#if defined(BUILD_TARGET_RELEASE) && !defined(AF_LOG_BINARY)
 #define AFLOG_DEBUG4(_fmt, ...)
 #define AFLOG_DEBUG3(_fmt, ...)
 #define AFLOG_DEBUG2(_fmt, ...)
 #else
-#define AFLOG_DEBUG4(_fmt, ...) if (g_debugLevel>=LOG_DEBUG4) syslog(LOG_DEBUG,"4 "_fmt,##__VA_ARGS__)
-#define AFLOG_DEBUG3(_fmt, ...) if (g_debugLevel>=LOG_DEBUG3) syslog(LOG_DEBUG,"3 "_fmt,##__VA_ARGS__)
-#define AFLOG_DEBUG2(_fmt, ...) if (g_debugLevel>=LOG_DEBUG2) syslog(LOG_DEBUG,"2 "_fmt,##__VA_ARGS__)
-#endif // BUILD_TARGET_RELEASE
+#define AFLOG_DEBUG4(_fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG4) AF_LOG_OUTPUT(LOG_DEBUG,"4 "_fmt,##__VA_ARGS__)
+#define AFLOG_DEBUG3(_fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG3) AF_LOG_OUTPUT(LOG_DEBUG,"3 "_fmt,##__VA_ARGS__)
+#define AFLOG_DEBUG2(_fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG2) AF_LOG_OUTPUT(LOG_DEBUG,"2 "_fmt,##__VA_ARGS__)
+#endif // BUILD_TARGET_RELEASE && !AF_LOG_BINARY
+
+/* Rate limited variants for messages that can fire on every call, such as
+   allocation failures. Each call site allows a burst of
+   AF_LOG_RATELIMIT_BURST messages and then one message every
+   AF_LOG_RATELIMIT_INTERVAL_MS / AF_LOG_RATELIMIT_BURST milliseconds.
+   Messages over the limit are counted, and the next message that gets
+   through is preceded by a summary such as
+   "E af_mempool_alloc_no_expand:suppressed=120", made from the format up
+   to its first ':'. */
+#define AFLOG_INFO_RL(_fmt, ...) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_INFO, "I "_fmt, ##__VA_ARGS__)
+#define AFLOG_NOTICE_RL(_fmt, ...) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_NOTICE, "N "_fmt, ##__VA_ARGS__)
+#define AFLOG_WARNING_RL(_fmt, ...) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_WARNING, "W "_fmt, ##__VA_ARGS__)
+#define AFLOG_ERR_RL(_fmt, ...) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_ERR, "E "_fmt, ##__VA_ARGS__)
+#define AFLOG_CRIT_RL(_fmt, ...) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_CRIT, "C "_fmt, ##__VA_ARGS__)
+#define AFLOG_DEBUG1_RL(_fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG1) AF_LOG_RATELIMITED(AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, LOG_DEBUG, "1 "_fmt, ##__VA_ARGS__)
+
+/* Sampled variants log the first of every _n messages from the call site
+   and drop the rest without a summary. */
+#define AFLOG_INFO_SAMPLED(_n, _fmt, ...) AF_LOG_SAMPLED(_n, LOG_INFO, "I "_fmt, ##__VA_ARGS__)
+#define AFLOG_NOTICE_SAMPLED(_n, _fmt, ...) AF_LOG_SAMPLED(_n, LOG_NOTICE, "N "_fmt, ##__VA_ARGS__)
+#define AFLOG_WARNING_SAMPLED(_n, _fmt, ...) AF_LOG_SAMPLED(_n, LOG_WARNING, "W "_fmt, ##__VA_ARGS__)
+#define AFLOG_ERR_SAMPLED(_n, _fmt, ...) AF_LOG_SAMPLED(_n, LOG_ERR, "E "_fmt, ##__VA_ARGS__)
+#define AFLOG_CRIT_SAMPLED(_n, _fmt, ...) AF_LOG_SAMPLED(_n, LOG_CRIT, "C "_fmt, ##__VA_ARGS__)
+#define AFLOG_DEBUG1_SAMPLED(_n, _fmt, ...) if (AF_LOG_DEBUG_LEVEL>=LOG_DEBUG1) AF_LOG_SAMPLED(_n, LOG_DEBUG, "1 "_fmt, ##__VA_ARGS__)
 
 #endif // CHECK_FORMAT
 
-#define AFLOG_DEBUG_ENABLED()  (g_debugLevel >= LOG_DEBUG1)
+#define AFLOG_DEBUG_ENABLED()  (AF_LOG_DEBUG_LEVEL >= LOG_DEBUG1)
+
+/* Per module debug levels. A source file joins a module by defining
+   AF_LOG_MODULE as the module's name before including this header, as in
+   #define AF_LOG_MODULE "mempool". The AFLOG_DEBUG* macros in the file then
+   compare against the module's level instead of g_debugLevel. A module's
+   level is AF_LOG_LEVEL_DEFAULT, which follows g_debugLevel, until it's
+   set with af_log_set_module_level or af_log_load_module_levels. Several
+   files may use the same module name; they share the level. The check is
+   still a single branch, and BUILD_TARGET_RELEASE still compiles out
+   AFLOG_DEBUG2 through AFLOG_DEBUG4. This library's own debug messages
+   are in the modules "mempool", "slab", and "util". */
+#define AF_LOG_LEVEL_DEFAULT (-1)
+
+typedef struct af_log_module_struct {
+    const char *name;
+    int32_t level;
+    struct af_log_module_struct *next;
+} af_log_module_t;
+
+void af_log_register_module(af_log_module_t *module);
+
+static inline uint32_t af_log_module_level(const af_log_module_t *module)
+{
+    int32_t level = __atomic_load_n(&module->level, __ATOMIC_RELAXED);
+    return (level < 0 ? g_debugLevel : (uint32_t)level);
+}
+
+#ifdef AF_LOG_MODULE
+static af_log_module_t s_afLogModule = { AF_LOG_MODULE, AF_LOG_LEVEL_DEFAULT, NULL };
+static void __attribute__((constructor)) af_log_module_init(void)
+{
+    af_log_register_module(&s_afLogModule);
+}
+#define AF_LOG_DEBUG_LEVEL af_log_module_level(&s_afLogModule)
+#else
+#define AF_LOG_DEBUG_LEVEL g_debugLevel
+#endif
+
+/* sets the level of every file in the module name to level, which is
+   LOG_DEBUG_OFF through LOG_DEBUG4 or AF_LOG_LEVEL_DEFAULT
+   returns -1 with errno set to ENOENT if no file has registered the module */
+int af_log_set_module_level(const char *name, int level);
+
+/* returns the level set for the module name, which may be
+   AF_LOG_LEVEL_DEFAULT, or -2 with errno set to ENOENT if there is no such
+   module */
+int af_log_get_module_level(const char *name);
+
+/* sets module levels from a control file with lines of the form
+   "module=level", where level is a number or "default". Blank lines and
+   lines starting with '#' are skipped; modules that aren't registered are
+   logged and skipped. Reload it from a signal handling thread or a
+   control socket to change levels in a running daemon.
+   returns the number of modules set, or -1 with errno set */
+int af_log_load_module_levels(const char *path);
+
+void af_log_printf(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void af_log_vprintf(int priority, const char *format, va_list ap);
+
+#define AF_LOG_RATELIMIT_BURST       10
+#define AF_LOG_RATELIMIT_INTERVAL_MS 5000
+
+/* per call site state for the rate limited and sampled macros; private to af_log.c */
+typedef struct {
+    uint32_t tat;         /* when the bucket will be full again, in ms */
+    uint32_t suppressed;
+    uint32_t count;
+} af_log_ratelimit_t;
+
+/* returns nonzero if a message may be logged, allowing burst messages per
+   intervalMs, and sets *suppressed to the number of messages refused
+   since the last one allowed. Uses the coarse monotonic clock. */
+int af_log_ratelimit(af_log_ratelimit_t *rl, uint32_t burst, uint32_t intervalMs, uint32_t *suppressed);
+
+/* returns nonzero for the first of every n calls */
+int af_log_sample(af_log_ratelimit_t *rl, uint32_t n);
+
+/* logs the summary for suppressed messages from the site with format */
+void af_log_suppressed(int priority, const char *format, uint32_t suppressed);
+
+#define AF_LOG_RATELIMITED(_burst, _intervalMs, _pri, _fmt, ...) do { \
+    static af_log_ratelimit_t _afLogRl; \
+    uint32_t _afLogSuppressed; \
+    if (af_log_ratelimit(&_afLogRl, _burst, _intervalMs, &_afLogSuppressed)) { \
+        if (_afLogSuppressed) af_log_suppressed(_pri, _fmt, _afLogSuppressed); \
+        AF_LOG_OUTPUT(_pri, _fmt, ##__VA_ARGS__); \
+    } \
+} while (0)
+
+#define AF_LOG_SAMPLED(_n, _pri, _fmt, ...) do { \
+    static af_log_ratelimit_t _afLogRl; \
+    if (af_log_sample(&_afLogRl, _n)) AF_LOG_OUTPUT(_pri, _fmt, ##__VA_ARGS__); \
+} while (0)
+
+/* Asynchronous logging. Once started, af_log_printf formats each message
+   into a slot of a ring buffer on the calling thread and a background
+   thread writes the messages to syslog. Messages longer than
+   AF_LOG_ASYNC_MSG_SIZE - 1 characters are truncated.
+
+   When the ring is full, AF_LOG_OVERFLOW_DROP throws the message away and
+   counts it; the count is logged by the background thread.
+   AF_LOG_OVERFLOW_BLOCK makes the logging thread wait for room. */
+#define AF_LOG_ASYNC_MSG_SIZE 480
+
+#define AF_LOG_OVERFLOW_DROP  0
+#define AF_LOG_OVERFLOW_BLOCK 1
+
+/* Binary logging. If binaryPath is set, the background thread appends
+   records to that file instead of writing to syslog, and messages logged
+   through af_log_binary are recorded as the site's format ID, a
+   timestamp, and the raw arguments, without formatting them. Messages
+   logged any other way are recorded as text. Run af_logdecode on the file
+   to get the messages back. If binaryMaxBytes is not 0, the file is
+   renamed to binaryPath with ".1" appended when the next record would
+   take it past that size, replacing any earlier one, and a new file is
+   started. Each file holds the definitions of all the sites it uses. */
+
+/* Transports. AF_LOG_TRANSPORT_SYSLOG writes each message with syslog(3).
+   AF_LOG_TRANSPORT_DEVLOG has the background thread keep its own
+   connection to syslogd's datagram socket, devLogPath or /dev/log, and
+   send queued messages in batches, with a header built from ident (the
+   program name by default), the process ID, and facility (LOG_USER by
+   default) rather than the ones given to openlog. The timestamp is when
+   the message is sent. If syslogd restarts the socket is reconnected;
+   while it can't be, messages go through syslog(3). */
+#define AF_LOG_TRANSPORT_SYSLOG 0
+#define AF_LOG_TRANSPORT_DEVLOG 1
+
+typedef struct {
+    uint32_t numSlots;        /* power of two; 0 picks the default of 1024 */
+    uint32_t overflow;        /* AF_LOG_OVERFLOW_DROP or AF_LOG_OVERFLOW_BLOCK */
+    const char *binaryPath;   /* NULL to write to syslog */
+    uint32_t binaryMaxBytes;  /* 0 for no limit */
+    uint32_t transport;       /* AF_LOG_TRANSPORT_SYSLOG or AF_LOG_TRANSPORT_DEVLOG; ignored in binary mode */
+    const char *devLogPath;   /* NULL for /dev/log */
+    const char *ident;        /* NULL for the program name */
+    int facility;             /* 0 for LOG_USER */
+} af_log_async_config_t;
+
+/* starts the background thread; config may be NULL for the defaults
+   returns -1 with errno set on failure. The child of a fork logs
+   synchronously to syslog; call af_log_start_async again in the child to
+   log asynchronously there. */
+int af_log_start_async(const af_log_async_config_t *config);
+
+/* waits until every message logged before the call has been written out */
+void af_log_flush(void);
+
+/* writes out the queued messages, stops the background thread, and goes
+   back to logging synchronously. No other thread may be logging while
+   this runs, so call it during shutdown. */
+void af_log_stop_async(void);
+
+/* returns the number of messages dropped because the ring was full */
+uint64_t af_log_num_dropped(void);
+
+/* returns the longest message, in characters, that the calling thread can
+   log without it being truncated, or 0 if there is no limit because
+   logging is synchronous */
+uint32_t af_log_max_msg_len(void);
+
+/* A log site is one call to AF_LOG_BINARY_OUTPUT. The first time a site
+   logs while binary logging is on, its format is parsed to find the
+   argument types and the site is given an ID; after that, logging costs
+   a timestamp and a copy of the arguments. Formats that can't be recorded
+   this way, such as ones using %m, %n, long double, or a precision on %s,
+   are formatted as usual. The fields are private to af_log.c. */
+#define AF_LOG_BINARY_MAX_ARGS 16
+
+typedef struct af_log_site_struct {
+    const char *format;
+    int priority;
+    int state;
+    uint32_t id;
+    uint16_t argBytes;
+    uint8_t numArgs;
+    uint8_t types[AF_LOG_BINARY_MAX_ARGS];
+    struct af_log_site_struct *next;
+} af_log_site_t;
+
+void af_log_binary(af_log_site_t *site, ...);
+
+static inline void af_log_check_format(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static inline void af_log_check_format(const char *format, ...) { }
+
+#define AF_LOG_BINARY_OUTPUT(_pri, _fmt, ...) do { \
+    static af_log_site_t _afLogSite = { _fmt, _pri }; \
+    if (0) af_log_check_format(_fmt, ##__VA_ARGS__); \
+    af_log_binary(&_afLogSite, ##__VA_ARGS__); \
+} while (0)
 
 void af_log_buffer(uint32_t level, char *name, uint8_t *buffer, int bufLen);
 
+/* same as af_log_buffer but logs bytesPerRecord bytes per syslog record
+   instead of 32, so large buffers take fewer, longer records. Values of 0
+   or less mean 32 and larger values are limited to
+   AF_LOG_BUFFER_MAX_BYTES_PER_RECORD, or to what fits in a slot while
+   logging is asynchronous. */
+#define AF_LOG_BUFFER_MAX_BYTES_PER_RECORD 256
+void af_log_buffer_wide(uint32_t level, char *name, uint8_t *buffer, int bufLen, int bytesPerRecord);
+
 void af_util_convert_data_to_hex_with_name(char *name, uint8_t *data, int dataLen, char *buf, int bufLen);
 
+/* same as af_util_convert_data_to_hex_with_name but returns the length of
+   the message written to buf, or -1 if buf holds an error message instead */
+int af_util_format_hex_with_name(const char *name, const uint8_t *data, int dataLen, char *buf, int bufLen);
+
 #endif // __LOG_H__
 
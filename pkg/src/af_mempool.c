@@ -8,85 +8,754 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
+#define AF_LOG_MODULE "mempool"
 #include "af_log.h"
 #include "af_mempool.h"
+#include "af_mempool_fast.h"
+#include "af_metrics.h"
 
-#define ALIGN8(_x) (((_x) + 0x7) & 0xfffffff8)
+#define ALIGN_UP(_x, _a) (((_x) + ((_a) - 1)) & ~((uintptr_t)(_a) - 1))
+
+#define MIN_ALIGN       8
+#define MAX_ALIGN       4096
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+/* per-thread cache sizing for thread safe pools */
+#define CACHE_BATCH 16                  /* units moved between cache and pool at a time */
+#define CACHE_SIZE  (CACHE_BATCH * 2)   /* maximum units held by a cache */
+
+/* maximum number of blocks in a lock free pool */
+#define LF_MAX_BLOCKS 1024
+
+/* The lock free free list head packs a 32 bit unit index with a 32 bit tag
+   that is incremented on every change, which protects the compare and swap
+   against ABA. Unit indexes are ((blockNum + 1) << unitBits) | unitNum so
+   index 0 means the list is empty. */
+#define LF_HEAD(_tag, _index) (((uint64_t)(_tag) << 32) | (uint32_t)(_index))
+#define LF_HEAD_TAG(_head)    ((uint32_t)((_head) >> 32))
+#define LF_HEAD_INDEX(_head)  ((uint32_t)(_head))
 
 static uint32_t s_poolMagic = 0xf7bdedcd;
-static uint32_t s_unitMagic = 0xcefabeba;
-
-typedef struct prv_block_struct {
-    struct prv_block_struct *next;
-    struct prv_unit_struct *units;
-} prv_block_t;
-
-struct af_mempool_struct {
-    uint32_t magic;
-    uint32_t flags;
-    uint32_t unitSize;
-    uint32_t numUnits;
-    struct prv_unit_struct *free;
-    struct prv_block_struct *blocks;
-};
-
-/* magic is 0 if the block is free. Otherwise it's set to s_unitMagic */
-typedef struct prv_unit_struct {
-    uint32_t magic;
-    union {
-        struct prv_unit_struct *next;
-        struct af_mempool_struct *pool;
-    } u;
-} prv_unit_t;
+static uint32_t s_unitMagic = AF_MEMPOOL_UNIT_MAGIC;
+
+/* per-thread cache of free units; only used with AF_MEMPOOL_FLAG_THREAD_SAFE */
+typedef struct prv_cache_struct {
+    struct prv_cache_struct *next;   /* list of all caches of a pool; protected by pool lock */
+    struct prv_cache_struct *prev;
+    struct af_mempool_struct *pool;
+    uint32_t id;                     /* never 0; stored in the units allocated from the cache */
+    uint32_t count;
+    uint64_t numPoolFrees;           /* units from the cache freed straight to the pool; written with the pool lock held */
+    uint64_t numAllocs;              /* written only by the owning thread */
+    uint64_t numFrees;
+    uint64_t highWater;              /* most units from the cache in use at once */
+    struct prv_unit_struct *units[CACHE_SIZE];
+} prv_cache_t;
+
+/* returns the number of bytes needed for a block, including the slack
+   used to align the first unit's data */
+static inline size_t block_size(af_mempool_t *mp)
+{
+    return sizeof(prv_block_t) + sizeof(prv_unit_t) + (mp->align - 1) + (size_t)mp->actualUnitSize * mp->numUnits;
+}
+
+/* maps memory for a block, using huge pages if requested; returns NULL on failure */
+static void *map_block(af_mempool_t *mp, size_t *size)
+{
+    void *mem;
+
+#ifdef MAP_HUGETLB
+    if (mp->flags & AF_MEMPOOL_FLAG_HUGEPAGE) {
+        /* reserved huge pages, if the system has any */
+        size_t hugeSize = ALIGN_UP(*size, HUGE_PAGE_SIZE);
+        mem = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *size = hugeSize;
+            return mem;
+        }
+        AFLOG_DEBUG3("map_block_hugetlb:errno=%d", errno);
+    }
+#endif
+
+    mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        AFLOG_ERR_RL("map_block_mmap:errno=%d", errno);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (mp->flags & AF_MEMPOOL_FLAG_HUGEPAGE) {
+        /* fall back to transparent huge pages */
+        madvise(mem, *size, MADV_HUGEPAGE);
+    }
+#endif
+    return mem;
+}
+
+static void free_block(af_mempool_t *mp, prv_block_t *block)
+{
+    if (mp->flags & (AF_MEMPOOL_FLAG_MMAP | AF_MEMPOOL_FLAG_HUGEPAGE)) {
+        munmap(block, block->size);
+    } else {
+        free(block);
+    }
+}
 
 static prv_block_t *alloc_new_block(af_mempool_t *mp)
 {
     /* don't check params or magic; we trust the caller */
 
-    /* determine the unit size and block size */
-    uint32_t actualUnitSize = ALIGN8(sizeof(prv_unit_t) + mp->unitSize);
-    uint32_t blockSize = sizeof(prv_block_t) + actualUnitSize * mp->numUnits;
+    AF_METRIC_TIMER_START(start);
+
+    /* determine the block size */
+    size_t blockSize = block_size(mp);
 
-    prv_block_t *block = (prv_block_t *)calloc(1, blockSize);
+    prv_block_t *block;
+    if (mp->flags & (AF_MEMPOOL_FLAG_MMAP | AF_MEMPOOL_FLAG_HUGEPAGE)) {
+        block = (prv_block_t *)map_block(mp, &blockSize);
+    } else {
+        /* the units are carved lazily, so only the header is touched here */
+        block = (prv_block_t *)malloc(blockSize);
+        if (block == NULL) {
+            AFLOG_ERR_RL("alloc_new_block_malloc:errno=%d", errno);
+        }
+    }
     if (block == NULL) {
-        AFLOG_ERR("alloc_new_block_calloc:errno=%d", errno);
         return NULL;
     }
+    memset(block, 0, sizeof(prv_block_t));
+    block->size = blockSize;
 
-    /* use this pointer for arithmetic */
-    uint8_t *blockUInt8 = (uint8_t *)block + sizeof(prv_block_t);
+    /* the unit header sits right before the aligned data */
+    uintptr_t data = ALIGN_UP((uintptr_t)block + sizeof(prv_block_t) + sizeof(prv_unit_t), mp->align);
 
-    /* link the units together */
-    block->units = (prv_unit_t *)blockUInt8;
-    int i;
-    for (i = 0; i < mp->numUnits - 1; i++) {
-        ((prv_unit_t *)blockUInt8)->u.next = (prv_unit_t *)(blockUInt8 + actualUnitSize);
-        blockUInt8 += actualUnitSize;
-    }
-    ((prv_unit_t *)blockUInt8)->u.next = NULL;
+    block->pool = mp;
+    block->units = (prv_unit_t *)(data - sizeof(prv_unit_t));
+    block->numFree = mp->numUnits;
 
-    AFLOG_DEBUG3("alloc_new_block:mp=%p,block=%p,actualUnitSize=%d,blockSize=%d", mp, block, actualUnitSize, blockSize);
+    AFLOG_DEBUG3("alloc_new_block:mp=%p,block=%p,actualUnitSize=%d,blockSize=%zu", mp, block, mp->actualUnitSize, blockSize);
+    AF_METRIC_INC(AF_METRIC_MEMPOOL_EXPAND);
+    AF_METRIC_TIMER_STOP(AF_METRIC_MEMPOOL_EXPAND_NS, start);
     return block;
 }
 
-/* returns -1 if pointer does not point to a mempool */
-static int check_mempool(const char *function, af_mempool_t *mp)
+/* marks a unit allocated and returns the pointer handed to the caller */
+static inline void *unit_data(af_mempool_t *mp, prv_unit_t *u)
 {
-    if (mp == NULL) {
-        AFLOG_ERR("%s_pool_null", function);
-        errno = EINVAL;
+    void *data = (void *)(((uint8_t *)u) + sizeof(prv_unit_t));
+    u->magic = s_unitMagic;
+    if (mp->flags & AF_MEMPOOL_FLAG_ZERO) {
+        memset(data, 0, mp->unitSize);
+    }
+    return data;
+}
+
+/* logs a bad pool pointer for check_mempool; kept out of line so the
+   check itself is inlined on the alloc and free paths */
+static int __attribute__((noinline, cold)) bad_mempool(const char *function, af_mempool_t *mp, af_log_ratelimit_t *rl)
+{
+    const char *problem = (mp == NULL ? "pool_null" : "pool_magic");
+    uint32_t suppressed;
+    if (af_log_ratelimit(rl, AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, &suppressed)) {
+        if (suppressed) {
+            AFLOG_ERR("%s_%s:suppressed=%u", function, problem, suppressed);
+        }
+        AFLOG_ERR("%s_%s", function, problem);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* returns -1 if pointer does not point to a mempool; each caller passes its
+   own rate limit so that a flood of errors from one function doesn't hide
+   the errors from the others */
+static inline int check_mempool(const char *function, af_mempool_t *mp, af_log_ratelimit_t *rl)
+{
+    if (mp != NULL && mp->magic == s_poolMagic) {
+        return 0;
+    }
+    return bad_mempool(function, mp, rl);
+}
+
+/* avail list helpers; the caller must hold the pool lock for thread safe pools */
+static void avail_remove(af_mempool_t *mp, prv_block_t *block)
+{
+    if (block->availPrev) {
+        block->availPrev->availNext = block->availNext;
+    } else {
+        mp->availHead = block->availNext;
+    }
+    if (block->availNext) {
+        block->availNext->availPrev = block->availPrev;
+    } else {
+        mp->availTail = block->availPrev;
+    }
+    block->availNext = block->availPrev = NULL;
+}
+
+static void avail_add_head(af_mempool_t *mp, prv_block_t *block)
+{
+    block->availPrev = NULL;
+    block->availNext = mp->availHead;
+    if (mp->availHead) {
+        mp->availHead->availPrev = block;
+    } else {
+        mp->availTail = block;
+    }
+    mp->availHead = block;
+}
+
+static void avail_add_tail(af_mempool_t *mp, prv_block_t *block)
+{
+    block->availNext = NULL;
+    block->availPrev = mp->availTail;
+    if (mp->availTail) {
+        mp->availTail->availNext = block;
+    } else {
+        mp->availHead = block;
+    }
+    mp->availTail = block;
+}
+
+/* frees idle blocks, other than the base block, until at most keepIdle remain
+   the caller must hold the pool lock for thread safe pools
+   returns the number of blocks freed */
+static uint32_t pool_trim(af_mempool_t *mp, uint32_t keepIdle)
+{
+    uint32_t numFreed = 0;
+
+    /* idle blocks collect at the tail of the avail list */
+    prv_block_t *block = mp->availTail;
+    while (block && mp->numIdleBlocks > keepIdle) {
+        prv_block_t *prev = block->availPrev;
+        if (block->numFree == mp->numUnits && block != mp->baseBlock) {
+            avail_remove(mp, block);
+            if (block->prev) {
+                block->prev->next = block->next;
+            } else {
+                mp->blocks = block->next;
+            }
+            if (block->next) {
+                block->next->prev = block->prev;
+            }
+            free_block(mp, block);
+            mp->numIdleBlocks--;
+            mp->numBlocks--;
+            numFreed++;
+        }
+        block = prev;
+    }
+
+    mp->numTrimmed += numFreed;
+    if (numFreed) {
+        AFLOG_DEBUG3("pool_trim:mp=%p,numFreed=%d,numBlocks=%d", mp, numFreed, mp->numBlocks);
+    }
+    return numFreed;
+}
+
+/* adds a new block to the pool and puts it at the head of the avail list
+   the caller must hold the pool lock for thread safe pools */
+static int pool_expand(af_mempool_t *mp)
+{
+    prv_block_t *block = alloc_new_block(mp);
+    if (block == NULL) {
+        AFLOG_ERR_RL("af_mempool_alloc_block_alloc");
+        errno = ENOSPC;
         return -1;
     }
-    if (mp->magic != s_poolMagic) {
-        AFLOG_ERR("%s_pool_magic", function);
+
+    /* add to mempool's block linked list */
+    block->next = mp->blocks;
+    if (mp->blocks) {
+        mp->blocks->prev = block;
+    }
+    mp->blocks = block;
+    mp->numBlocks++;
+    mp->numExpansions++;
+    mp->numIdleBlocks++;
+
+    avail_add_head(mp, block);
+    return 0;
+}
+
+/* makes sure the free list holds at least numUnits units, expanding the
+   pool if allowed; the caller must hold the pool lock for thread safe pools
+   returns -1 with errno set if the units are not available */
+static int pool_reserve(af_mempool_t *mp, uint32_t numUnits)
+{
+    /* units in per-thread caches can't be handed out from here */
+    uint32_t numUsed = (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) ? mp->numTaken : mp->numInUse;
+    uint32_t numFree = mp->numBlocks * mp->numUnits - numUsed;
+    if (numFree >= numUnits) {
+        return 0;
+    }
+    if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) == 0) {
+        AFLOG_ERR_RL("af_mempool_alloc_no_expand");
+        errno = ENOSPC;
+        return -1;
+    }
+    while (numFree < numUnits) {
+        if (pool_expand(mp) < 0) {
+            return -1;
+        }
+        numFree += mp->numUnits;
+    }
+    return 0;
+}
+
+/* called when no block has a free unit; expands the pool if allowed
+   returns -1 with errno set if it can't */
+static int pool_out_of_units(af_mempool_t *mp)
+{
+    if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) == 0) {
+        AFLOG_ERR_RL("af_mempool_alloc_no_expand");
+        errno = ENOSPC;
+        return -1;
+    }
+    return pool_expand(mp);
+}
+
+/* called when a unit has been taken from a block that was idle or is now
+   full */
+static void block_taken(af_mempool_t *mp, prv_block_t *block)
+{
+    if (block->numFree == mp->numUnits - 1 && block != mp->baseBlock) {
+        mp->numIdleBlocks--;
+    }
+    if (block->numFree == 0) {
+        avail_remove(mp, block);
+    }
+}
+
+/* called when a unit has been put back in a block that was full or is now
+   idle; trims the pool if the automatic trim policy calls for it */
+static void block_returned(af_mempool_t *mp, prv_block_t *block)
+{
+    if (block->numFree == 1) {
+        avail_add_head(mp, block);
+    }
+    if (block->numFree == mp->numUnits) {
+        /* move idle blocks out of the way of allocation */
+        avail_remove(mp, block);
+        avail_add_tail(mp, block);
+        if (block != mp->baseBlock) {
+            mp->numIdleBlocks++;
+            if (mp->autoTrimMax && mp->numIdleBlocks > mp->autoTrimMax) {
+                pool_trim(mp, mp->autoTrimKeep);
+            }
+        }
+    }
+}
+
+/* takes a free unit off the pool's free list, expanding the pool if allowed
+   the caller must hold the pool lock for thread safe pools
+   returns NULL with errno set if no unit is available
+
+   The avail list and idle count only change when a block crosses the full
+   or idle boundary. A pool that can't expand has only its base block,
+   which is never trimmed, so it stays on the avail list even when it's
+   full and none of that bookkeeping is done for it. */
+static inline prv_unit_t *pool_get_unit(af_mempool_t *mp)
+{
+    prv_block_t *block = mp->availHead;
+    if (block == NULL || block->numFree == 0) {
+        if (pool_out_of_units(mp) < 0) {
+            return NULL;
+        }
+        block = mp->availHead;
+    }
+
+    prv_unit_t *u = block->free;
+    if (u != NULL) {
+        block->free = u->u.next;
+    } else {
+        /* a block with free units and an empty free list has uncarved units */
+        u = (prv_unit_t *)((uint8_t *)block->units + (size_t)block->numCarved++ * mp->actualUnitSize);
+    }
+    block->numFree--;
+    mp->numTaken++;
+    u->u.block = block;
+
+    if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) &&
+        (block->numFree == 0 || block->numFree == mp->numUnits - 1)) {
+        block_taken(mp, block);
+    }
+    return u;
+}
+
+/* puts a unit back on its block's free list
+   the caller must hold the pool lock for thread safe pools */
+static inline void pool_put_unit(af_mempool_t *mp, prv_unit_t *u)
+{
+    prv_block_t *block = u->u.block;
+    u->u.next = block->free;
+    block->free = u;
+    block->numFree++;
+    mp->numTaken--;
+
+    if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) &&
+        (block->numFree == 1 || block->numFree == mp->numUnits)) {
+        block_returned(mp, block);
+    }
+}
+
+/* takes numUnits reserved units off the free list and hands them to the
+   caller; the caller must hold the pool lock for thread safe pools */
+static void pool_take_units(af_mempool_t *mp, void **units, uint32_t numUnits)
+{
+    uint32_t i;
+    for (i = 0; i < numUnits; i++) {
+        units[i] = unit_data(mp, pool_get_unit(mp));
+    }
+}
+
+/* returns the calling thread's cache for a thread safe pool, creating it if needed */
+static prv_cache_t *get_cache(af_mempool_t *mp)
+{
+    prv_cache_t *c = (prv_cache_t *)pthread_getspecific(mp->cacheKey);
+    if (c != NULL) {
+        return c;
+    }
+
+    c = (prv_cache_t *)calloc(1, sizeof(prv_cache_t));
+    if (c == NULL) {
+        AFLOG_ERR("get_cache_calloc:errno=%d", errno);
+        return NULL;
+    }
+    c->pool = mp;
+
+    int err = pthread_setspecific(mp->cacheKey, c);
+    if (err != 0) {
+        AFLOG_ERR("get_cache_setspecific:err=%d", err);
+        free(c);
+        errno = err;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mp->lock);
+    if (++mp->nextCacheId == 0) {
+        mp->nextCacheId = 1;
+    }
+    c->id = mp->nextCacheId;
+    c->next = mp->caches;
+    if (mp->caches) {
+        mp->caches->prev = c;
+    }
+    mp->caches = c;
+    pthread_mutex_unlock(&mp->lock);
+
+    AFLOG_DEBUG3("get_cache:mp=%p,c=%p", mp, c);
+    return c;
+}
+
+/* counts units handed out by a pool that isn't shared between threads */
+static inline void update_in_use(af_mempool_t *mp, uint32_t numUnits)
+{
+    mp->numInUse += numUnits;
+    if (mp->numInUse > mp->highWater) {
+        mp->highWater = mp->numInUse;
+    }
+}
+
+/* counts units allocated through a thread's cache; only the owning thread
+   calls this, and the stores are atomic only so that the stats reader sees
+   whole values */
+static inline void cache_count_allocs(prv_cache_t *c, uint32_t numUnits)
+{
+    uint64_t numAllocs = c->numAllocs + numUnits;
+    __atomic_store_n(&c->numAllocs, numAllocs, __ATOMIC_RELAXED);
+    uint64_t numInUse = numAllocs - c->numFrees - __atomic_load_n(&c->numPoolFrees, __ATOMIC_RELAXED);
+    if (numInUse > c->highWater) {
+        __atomic_store_n(&c->highWater, numInUse, __ATOMIC_RELAXED);
+    }
+}
+
+/* counts numUnits units allocated from the cache with the given id as
+   freed straight to the pool, or counts them against the pool if the
+   cache's thread has exited; the caller must hold the pool lock */
+static void count_pool_frees(af_mempool_t *mp, uint32_t id, uint32_t numUnits)
+{
+    prv_cache_t *c;
+    for (c = mp->caches; c; c = c->next) {
+        if (c->id == id) {
+            __atomic_store_n(&c->numPoolFrees, c->numPoolFrees + numUnits, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    mp->numFrees += numUnits;
+}
+
+/* a thread safe pool's in use counts are kept per cache, so its high water
+   mark is the sum of the caches' high water marks plus the units of exited
+   threads still in use; this folds that sum into mp->highWater. The caller
+   must hold the pool lock */
+static void cache_sum_high_water(af_mempool_t *mp)
+{
+    uint64_t sum = mp->numAllocs - mp->numFrees;
+    prv_cache_t *c;
+    for (c = mp->caches; c; c = c->next) {
+        sum += __atomic_load_n(&c->highWater, __ATOMIC_RELAXED);
+    }
+    if (sum > UINT32_MAX) {
+        sum = UINT32_MAX;
+    }
+    if (sum > mp->highWater) {
+        mp->highWater = sum;
+    }
+}
+
+/* moves up to CACHE_BATCH units from the pool into the cache
+   the pool is only expanded if the cache is empty
+   returns -1 if no units could be obtained */
+static int cache_refill(af_mempool_t *mp, prv_cache_t *c)
+{
+    pthread_mutex_lock(&mp->lock);
+    while (c->count < CACHE_BATCH && ((mp->availHead != NULL && mp->availHead->numFree > 0) || c->count == 0)) {
+        prv_unit_t *u = pool_get_unit(mp);
+        if (u == NULL) {
+            mp->numFailedAllocs++;
+            break;
+        }
+        c->units[c->count++] = u;
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    return (c->count == 0 ? -1 : 0);
+}
+
+/* returns the oldest numUnits units in the cache to the pool */
+static void cache_drain(af_mempool_t *mp, prv_cache_t *c, uint32_t numUnits)
+{
+    if (numUnits == 0) {
+        return;
+    }
+
+    uint32_t i;
+    pthread_mutex_lock(&mp->lock);
+    for (i = 0; i < numUnits; i++) {
+        pool_put_unit(mp, c->units[i]);
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    /* keep the most recently used units; they are likely still in the CPU cache */
+    memmove(&c->units[0], &c->units[numUnits], (c->count - numUnits) * sizeof(c->units[0]));
+    c->count -= numUnits;
+}
+
+/* called when a thread exits; gives the thread's cached units back to the pool */
+static void cache_destructor(void *arg)
+{
+    prv_cache_t *c = (prv_cache_t *)arg;
+    af_mempool_t *mp = c->pool;
+
+    cache_drain(mp, c, c->count);
+
+    pthread_mutex_lock(&mp->lock);
+    cache_sum_high_water(mp);
+    mp->numAllocs += c->numAllocs;
+    mp->numFrees += c->numFrees + c->numPoolFrees;
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        mp->caches = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    free(c);
+}
+
+/* counts units allocated from a lock free pool */
+static inline void lf_update_in_use(af_mempool_t *mp, uint32_t numUnits)
+{
+    __atomic_fetch_add(&mp->numAllocs, numUnits, __ATOMIC_RELAXED);
+    uint32_t numInUse = __atomic_add_fetch(&mp->numInUse, numUnits, __ATOMIC_RELAXED);
+    uint32_t highWater = __atomic_load_n(&mp->highWater, __ATOMIC_RELAXED);
+    while (numInUse > highWater &&
+           !__atomic_compare_exchange_n(&mp->highWater, &highWater, numInUse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* returns the unit with the given index in a lock free pool */
+static inline prv_unit_t *lf_unit(af_mempool_t *mp, uint32_t index)
+{
+    prv_block_t *block = mp->lfBlocks[(index >> mp->unitBits) - 1];
+    uint32_t unitNum = index & ((1 << mp->unitBits) - 1);
+    return (prv_unit_t *)((uint8_t *)block->units + unitNum * mp->actualUnitSize);
+}
+
+/* pushes a chain of units linked through lfIndex onto the lock free list */
+static void lf_push(af_mempool_t *mp, uint32_t firstIndex, prv_unit_t *last)
+{
+    uint64_t head = __atomic_load_n(&mp->lfHead, __ATOMIC_RELAXED);
+    uint64_t newHead;
+    do {
+        __atomic_store_n(&last->lfIndex, LF_HEAD_INDEX(head), __ATOMIC_RELAXED);
+        newHead = LF_HEAD(LF_HEAD_TAG(head) + 1, firstIndex);
+    } while (!__atomic_compare_exchange_n(&mp->lfHead, &head, newHead, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* takes the next never used unit of a lock free pool; returns NULL if the
+   newest block has been used up */
+static prv_unit_t *lf_carve(af_mempool_t *mp)
+{
+    uint32_t index = __atomic_load_n(&mp->lfCarve, __ATOMIC_ACQUIRE);
+    uint32_t next;
+    do {
+        if (index == 0) {
+            return NULL;
+        }
+        uint32_t unitNum = index & ((1 << mp->unitBits) - 1);
+        next = (unitNum + 1 == mp->numUnits ? 0 : index + 1);
+    } while (!__atomic_compare_exchange_n(&mp->lfCarve, &index, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    /* indexes are never reused, so the unit is ours */
+    prv_unit_t *u = lf_unit(mp, index);
+    u->u.block = mp->lfBlocks[(index >> mp->unitBits) - 1];
+    __atomic_store_n(&u->lfIndex, index, __ATOMIC_RELAXED);
+    return u;
+}
+
+/* adds a block to a lock free pool and returns its first unit to the
+   caller; the rest of the units are carved from the block as needed */
+static prv_unit_t *lf_expand(af_mempool_t *mp)
+{
+    /* reserve a slot in the block table */
+    uint32_t blockNum = __atomic_load_n(&mp->lfNumBlocks, __ATOMIC_RELAXED);
+    do {
+        if (blockNum >= mp->lfMaxBlocks) {
+            AFLOG_ERR_RL("af_mempool_alloc_lf_max_blocks:blocks=%d", blockNum);
+            errno = ENOSPC;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&mp->lfNumBlocks, &blockNum, blockNum + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    prv_block_t *block = alloc_new_block(mp);
+    if (block == NULL) {
+        /* the slot stays reserved; it's freed with the pool */
+        AFLOG_ERR_RL("af_mempool_alloc_block_alloc");
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    /* publish the block before any of its units can be found */
+    __atomic_store_n(&mp->lfBlocks[blockNum], block, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&mp->numBlocks, 1, __ATOMIC_RELAXED);
+
+    /* keep the first unit and make the rest available for carving */
+    uint32_t base = (blockNum + 1) << mp->unitBits;
+    prv_unit_t *first = block->units;
+    first->u.block = block;
+    __atomic_store_n(&first->lfIndex, base, __ATOMIC_RELAXED);
+    if (mp->numUnits > 1) {
+        uint32_t noCarve = 0;
+        if (!__atomic_compare_exchange_n(&mp->lfCarve, &noCarve, base + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            /* another thread expanded the pool at the same time and its
+               block is still being carved; put this block's units on the
+               free list instead */
+            uint8_t *unitUInt8 = (uint8_t *)first;
+            uint32_t i;
+            for (i = 1; i < mp->numUnits; i++) {
+                unitUInt8 += mp->actualUnitSize;
+                prv_unit_t *u = (prv_unit_t *)unitUInt8;
+                u->u.block = block;
+                u->lfIndex = (i == mp->numUnits - 1 ? 0 : base + i + 1);
+            }
+            lf_push(mp, base + 1, (prv_unit_t *)unitUInt8);
+        }
+    }
+    return first;
+}
+
+/* pops a unit off a lock free pool, carving a new one if the free list is
+   empty and expanding the pool if allowed */
+static prv_unit_t *lf_alloc(af_mempool_t *mp)
+{
+    uint64_t head = __atomic_load_n(&mp->lfHead, __ATOMIC_ACQUIRE);
+    prv_unit_t *u;
+    uint32_t index;
+    while (1) {
+        index = LF_HEAD_INDEX(head);
+        if (index == 0) {
+            u = lf_carve(mp);
+            if (u != NULL) {
+                return u;
+            }
+            if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) == 0) {
+                AFLOG_ERR_RL("af_mempool_alloc_no_expand");
+                errno = ENOSPC;
+                return NULL;
+            }
+            u = lf_expand(mp);
+            if (u != NULL) {
+                __atomic_fetch_add(&mp->numExpansions, 1, __ATOMIC_RELAXED);
+            }
+            return u;
+        }
+        u = lf_unit(mp, index);
+        /* if the unit was taken by another thread the tag has changed and the
+           compare and swap fails, so a stale next index is harmless */
+        uint32_t next = __atomic_load_n(&u->lfIndex, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&mp->lfHead, &head, LF_HEAD(LF_HEAD_TAG(head) + 1, next),
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    __atomic_store_n(&u->lfIndex, index, __ATOMIC_RELAXED);
+    return u;
+}
+
+/* sets up the lock free part of a pool and adds its first block */
+static int lf_init(af_mempool_t *mp)
+{
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+    while ((1 << mp->unitBits) < mp->numUnits) {
+        mp->unitBits++;
+    }
+    if (mp->unitBits > 30) {
+        AFLOG_ERR("af_mempool_create_lf_units:numUnits=%d", mp->numUnits);
         errno = EINVAL;
         return -1;
     }
+    mp->lfMaxBlocks = ((uint64_t)1 << (32 - mp->unitBits)) - 1;
+    if (mp->lfMaxBlocks > LF_MAX_BLOCKS) {
+        mp->lfMaxBlocks = LF_MAX_BLOCKS;
+    }
+    mp->lfBlocks = (prv_block_t **)calloc(mp->lfMaxBlocks, sizeof(prv_block_t *));
+    if (mp->lfBlocks == NULL) {
+        AFLOG_ERR("af_mempool_create_lf_blocks:errno=%d", errno);
+        return -1;
+    }
+
+    /* the first block is added the same way as an expansion */
+    prv_unit_t *u = lf_expand(mp);
+    if (u == NULL) {
+        free(mp->lfBlocks);
+        return -1;
+    }
+    lf_push(mp, u->lfIndex, u);
     return 0;
+#else
+    AFLOG_ERR("af_mempool_create_lf_unsupported");
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
 }
 
 af_mempool_t *af_mempool_create(uint32_t numUnits, uint32_t unitSize, uint32_t flags)
+{
+    return af_mempool_create_aligned(numUnits, unitSize,
+                                     (flags & AF_MEMPOOL_FLAG_CACHE_ALIGN) ? AF_MEMPOOL_CACHE_LINE_SIZE : MIN_ALIGN,
+                                     flags);
+}
+
+af_mempool_t *af_mempool_create_aligned(uint32_t numUnits, uint32_t unitSize, uint32_t align, uint32_t flags)
 {
     /* check parameters */
     if (unitSize == 0 || numUnits == 0) {
@@ -94,6 +763,29 @@ af_mempool_t *af_mempool_create(uint32_t numUnits, uint32_t unitSize, uint32_t f
         errno = EINVAL;
         return NULL;
     }
+    if (align < MIN_ALIGN) {
+        align = MIN_ALIGN;
+    }
+    if ((align & (align - 1)) != 0 || align > MAX_ALIGN) {
+        AFLOG_ERR("af_mempool_create_align:align=%d", align);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* each unit's header and data get their own aligned space, so with cache
+       line alignment no two units share a line; the header is at the end of
+       its space, right before the data */
+    uint64_t actualUnitSize = ALIGN_UP((uint64_t)sizeof(prv_unit_t), align) + ALIGN_UP((uint64_t)unitSize, align);
+    if (actualUnitSize > UINT32_MAX || actualUnitSize * numUnits > SIZE_MAX - MAX_ALIGN - 256) {
+        AFLOG_ERR("af_mempool_create_size:unitSize=%d,numUnits=%d,align=%d", unitSize, numUnits, align);
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((flags & AF_MEMPOOL_FLAG_THREAD_SAFE) && (flags & AF_MEMPOOL_FLAG_LOCK_FREE)) {
+        AFLOG_ERR("af_mempool_create_flags:flags=%d", flags);
+        errno = EINVAL;
+        return NULL;
+    }
 
     /* allocate the mempool structure */
     af_mempool_t *mp = (af_mempool_t *)calloc(1, sizeof(af_mempool_t));
@@ -107,131 +799,514 @@ af_mempool_t *af_mempool_create(uint32_t numUnits, uint32_t unitSize, uint32_t f
     mp->flags = flags;
     mp->unitSize = unitSize;
     mp->numUnits = numUnits;
+    mp->actualUnitSize = (uint32_t)actualUnitSize;
+    mp->align = align;
+
+    if (flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        if (lf_init(mp) < 0) {
+            free(mp);
+            return NULL;
+        }
+        AFLOG_DEBUG3("af_mempool_create:mp=%p,unitSize=%d,numUnits=%d,align=%d,flags=%d", mp, mp->unitSize, mp->numUnits, mp->align, mp->flags);
+        return mp;
+    }
+
     mp->blocks = alloc_new_block(mp);
     if (mp->blocks == NULL) {
         free(mp);
         return NULL;
     }
-    mp->free = mp->blocks->units;
+    mp->baseBlock = mp->blocks;
+    avail_add_head(mp, mp->blocks);
+    mp->numBlocks = 1;
 
-    AFLOG_DEBUG3("af_mempool_create:mp=%p,unitSize=%d,numUnits=%d,flags=%d", mp, mp->unitSize, mp->numUnits, mp->flags);
+    if (flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        int err = pthread_key_create(&mp->cacheKey, cache_destructor);
+        if (err != 0) {
+            AFLOG_ERR("af_mempool_create_key:err=%d", err);
+            free_block(mp, mp->blocks);
+            free(mp);
+            errno = err;
+            return NULL;
+        }
+        pthread_mutex_init(&mp->lock, NULL);
+    }
+
+    AFLOG_DEBUG3("af_mempool_create:mp=%p,unitSize=%d,numUnits=%d,align=%d,flags=%d", mp, mp->unitSize, mp->numUnits, mp->align, mp->flags);
     return mp;
 }
 
-void *af_mempool_alloc(af_mempool_t *mp)
+static inline void *mempool_alloc(af_mempool_t *mp)
 {
-    if (check_mempool(__func__, mp) < 0) {
+    static af_log_ratelimit_t rl;
+    if (check_mempool("af_mempool_alloc", mp, &rl) < 0) {
         return NULL;
     }
 
-    /* allocate new blocks if there are no free blocks */
-    if (mp->free == NULL) {
-        if ((mp->flags & AF_MEMPOOL_FLAG_EXPAND) == 0) {
-            AFLOG_ERR("af_mempool_alloc_no_expand");
-            errno = ENOSPC;
+    prv_unit_t *u;
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        u = lf_alloc(mp);
+        if (u == NULL) {
+            __atomic_fetch_add(&mp->numFailedAllocs, 1, __ATOMIC_RELAXED);
             return NULL;
-        } else {
-            prv_block_t *block = alloc_new_block(mp);
-            if (block == NULL) {
-                AFLOG_ERR("af_mempool_alloc_block_alloc");
-                errno = ENOSPC;
-                return NULL;
-            }
-
-            /* add to mempool's block linked list */
-            block->next = mp->blocks;
-            mp->blocks = block;
+        }
+        lf_update_in_use(mp, 1);
 
-            /* set free list to point to new blocks */
-            mp->free = block->units;
+        /* the block pointer in a lock free unit never changes */
+        AFLOG_DEBUG3("af_mempool_alloc:mp=%p,u=%p", mp, u);
+        return unit_data(mp, u);
+    } else if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        prv_cache_t *c = get_cache(mp);
+        if (c == NULL) {
+            return NULL;
+        }
+        if (c->count == 0 && cache_refill(mp, c) < 0) {
+            return NULL;
         }
+        u = c->units[--c->count];
+        u->lfIndex = c->id;
+        cache_count_allocs(c, 1);
+    } else {
+        u = pool_get_unit(mp);
+        if (u == NULL) {
+            mp->numFailedAllocs++;
+            return NULL;
+        }
+        mp->numAllocs++;
+        update_in_use(mp, 1);
     }
-    /* at this point we're guaranteed that there are blocks in free list */
-
-    /* allocate the block */
-    prv_unit_t *u = mp->free;
-    mp->free = u->u.next;
-
-    /* set up the magic number */
-    u->magic = s_unitMagic;
-    u->u.pool = mp;
 
     AFLOG_DEBUG3("af_mempool_alloc:mp=%p,u=%p", mp, u);
 
-    return (void *)(((uint8_t *)u) + sizeof(prv_unit_t));
+    return unit_data(mp, u);
+}
+
+void *af_mempool_alloc(af_mempool_t *mp)
+{
+    void *unit = mempool_alloc(mp);
+    AF_METRIC_MEMPOOL_ADD(unit ? AF_METRIC_MEMPOOL_ALLOC : AF_METRIC_MEMPOOL_ALLOC_FAILED, 1);
+    return unit;
 }
 
 void af_mempool_free(void *unit)
 {
     /* check if unit is valid */
     if (unit == NULL) {
-        AFLOG_ERR("af_mempool_free_unit_null");
+        AFLOG_ERR_RL("af_mempool_free_unit_null");
         return;
     }
     prv_unit_t *u = (prv_unit_t *)((uint8_t *)unit - sizeof(prv_unit_t));
     if (u->magic != s_unitMagic) {
-        AFLOG_ERR("af_mempool_free_unit_magic");
+        AFLOG_ERR_RL("af_mempool_free_unit_magic");
         return;
     }
 
-    af_mempool_t *mp = u->u.pool;
+    af_mempool_t *mp = u->u.block->pool;
 
     /* check if mempool is valid */
-    if (check_mempool(__func__, mp) < 0) {
+    static af_log_ratelimit_t rl;
+    if (check_mempool(__func__, mp, &rl) < 0) {
         return;
     }
     AFLOG_DEBUG3("af_mempool_free:mp=%p,u=%p", mp, u);
+    AF_METRIC_MEMPOOL_ADD(AF_METRIC_MEMPOOL_FREE, 1);
 
-    /* add unit to free list */
     u->magic = 0;
-    u->u.next = mp->free;
-    mp->free = u;
+
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        /* count the unit free before another thread can take it */
+        __atomic_fetch_sub(&mp->numInUse, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&mp->numFrees, 1, __ATOMIC_RELAXED);
+        lf_push(mp, __atomic_load_n(&u->lfIndex, __ATOMIC_RELAXED), u);
+        return;
+    }
+
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        /* a thread that only frees never gets a cache */
+        prv_cache_t *c = (prv_cache_t *)pthread_getspecific(mp->cacheKey);
+        if (c == NULL || u->lfIndex != c->id) {
+            /* the unit came from another thread's cache; give it straight
+               back to the pool so that a consumer thread doesn't keep units
+               its producer needs */
+            /* count first; putting the unit back can trim its block */
+            pthread_mutex_lock(&mp->lock);
+            count_pool_frees(mp, u->lfIndex, 1);
+            pool_put_unit(mp, u);
+            pthread_mutex_unlock(&mp->lock);
+            return;
+        }
+
+        /* add unit to this thread's cache, making room if necessary */
+        if (c->count >= CACHE_SIZE) {
+            cache_drain(mp, c, CACHE_BATCH);
+        }
+        c->units[c->count++] = u;
+        __atomic_store_n(&c->numFrees, c->numFrees + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* add unit to its block's free list */
+    pool_put_unit(mp, u);
+    mp->numInUse--;
+    mp->numFrees++;
+}
+
+static int mempool_alloc_bulk(af_mempool_t *mp, void **units, uint32_t numUnits)
+{
+    static af_log_ratelimit_t rl;
+    if (check_mempool("af_mempool_alloc_bulk", mp, &rl) < 0) {
+        return -1;
+    }
+    if (units == NULL) {
+        AFLOG_ERR_RL("af_mempool_alloc_bulk_units_null");
+        errno = EINVAL;
+        return -1;
+    }
+    if (numUnits == 0) {
+        return 0;
+    }
+
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        /* units can't be taken off a lock free list in one step */
+        uint32_t i;
+        for (i = 0; i < numUnits; i++) {
+            prv_unit_t *u = lf_alloc(mp);
+            if (u == NULL) {
+                break;
+            }
+            units[i] = unit_data(mp, u);
+        }
+        if (i < numUnits) {
+            /* give back what we got as one chain */
+            if (i > 0) {
+                uint32_t firstIndex = 0;
+                prv_unit_t *prev = NULL;
+                uint32_t j;
+                for (j = 0; j < i; j++) {
+                    prv_unit_t *u = (prv_unit_t *)((uint8_t *)units[j] - sizeof(prv_unit_t));
+                    uint32_t index = __atomic_load_n(&u->lfIndex, __ATOMIC_RELAXED);
+                    u->magic = 0;
+                    if (prev) {
+                        __atomic_store_n(&prev->lfIndex, index, __ATOMIC_RELAXED);
+                    } else {
+                        firstIndex = index;
+                    }
+                    prev = u;
+                }
+                lf_push(mp, firstIndex, prev);
+            }
+            __atomic_fetch_add(&mp->numFailedAllocs, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        lf_update_in_use(mp, numUnits);
+    } else if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        prv_cache_t *c = get_cache(mp);
+        if (c == NULL) {
+            return -1;
+        }
+
+        /* take what the cache can't supply from the pool first, so nothing
+           has to be put back if the pool can't supply it */
+        uint32_t fromCache = (c->count < numUnits ? c->count : numUnits);
+        uint32_t fromPool = numUnits - fromCache;
+        if (fromPool > 0) {
+            pthread_mutex_lock(&mp->lock);
+            if (pool_reserve(mp, fromPool) < 0) {
+                mp->numFailedAllocs++;
+                pthread_mutex_unlock(&mp->lock);
+                return -1;
+            }
+            pool_take_units(mp, &units[fromCache], fromPool);
+            pthread_mutex_unlock(&mp->lock);
+        }
+
+        uint32_t i;
+        for (i = 0; i < fromCache; i++) {
+            units[i] = unit_data(mp, c->units[--c->count]);
+        }
+        for (i = 0; i < numUnits; i++) {
+            ((prv_unit_t *)((uint8_t *)units[i] - sizeof(prv_unit_t)))->lfIndex = c->id;
+        }
+        cache_count_allocs(c, numUnits);
+    } else {
+        if (pool_reserve(mp, numUnits) < 0) {
+            mp->numFailedAllocs++;
+            return -1;
+        }
+        pool_take_units(mp, units, numUnits);
+        mp->numAllocs += numUnits;
+        update_in_use(mp, numUnits);
+    }
+
+    AFLOG_DEBUG3("af_mempool_alloc_bulk:mp=%p,numUnits=%d", mp, numUnits);
+    return 0;
+}
+
+int af_mempool_alloc_bulk(af_mempool_t *mp, void **units, uint32_t numUnits)
+{
+    int ret = mempool_alloc_bulk(mp, units, numUnits);
+    if (ret == 0) {
+        AF_METRIC_MEMPOOL_ADD(AF_METRIC_MEMPOOL_ALLOC, numUnits);
+    } else {
+        AF_METRIC_MEMPOOL_ADD(AF_METRIC_MEMPOOL_ALLOC_FAILED, 1);
+    }
+    return ret;
+}
+
+/* finishes returning a run of numUnits units to a pool; lock free units
+   are pushed as one chain linked through lfIndex, while the others have
+   already been put back with the pool locked */
+static void free_run_end(af_mempool_t *mp, uint32_t firstIndex, prv_unit_t *last, uint32_t numUnits)
+{
+    AFLOG_DEBUG3("af_mempool_free_bulk:mp=%p,numUnits=%d", mp, numUnits);
+    AF_METRIC_MEMPOOL_ADD(AF_METRIC_MEMPOOL_FREE, numUnits);
+
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        __atomic_fetch_sub(&mp->numInUse, numUnits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&mp->numFrees, numUnits, __ATOMIC_RELAXED);
+        lf_push(mp, firstIndex, last);
+        return;
+    }
+
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        /* the frees were counted against their caches as they were put back */
+        pthread_mutex_unlock(&mp->lock);
+    } else {
+        mp->numInUse -= numUnits;
+        mp->numFrees += numUnits;
+    }
+}
+
+void af_mempool_free_bulk(void **units, uint32_t numUnits)
+{
+    static af_log_ratelimit_t rl;
+
+    if (units == NULL) {
+        AFLOG_ERR_RL("af_mempool_free_bulk_units_null");
+        return;
+    }
+
+    /* consecutive units from the same pool are returned in one operation */
+    af_mempool_t *mp = NULL;
+    prv_unit_t *last = NULL;
+    uint32_t firstIndex = 0, runLen = 0;
+    uint32_t i;
+    for (i = 0; i < numUnits; i++) {
+        if (units[i] == NULL) {
+            AFLOG_ERR_RL("af_mempool_free_unit_null");
+            continue;
+        }
+        prv_unit_t *u = (prv_unit_t *)((uint8_t *)units[i] - sizeof(prv_unit_t));
+        if (u->magic != s_unitMagic) {
+            AFLOG_ERR_RL("af_mempool_free_unit_magic");
+            continue;
+        }
+
+        af_mempool_t *unitPool = u->u.block->pool;
+        if (unitPool != mp) {
+            if (check_mempool(__func__, unitPool, &rl) < 0) {
+                continue;
+            }
+            if (runLen > 0) {
+                free_run_end(mp, firstIndex, last, runLen);
+            }
+            mp = unitPool;
+            runLen = 0;
+            if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+                pthread_mutex_lock(&mp->lock);
+            }
+        }
+        u->magic = 0;
+
+        if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+            uint32_t index = __atomic_load_n(&u->lfIndex, __ATOMIC_RELAXED);
+            if (runLen == 0) {
+                firstIndex = index;
+            } else {
+                __atomic_store_n(&last->lfIndex, index, __ATOMIC_RELAXED);
+            }
+        } else {
+            if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+                count_pool_frees(mp, u->lfIndex, 1);
+            }
+            pool_put_unit(mp, u);
+        }
+        last = u;
+        runLen++;
+    }
+    if (runLen > 0) {
+        free_run_end(mp, firstIndex, last, runLen);
+    }
+}
+
+int af_mempool_trim(af_mempool_t *mp)
+{
+    static af_log_ratelimit_t rl;
+    if (check_mempool(__func__, mp, &rl) < 0) {
+        return -1;
+    }
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        /* blocks of a lock free pool can't be freed while other threads may
+           still be reading their units */
+        return 0;
+    }
+
+    uint32_t numFreed;
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        /* give back the calling thread's cached units so their blocks can go */
+        prv_cache_t *c = (prv_cache_t *)pthread_getspecific(mp->cacheKey);
+        if (c != NULL) {
+            cache_drain(mp, c, c->count);
+        }
+        pthread_mutex_lock(&mp->lock);
+        numFreed = pool_trim(mp, 0);
+        pthread_mutex_unlock(&mp->lock);
+    } else {
+        numFreed = pool_trim(mp, 0);
+    }
+    return numFreed;
+}
+
+int af_mempool_set_auto_trim(af_mempool_t *mp, uint32_t maxIdleBlocks, uint32_t keepIdleBlocks)
+{
+    static af_log_ratelimit_t rl;
+    if (check_mempool(__func__, mp, &rl) < 0) {
+        return -1;
+    }
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        AFLOG_ERR("af_mempool_set_auto_trim_lock_free");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (maxIdleBlocks != 0 && keepIdleBlocks >= maxIdleBlocks) {
+        AFLOG_ERR("af_mempool_set_auto_trim_param:maxIdleBlocks=%d,keepIdleBlocks=%d", maxIdleBlocks, keepIdleBlocks);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        pthread_mutex_lock(&mp->lock);
+    }
+    mp->autoTrimMax = maxIdleBlocks;
+    mp->autoTrimKeep = keepIdleBlocks;
+    if (mp->autoTrimMax && mp->numIdleBlocks > mp->autoTrimMax) {
+        pool_trim(mp, mp->autoTrimKeep);
+    }
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        pthread_mutex_unlock(&mp->lock);
+    }
+    return 0;
 }
 
 void af_mempool_destroy(af_mempool_t *mp)
 {
     /* check if mempool is valid */
-    if (check_mempool(__func__, mp) < 0) {
+    static af_log_ratelimit_t rl;
+    if (check_mempool(__func__, mp, &rl) < 0) {
         return;
     }
 
+    if (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) {
+        /* the caches are freed below, so make sure no destructors run on them */
+        pthread_key_delete(mp->cacheKey);
+        prv_cache_t *c = mp->caches;
+        while (c) {
+            prv_cache_t *next = c->next;
+            free(c);
+            c = next;
+        }
+        pthread_mutex_destroy(&mp->lock);
+    }
+
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        uint32_t i;
+        for (i = 0; i < mp->lfNumBlocks; i++) {
+            if (mp->lfBlocks[i]) {
+                free_block(mp, mp->lfBlocks[i]);
+            }
+        }
+        free(mp->lfBlocks);
+    }
+
     prv_block_t *block = mp->blocks;
     while (block) {
         prv_block_t *next = block->next;
-        free(block);
+        free_block(mp, block);
         block = next;
     }
 
+    mp->magic = 0;
     free(mp);
 }
 
-void af_mempool_log_stats(af_mempool_t *mp)
+int af_mempool_get_stats(af_mempool_t *mp, af_mempool_stats_t *stats)
 {
     /* check if mempool is valid */
-    if (check_mempool(__func__, mp) < 0) {
-        return;
+    static af_log_ratelimit_t rl;
+    if (check_mempool(__func__, mp, &rl) < 0) {
+        return -1;
     }
-
-    /* count the number of blocks */
-    int numBlocks = 0;
-    prv_block_t *block = mp->blocks;
-    while (block) {
-        numBlocks++;
-        block = block->next;
+    if (stats == NULL) {
+        AFLOG_ERR("af_mempool_get_stats_param");
+        errno = EINVAL;
+        return -1;
     }
 
-    /* count the number of free units */
-    int numFree = 0;
-    prv_unit_t *u = mp->free;
-    while (u) {
-        numFree++;
-        u = u->u.next;
-    }
+    if (mp->flags & AF_MEMPOOL_FLAG_LOCK_FREE) {
+        stats->numBlocks = __atomic_load_n(&mp->numBlocks, __ATOMIC_RELAXED);
+        stats->numInUse = __atomic_load_n(&mp->numInUse, __ATOMIC_RELAXED);
+        stats->highWater = __atomic_load_n(&mp->highWater, __ATOMIC_RELAXED);
+        stats->numExpansions = __atomic_load_n(&mp->numExpansions, __ATOMIC_RELAXED);
+        stats->numFailedAllocs = __atomic_load_n(&mp->numFailedAllocs, __ATOMIC_RELAXED);
+        stats->numTrimmed = 0;
+        stats->numAllocs = __atomic_load_n(&mp->numAllocs, __ATOMIC_RELAXED);
+        stats->numFrees = __atomic_load_n(&mp->numFrees, __ATOMIC_RELAXED);
+    } else {
+        int threadSafe = (mp->flags & AF_MEMPOOL_FLAG_THREAD_SAFE) != 0;
+        if (threadSafe) {
+            pthread_mutex_lock(&mp->lock);
+        }
+
+        stats->numBlocks = mp->numBlocks;
+        stats->numInUse = mp->numInUse;
+        stats->highWater = mp->highWater;
+        stats->numExpansions = mp->numExpansions;
+        stats->numFailedAllocs = mp->numFailedAllocs;
+        stats->numTrimmed = mp->numTrimmed;
+        stats->numAllocs = mp->numAllocs;
+        stats->numFrees = mp->numFrees;
 
-    /* get the total number of units */
-    int numTotal = numBlocks * mp->numUnits;
+        if (threadSafe) {
+            /* add in the counts of the threads that are still running */
+            prv_cache_t *c;
+            for (c = mp->caches; c; c = c->next) {
+                stats->numAllocs += __atomic_load_n(&c->numAllocs, __ATOMIC_RELAXED);
+                stats->numFrees += __atomic_load_n(&c->numFrees, __ATOMIC_RELAXED) +
+                                   __atomic_load_n(&c->numPoolFrees, __ATOMIC_RELAXED);
+            }
+            /* the counts are read while other threads change them */
+            uint64_t numInUse = (stats->numAllocs > stats->numFrees ? stats->numAllocs - stats->numFrees : 0);
+            stats->numInUse = (numInUse > UINT32_MAX ? UINT32_MAX : numInUse);
+            cache_sum_high_water(mp);
+            stats->highWater = (mp->highWater > stats->numInUse ? mp->highWater : stats->numInUse);
+            pthread_mutex_unlock(&mp->lock);
+        }
+    }
 
-    AFLOG_DEBUG2("af_mempool_log_stats:mp=%p,numBlocks=%d,numTotal=%d,numFree=%d,numUsed=%d,unitSize=%d",
-                 mp, numBlocks, numTotal, numFree, numTotal-numFree, mp->unitSize);
+    stats->numTotal = stats->numBlocks * mp->numUnits;
+    stats->unitSize = mp->unitSize;
+    return 0;
 }
 
+void af_mempool_log_stats(af_mempool_t *mp)
+{
+    af_mempool_stats_t stats;
+    if (af_mempool_get_stats(mp, &stats) < 0) {
+        return;
+    }
+
+    AFLOG_DEBUG2("af_mempool_log_stats:mp=%p,numBlocks=%d,numTotal=%d,numInUse=%d,highWater=%d,numAllocs=%llu,numFrees=%llu,numExpansions=%d,numFailedAllocs=%d,numTrimmed=%d,unitSize=%d",
+                 mp, stats.numBlocks, stats.numTotal, stats.numInUse, stats.highWater,
+                 (unsigned long long)stats.numAllocs, (unsigned long long)stats.numFrees,
+                 stats.numExpansions, stats.numFailedAllocs, stats.numTrimmed, stats.unitSize);
+}
@@ -9,14 +9,105 @@
 
 #include <stdint.h>
 
-#define AF_MEMPOOL_FLAG_EXPAND (1 << 0)  /* memory pool expands as needed */
+#define AF_MEMPOOL_FLAG_EXPAND      (1 << 0)  /* memory pool expands as needed */
+#define AF_MEMPOOL_FLAG_THREAD_SAFE (1 << 1)  /* pool may be used from several threads at once */
+#define AF_MEMPOOL_FLAG_LOCK_FREE   (1 << 2)  /* thread safe pool that never blocks */
+#define AF_MEMPOOL_FLAG_CACHE_ALIGN (1 << 3)  /* units start on their own cache line */
+#define AF_MEMPOOL_FLAG_MMAP        (1 << 4)  /* blocks are mapped with mmap instead of malloc */
+#define AF_MEMPOOL_FLAG_HUGEPAGE    (1 << 5)  /* blocks are mapped on huge pages if possible */
+#define AF_MEMPOOL_FLAG_ZERO        (1 << 6)  /* units are zeroed when allocated */
+
+#define AF_MEMPOOL_CACHE_LINE_SIZE  64
+
+/* Units are 8 byte aligned by default. With AF_MEMPOOL_FLAG_CACHE_ALIGN, or
+   an alignment passed to af_mempool_create_aligned, the pointer returned by
+   af_mempool_alloc is aligned as requested and each unit's data is padded
+   to a multiple of the alignment, so units handed to different threads
+   don't share cache lines.
+
+   AF_MEMPOOL_FLAG_HUGEPAGE maps each block with MAP_HUGETLB, rounding the
+   block up to a 2MB huge page. If no huge pages are reserved the block is
+   mapped normally and marked for transparent huge pages instead. It
+   implies AF_MEMPOOL_FLAG_MMAP. */
+
+/* Blocks are not initialized when they are added to the pool. Units are
+   handed out from the start of a block as they are first needed and only
+   freed units are kept on a free list, so creating or expanding a pool
+   costs the same whatever its size, and pages of a block that have never
+   been used don't count toward the process's resident memory. The
+   contents of a newly allocated unit are undefined unless the pool was
+   created with AF_MEMPOOL_FLAG_ZERO. */
+
+/* Thread safe pools keep a small cache of free units for each thread that
+   uses the pool. Allocations and frees are served from the calling thread's
+   cache without locking; the cache is refilled from or drained to the shared
+   pool in batches. A unit may be freed by a different thread than the one
+   that allocated it; such a unit goes straight back to the shared pool, so
+   a thread that only frees never holds units another thread needs. A
+   thread's cache is returned to the pool when the thread exits. */
+
+/* Lock free pools keep their free list in a single atomic word so that
+   allocating and freeing never takes a lock, even when the pool expands.
+   They are meant for threads that must not block, such as real time
+   threads. Expansion still calls the system allocator. The flag cannot be
+   combined with AF_MEMPOOL_FLAG_THREAD_SAFE. Pools are limited to 2^30
+   units per block, and af_mempool_create fails with EOPNOTSUPP on targets
+   without a 64 bit compare and swap instruction. */
 
 typedef struct af_mempool_struct af_mempool_t;
 
+/* pool statistics; all counts are maintained as the pool is used, so
+   af_mempool_get_stats is cheap enough to call periodically. Units held in
+   per-thread caches are free, not in use. Thread safe pools count in each
+   thread's cache, so their highWater is the sum of the threads' own high
+   water marks, which can be more than were ever in use at once. */
+typedef struct {
+    uint32_t numBlocks;        /* blocks currently allocated */
+    uint32_t numTotal;         /* units in all blocks */
+    uint32_t numInUse;         /* units currently allocated */
+    uint32_t highWater;        /* largest value numInUse has reached */
+    uint32_t numExpansions;    /* blocks added since the pool was created */
+    uint32_t numFailedAllocs;  /* allocations that returned NULL */
+    uint32_t numTrimmed;       /* blocks freed by trimming */
+    uint64_t numAllocs;        /* successful allocations */
+    uint64_t numFrees;         /* successful frees */
+    uint32_t unitSize;
+} af_mempool_stats_t;
+
 af_mempool_t *af_mempool_create(uint32_t numUnits, uint32_t unitSize, uint32_t flags);
+
+/* same as af_mempool_create but units are aligned to align bytes, which
+   must be a power of two no larger than 4096 */
+af_mempool_t *af_mempool_create_aligned(uint32_t numUnits, uint32_t unitSize, uint32_t align, uint32_t flags);
 void *af_mempool_alloc(af_mempool_t *pool);
 void af_mempool_free(void *unit);
+
+/* allocates numUnits units into units[]; either all of them are allocated
+   or, if the pool runs out, none are and -1 is returned with errno set */
+int af_mempool_alloc_bulk(af_mempool_t *pool, void **units, uint32_t numUnits);
+
+/* frees numUnits units; the units may come from different pools, but runs
+   of units from the same pool are returned to it in one operation */
+void af_mempool_free_bulk(void **units, uint32_t numUnits);
 void af_mempool_destroy(af_mempool_t *pool);
 void af_mempool_log_stats(af_mempool_t *pool);
 
+/* frees all blocks whose units are all free, except the block allocated
+   when the pool was created; returns the number of blocks freed or -1 with
+   errno set. For thread safe pools the calling thread's cache is emptied
+   first, but units held in other threads' caches keep their blocks alive.
+   Lock free pools are never trimmed. */
+int af_mempool_trim(af_mempool_t *pool);
+
+/* trims the pool automatically: once more than maxIdleBlocks blocks are
+   idle, idle blocks are freed until keepIdleBlocks remain. The gap between
+   the two avoids freeing and reallocating blocks when usage hovers around
+   a block boundary. maxIdleBlocks of 0 turns automatic trimming off, which
+   is the default. Not supported for lock free pools. */
+int af_mempool_set_auto_trim(af_mempool_t *pool, uint32_t maxIdleBlocks, uint32_t keepIdleBlocks);
+
+/* fills in stats; returns -1 with errno set on failure
+   safe to call from any thread for thread safe and lock free pools */
+int af_mempool_get_stats(af_mempool_t *pool, af_mempool_stats_t *stats);
+
 #endif // __AF_MEMPOOL_H__
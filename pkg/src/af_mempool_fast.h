@@ -0,0 +1,187 @@
+//
+// mempool_fast.h -- inline allocation for af_mempool
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __AF_MEMPOOL_FAST_H__
+#define __AF_MEMPOOL_FAST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "af_mempool.h"
+
+/* af_mempool_alloc_fast and af_mempool_free_fast are inline versions of
+   af_mempool_alloc and af_mempool_free. They handle the common case of a
+   pool without AF_MEMPOOL_FLAG_THREAD_SAFE, AF_MEMPOOL_FLAG_LOCK_FREE, or
+   AF_MEMPOOL_FLAG_ZERO taking a unit from, or giving one back to, a block
+   that stays partially used; everything else, including expansion and
+   trimming, goes to the library functions. The units they handle are
+   counted in the pool's stats but not in the mempool metrics counters.
+
+   The fast path doesn't check the pool or unit, so passing a bad pointer
+   or freeing a unit twice corrupts the pool. Define AF_MEMPOOL_CHECKED, or
+   build without BUILD_TARGET_RELEASE, and both functions call the checked
+   library functions instead.
+
+   The structures below are exposed only for these functions; their layout
+   may change between library versions, so code that includes this header
+   must be rebuilt along with the library. */
+
+#if !defined(BUILD_TARGET_RELEASE) && !defined(AF_MEMPOOL_CHECKED)
+#define AF_MEMPOOL_CHECKED
+#endif
+
+#define AF_MEMPOOL_UNIT_MAGIC 0xcefabeba
+
+/* pools with these flags always take the library path */
+#define AF_MEMPOOL_FLAGS_NOT_FAST (AF_MEMPOOL_FLAG_THREAD_SAFE | AF_MEMPOOL_FLAG_LOCK_FREE | AF_MEMPOOL_FLAG_ZERO)
+
+/* Each block keeps its own free list. Blocks with free units are kept on
+   the pool's avail list; allocation takes units from the block at the head
+   so busy blocks fill up, and a block whose units are all free (idle) is
+   moved to the tail where af_mempool_trim can find and release it.
+
+   Units are carved out of a block lazily: the free list only holds units
+   that have been freed, and when it's empty the next never used unit is
+   taken from the block. numFree counts both kinds. */
+typedef struct prv_block_struct {
+    struct prv_block_struct *next;      /* all blocks of the pool */
+    struct prv_block_struct *prev;
+    struct prv_block_struct *availNext; /* blocks with free units */
+    struct prv_block_struct *availPrev;
+    struct af_mempool_struct *pool;
+    struct prv_unit_struct *units;
+    struct prv_unit_struct *free;
+    uint32_t numFree;
+    uint32_t numCarved;                 /* units taken from the block so far */
+    size_t size;                        /* bytes allocated or mapped for the block */
+} prv_block_t;
+
+struct af_mempool_struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t unitSize;
+    uint32_t numUnits;
+    uint32_t actualUnitSize;         /* unit size including header and padding */
+    uint32_t align;                  /* alignment of the pointers handed out */
+    struct prv_block_struct *blocks;
+    struct prv_block_struct *baseBlock;  /* first block; never trimmed */
+    struct prv_block_struct *availHead;
+    struct prv_block_struct *availTail;
+    uint32_t numIdleBlocks;          /* idle blocks other than the base block */
+    uint32_t autoTrimMax;            /* trim when more blocks than this are idle; 0 is off */
+    uint32_t autoTrimKeep;           /* idle blocks left after an automatic trim */
+
+    /* statistics; thread safe pools count allocations and frees in each
+       thread's cache, so numInUse isn't kept, numAllocs and numFrees only
+       count threads that have exited, and highWater is updated when the
+       stats are read or a thread exits */
+    uint32_t numBlocks;
+    uint32_t numInUse;
+    uint32_t highWater;
+    uint32_t numExpansions;
+    uint32_t numFailedAllocs;
+    uint32_t numTrimmed;
+    uint64_t numAllocs;
+    uint64_t numFrees;
+
+    /* the following are only used with AF_MEMPOOL_FLAG_THREAD_SAFE */
+    pthread_mutex_t lock;            /* protects blocks, counters, and caches */
+    pthread_key_t cacheKey;          /* calling thread's prv_cache_t */
+    struct prv_cache_struct *caches;
+    uint32_t nextCacheId;
+    uint32_t numTaken;               /* units off the free lists, including cached units */
+
+    /* the following are only used with AF_MEMPOOL_FLAG_LOCK_FREE */
+    uint64_t lfHead;                 /* tagged index of first free unit */
+    uint32_t lfNumBlocks;            /* number of entries used in lfBlocks */
+    uint32_t lfMaxBlocks;
+    uint32_t unitBits;               /* bits of a unit index used for unit number */
+    uint32_t lfCarve;                /* index of the next never used unit; 0 if none */
+    struct prv_block_struct **lfBlocks;
+};
+
+/* magic is 0 if the block is free. Otherwise it's set to AF_MEMPOOL_UNIT_MAGIC
+   u.block is valid whenever the unit is not on its block's free list */
+typedef struct prv_unit_struct {
+    uint32_t magic;
+    /* lock free pools: the index of the next free unit while the unit is
+       free, and the unit's own index while it's allocated
+       thread safe pools: the id of the cache the unit was allocated from */
+    uint32_t lfIndex;
+    union {
+        struct prv_unit_struct *next;
+        struct prv_block_struct *block;
+    } u;
+} prv_unit_t;
+
+
+#ifdef AF_MEMPOOL_CHECKED
+
+static inline void *af_mempool_alloc_fast(af_mempool_t *pool)
+{
+    return af_mempool_alloc(pool);
+}
+
+static inline void af_mempool_free_fast(void *unit)
+{
+    af_mempool_free(unit);
+}
+
+#else // AF_MEMPOOL_CHECKED
+
+static inline void *af_mempool_alloc_fast(af_mempool_t *pool)
+{
+    prv_block_t *block = pool->availHead;
+
+    /* the block must neither be idle nor become full */
+    if ((pool->flags & AF_MEMPOOL_FLAGS_NOT_FAST) || block == NULL ||
+        block->numFree <= 1 || block->numFree >= pool->numUnits) {
+        return af_mempool_alloc(pool);
+    }
+
+    prv_unit_t *u = block->free;
+    if (u != NULL) {
+        block->free = u->u.next;
+    } else {
+        u = (prv_unit_t *)((uint8_t *)block->units + (size_t)block->numCarved++ * pool->actualUnitSize);
+    }
+    block->numFree--;
+    u->u.block = block;
+    u->magic = AF_MEMPOOL_UNIT_MAGIC;
+
+    pool->numAllocs++;
+    if (++pool->numInUse > pool->highWater) {
+        pool->highWater = pool->numInUse;
+    }
+    return (void *)(u + 1);
+}
+
+static inline void af_mempool_free_fast(void *unit)
+{
+    prv_unit_t *u = (prv_unit_t *)unit - 1;
+    prv_block_t *block = u->u.block;
+    af_mempool_t *pool = block->pool;
+
+    /* the block must neither have been full nor become idle */
+    if ((pool->flags & AF_MEMPOOL_FLAGS_NOT_FAST) ||
+        block->numFree == 0 || block->numFree + 1 >= pool->numUnits) {
+        af_mempool_free(unit);
+        return;
+    }
+
+    u->magic = 0;
+    u->u.next = block->free;
+    block->free = u;
+    block->numFree++;
+
+    pool->numInUse--;
+    pool->numFrees++;
+}
+
+#endif // AF_MEMPOOL_CHECKED
+
+#endif // __AF_MEMPOOL_FAST_H__
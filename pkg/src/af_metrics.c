@@ -0,0 +1,378 @@
+//
+// af_metrics.c -- counters and latency histograms for library operations
+//
+// The region starts out in anonymous memory. af_metrics_export copies it
+// into a shared file mapping and switches to the copy; threads find their
+// slot through the region pointer, so they follow the switch. The old
+// region is never unmapped, because a thread may still be adding to it.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "af_log.h"
+#include "af_metrics.h"
+
+#define OVERFLOW_SLOT 0
+
+static const char *s_builtinCounters[AF_METRIC_NUM_BUILTIN_COUNTERS] = {
+    "mempool_alloc",
+    "mempool_alloc_failed",
+    "mempool_free",
+    "mempool_expand",
+    "system",
+    "system_failed",
+    "log_messages",
+    "log_dropped",
+};
+
+static const char *s_builtinHistograms[AF_METRIC_NUM_BUILTIN_HISTOGRAMS] = {
+    "mempool_expand_ns",
+    "system_ns",
+    "log_ns",
+};
+
+static af_metrics_region_t *s_region;
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;   /* registration, slots, slot 0, and export */
+static pthread_key_t s_key;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static int s_timing;
+int g_afMetricsMempool;
+static char *s_exportPath;
+
+/* the slot index plus one; 0 until the thread records its first metric */
+static __thread uint32_t s_slot;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_slot(af_metrics_thread_t *to, af_metrics_thread_t *from)
+{
+    int i, j;
+    for (i = 0; i < AF_METRICS_MAX_COUNTERS; i++) {
+        to->counters[i] += from->counters[i];
+    }
+    for (i = 0; i < AF_METRICS_MAX_HISTOGRAMS; i++) {
+        to->histograms[i].count += from->histograms[i].count;
+        to->histograms[i].sum += from->histograms[i].sum;
+        for (j = 0; j < AF_METRICS_NUM_BUCKETS; j++) {
+            to->histograms[i].buckets[j] += from->histograms[i].buckets[j];
+        }
+    }
+}
+
+/* folds an exiting thread's slot into slot 0 and frees it */
+static void thread_exit(void *arg)
+{
+    uint32_t slot = (uint32_t)(uintptr_t)arg - 1;
+
+    pthread_mutex_lock(&s_lock);
+    af_metrics_thread_t *t = &s_region->threads[slot];
+    add_slot(&s_region->threads[OVERFLOW_SLOT], t);
+    memset(t->counters, 0, sizeof(t->counters));
+    memset(t->histograms, 0, sizeof(t->histograms));
+    __atomic_store_n(&t->inUse, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s_lock);
+    s_slot = 0;
+}
+
+/* an exported region is shared with the parent, so the child of a fork
+   starts a private one instead of writing into the parent's slots */
+static void fork_child(void)
+{
+    pthread_mutex_init(&s_lock, NULL);
+    if (s_exportPath) {
+        af_metrics_region_t *r = (af_metrics_region_t *)mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r != MAP_FAILED) {
+            memcpy(r, s_region, sizeof(*r));
+            memset(r->threads, 0, sizeof(r->threads));
+            r->threads[OVERFLOW_SLOT].inUse = 1;
+            if (s_slot) {
+                r->threads[s_slot - 1].inUse = 1;
+            }
+            r->pid = getpid();
+            __atomic_store_n(&s_region, r, __ATOMIC_RELEASE);
+        }
+        free(s_exportPath);
+        s_exportPath = NULL;
+    }
+}
+
+static void init_once(void)
+{
+    /* no logging here; the log path records metrics */
+    af_metrics_region_t *r = (af_metrics_region_t *)mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) {
+        return;
+    }
+
+    /* mmap'ed memory is already zero */
+    int i;
+    r->magic = AF_METRICS_MAGIC;
+    r->version = AF_METRICS_VERSION;
+    r->maxThreads = AF_METRICS_MAX_THREADS;
+    r->pid = getpid();
+    for (i = 0; i < AF_METRIC_NUM_BUILTIN_COUNTERS; i++) {
+        strcpy(r->counterNames[i], s_builtinCounters[i]);
+    }
+    for (i = 0; i < AF_METRIC_NUM_BUILTIN_HISTOGRAMS; i++) {
+        strcpy(r->histogramNames[i], s_builtinHistograms[i]);
+    }
+    r->numCounters = AF_METRIC_NUM_BUILTIN_COUNTERS;
+    r->numHistograms = AF_METRIC_NUM_BUILTIN_HISTOGRAMS;
+    r->threads[OVERFLOW_SLOT].inUse = 1;
+
+    pthread_key_create(&s_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+    __atomic_store_n(&s_region, r, __ATOMIC_RELEASE);
+}
+
+/* returns the calling thread's slot, taking one if it doesn't have one;
+   NULL if the region couldn't be created */
+static af_metrics_thread_t *get_slot(af_metrics_region_t **region)
+{
+    af_metrics_region_t *r = __atomic_load_n(&s_region, __ATOMIC_ACQUIRE);
+    if (s_slot) {
+        *region = r;
+        return &r->threads[s_slot - 1];
+    }
+
+    if (r == NULL) {
+        pthread_once(&s_once, init_once);
+        r = __atomic_load_n(&s_region, __ATOMIC_ACQUIRE);
+        if (r == NULL) {
+            return NULL;
+        }
+    }
+
+    uint32_t i, slot = OVERFLOW_SLOT;
+    pthread_mutex_lock(&s_lock);
+    r = s_region;
+    for (i = OVERFLOW_SLOT + 1; i < AF_METRICS_MAX_THREADS; i++) {
+        if (r->threads[i].inUse == 0) {
+            __atomic_store_n(&r->threads[i].inUse, 1, __ATOMIC_RELAXED);
+            slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+
+    if (slot != OVERFLOW_SLOT) {
+        pthread_setspecific(s_key, (void *)(uintptr_t)(slot + 1));
+    }
+    s_slot = slot + 1;
+    *region = r;
+    return &r->threads[slot];
+}
+
+void af_metrics_add(uint32_t counter, uint64_t n)
+{
+    af_metrics_region_t *r;
+    af_metrics_thread_t *t = get_slot(&r);
+    if (t == NULL || counter >= AF_METRICS_MAX_COUNTERS) {
+        return;
+    }
+
+    if (t == &r->threads[OVERFLOW_SLOT]) {
+        pthread_mutex_lock(&s_lock);
+        s_region->threads[OVERFLOW_SLOT].counters[counter] += n;
+        pthread_mutex_unlock(&s_lock);
+    } else {
+        t->counters[counter] += n;
+    }
+}
+
+static void histogram_add(af_metrics_histogram_t *h, uint64_t value)
+{
+    int bucket = (value ? 64 - __builtin_clzll(value) : 0);
+    if (bucket >= AF_METRICS_NUM_BUCKETS) {
+        bucket = AF_METRICS_NUM_BUCKETS - 1;
+    }
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket]++;
+}
+
+void af_metrics_observe(uint32_t histogram, uint64_t value)
+{
+    af_metrics_region_t *r;
+    af_metrics_thread_t *t = get_slot(&r);
+    if (t == NULL || histogram >= AF_METRICS_MAX_HISTOGRAMS) {
+        return;
+    }
+
+    if (t == &r->threads[OVERFLOW_SLOT]) {
+        pthread_mutex_lock(&s_lock);
+        histogram_add(&s_region->threads[OVERFLOW_SLOT].histograms[histogram], value);
+        pthread_mutex_unlock(&s_lock);
+    } else {
+        histogram_add(&t->histograms[histogram], value);
+    }
+}
+
+void af_metrics_set_timing(int on)
+{
+    __atomic_store_n(&s_timing, on != 0, __ATOMIC_RELAXED);
+}
+
+void af_metrics_set_mempool(int on)
+{
+    __atomic_store_n(&g_afMetricsMempool, on != 0, __ATOMIC_RELAXED);
+}
+
+uint64_t af_metrics_timer_start(void)
+{
+    return (__atomic_load_n(&s_timing, __ATOMIC_RELAXED) ? now_ns() : 0);
+}
+
+void af_metrics_timer_stop(uint32_t histogram, uint64_t start)
+{
+    if (start) {
+        af_metrics_observe(histogram, now_ns() - start);
+    }
+}
+
+static int register_name(const char *name, int histogram)
+{
+    if (name == NULL || name[0] == '\0' || strlen(name) >= AF_METRICS_NAME_SIZE) {
+        AFLOG_ERR("af_metrics_register_param:name_NULL=%d", name == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_once(&s_once, init_once);
+    if (s_region == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_lock);
+    af_metrics_region_t *r = s_region;
+    uint32_t *num = (histogram ? &r->numHistograms : &r->numCounters);
+    uint32_t max = (histogram ? AF_METRICS_MAX_HISTOGRAMS : AF_METRICS_MAX_COUNTERS);
+    char (*names)[AF_METRICS_NAME_SIZE] = (histogram ? r->histogramNames : r->counterNames);
+    int id = -1;
+    uint32_t i;
+    for (i = 0; i < *num; i++) {
+        if (strcmp(names[i], name) == 0) {
+            id = i;
+            break;
+        }
+    }
+    if (id < 0 && *num < max) {
+        strcpy(names[*num], name);
+        id = (*num)++;
+    }
+    pthread_mutex_unlock(&s_lock);
+
+    if (id < 0) {
+        AFLOG_ERR("af_metrics_register_full:name=%s", name);
+        errno = ENOSPC;
+    }
+    return id;
+}
+
+int af_metrics_register_counter(const char *name)
+{
+    return register_name(name, 0);
+}
+
+int af_metrics_register_histogram(const char *name)
+{
+    return register_name(name, 1);
+}
+
+int af_metrics_export(const char *path)
+{
+    char defaultPath[64];
+    if (path == NULL) {
+        snprintf(defaultPath, sizeof(defaultPath), "/dev/shm/af_metrics.%d", (int)getpid());
+        path = defaultPath;
+    }
+    pthread_once(&s_once, init_once);
+    if (s_region == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int err = errno;
+        AFLOG_ERR("af_metrics_export_open:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(af_metrics_region_t)) < 0) {
+        int err = errno;
+        AFLOG_ERR("af_metrics_export_truncate:errno=%d", err);
+        close(fd);
+        unlink(path);
+        errno = err;
+        return -1;
+    }
+    af_metrics_region_t *r = (af_metrics_region_t *)mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        int err = errno;
+        AFLOG_ERR("af_metrics_export_mmap:errno=%d", err);
+        unlink(path);
+        errno = err;
+        return -1;
+    }
+    char *exportPath = strdup(path);
+
+    /* counts added to the old region while it's copied are lost */
+    pthread_mutex_lock(&s_lock);
+    memcpy(r, s_region, sizeof(*r));
+    __atomic_store_n(&s_region, r, __ATOMIC_RELEASE);
+    free(s_exportPath);
+    s_exportPath = exportPath;
+    pthread_mutex_unlock(&s_lock);
+    return 0;
+}
+
+void af_metrics_unexport(void)
+{
+    pthread_mutex_lock(&s_lock);
+    if (s_exportPath) {
+        unlink(s_exportPath);
+        free(s_exportPath);
+        s_exportPath = NULL;
+    }
+    pthread_mutex_unlock(&s_lock);
+}
+
+int af_metrics_snapshot(af_metrics_thread_t *totals)
+{
+    if (totals == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_once(&s_once, init_once);
+    if (s_region == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int i;
+    memset(totals, 0, sizeof(*totals));
+    pthread_mutex_lock(&s_lock);
+    for (i = 0; i < AF_METRICS_MAX_THREADS; i++) {
+        add_slot(totals, &s_region->threads[i]);
+    }
+    pthread_mutex_unlock(&s_lock);
+    return 0;
+}
@@ -0,0 +1,148 @@
+//
+// af_metrics.h -- counters and latency histograms for library operations
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __AF_METRICS_H__
+#define __AF_METRICS_H__
+
+#include <stdint.h>
+
+/* Each thread that records a metric gets its own slot in the metrics
+   region, so recording is an unlocked add to memory no other thread
+   writes. A reader sums the slots. When a thread exits, its slot is added
+   into slot 0 and reused. Threads beyond AF_METRICS_MAX_THREADS share
+   slot 0 under a lock.
+
+   Histograms have log2 buckets: bucket 0 counts the value 0, bucket i
+   counts values from 2^(i-1) to 2^i - 1, and the last bucket counts
+   everything larger. Latencies are in nanoseconds. Timing an operation
+   costs two clock reads, so the library only times operations after
+   af_metrics_set_timing(1). Counting every mempool allocation and free
+   would cost more than the allocation itself, so those counters are only
+   kept after af_metrics_set_mempool(1); each pool's own counts are always
+   available from af_mempool_get_stats. Other counters are always kept.
+
+   af_metrics_export moves the region into a file, normally under
+   /dev/shm, that other processes can map to read the metrics while this
+   one runs; af_metricsdump prints it. Values are read without locking, so
+   a reader can see a count from an operation whose histogram entry hasn't
+   been added yet, and counts of a thread that is exiting can show up
+   twice for a moment. On 32 bit targets a value can also be read half
+   updated.
+
+   Building the library with AF_METRICS_DISABLE defined removes the
+   recording from the library's operations entirely. */
+
+#define AF_METRICS_MAGIC          0x544d4641   /* "AFMT" */
+#define AF_METRICS_VERSION        1
+#define AF_METRICS_MAX_COUNTERS   64
+#define AF_METRICS_MAX_HISTOGRAMS 16
+#define AF_METRICS_NUM_BUCKETS    40
+#define AF_METRICS_MAX_THREADS    64
+#define AF_METRICS_NAME_SIZE      48
+
+/* metrics recorded by the library */
+enum {
+    AF_METRIC_MEMPOOL_ALLOC = 0,       /* units allocated */
+    AF_METRIC_MEMPOOL_ALLOC_FAILED,    /* allocations that failed */
+    AF_METRIC_MEMPOOL_FREE,            /* units freed */
+    AF_METRIC_MEMPOOL_EXPAND,          /* blocks added to pools */
+    AF_METRIC_SYSTEM,                  /* af_util_system calls */
+    AF_METRIC_SYSTEM_FAILED,           /* af_util_system calls that returned nonzero */
+    AF_METRIC_LOG_MESSAGES,            /* messages logged with af_log_printf */
+    AF_METRIC_LOG_DROPPED,             /* messages dropped because the async ring was full */
+    AF_METRIC_NUM_BUILTIN_COUNTERS
+};
+
+enum {
+    AF_METRIC_MEMPOOL_EXPAND_NS = 0,   /* time to allocate a block */
+    AF_METRIC_SYSTEM_NS,               /* time af_util_system took */
+    AF_METRIC_LOG_NS,                  /* time af_log_printf took the caller */
+    AF_METRIC_NUM_BUILTIN_HISTOGRAMS
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[AF_METRICS_NUM_BUCKETS];
+} af_metrics_histogram_t;
+
+typedef struct {
+    uint32_t inUse;                    /* a thread owns the slot */
+    uint32_t reserved;
+    uint64_t counters[AF_METRICS_MAX_COUNTERS];
+    af_metrics_histogram_t histograms[AF_METRICS_MAX_HISTOGRAMS];
+} af_metrics_thread_t;
+
+/* the layout of the exported file */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numCounters;              /* names registered so far */
+    uint32_t numHistograms;
+    uint32_t maxThreads;
+    int32_t pid;
+    char counterNames[AF_METRICS_MAX_COUNTERS][AF_METRICS_NAME_SIZE];
+    char histogramNames[AF_METRICS_MAX_HISTOGRAMS][AF_METRICS_NAME_SIZE];
+    af_metrics_thread_t threads[AF_METRICS_MAX_THREADS];
+} af_metrics_region_t;
+
+/* register a metric and return its ID, or -1 with errno set if there's no
+   room. Registering a name again returns the same ID. */
+int af_metrics_register_counter(const char *name);
+int af_metrics_register_histogram(const char *name);
+
+void af_metrics_add(uint32_t counter, uint64_t n);
+void af_metrics_observe(uint32_t histogram, uint64_t value);
+
+/* turns timing of library operations on or off; off by default */
+void af_metrics_set_timing(int on);
+
+/* turns the mempool_alloc, mempool_alloc_failed, and mempool_free counters
+   on or off; off by default. The inline functions in af_mempool_fast.h
+   never record, so units they handle aren't counted */
+void af_metrics_set_mempool(int on);
+
+/* set by af_metrics_set_mempool; read inline so that the check costs the
+   mempool one load while the counters are off */
+extern int g_afMetricsMempool;
+
+/* returns the current monotonic time in nanoseconds if timing is on and 0
+   if it's off */
+uint64_t af_metrics_timer_start(void);
+
+/* adds the time since start to histogram, unless start is 0 */
+void af_metrics_timer_stop(uint32_t histogram, uint64_t start);
+
+/* moves the metrics into the file at path, creating or replacing it, so
+   other processes can read them. NULL means /dev/shm/af_metrics.<pid>.
+   returns -1 with errno set on failure */
+int af_metrics_export(const char *path);
+
+/* removes the exported file; the metrics keep being recorded */
+void af_metrics_unexport(void);
+
+/* sums the slots of all threads; returns -1 with errno set on failure */
+int af_metrics_snapshot(af_metrics_thread_t *totals);
+
+#ifdef AF_METRICS_DISABLE
+#define AF_METRIC_ADD(_counter, _n)
+#define AF_METRIC_MEMPOOL_ADD(_counter, _n)
+#define AF_METRIC_TIMER_START(_var)
+#define AF_METRIC_TIMER_STOP(_histogram, _var)
+#else
+#define AF_METRIC_ADD(_counter, _n) af_metrics_add(_counter, _n)
+#define AF_METRIC_MEMPOOL_ADD(_counter, _n) \
+    do { \
+        if (__builtin_expect(__atomic_load_n(&g_afMetricsMempool, __ATOMIC_RELAXED), 0)) { \
+            af_metrics_add(_counter, _n); \
+        } \
+    } while (0)
+#define AF_METRIC_TIMER_START(_var) uint64_t _var = af_metrics_timer_start()
+#define AF_METRIC_TIMER_STOP(_histogram, _var) af_metrics_timer_stop(_histogram, _var)
+#endif
+#define AF_METRIC_INC(_counter) AF_METRIC_ADD(_counter, 1)
+
+#endif // __AF_METRICS_H__
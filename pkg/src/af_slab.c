@@ -0,0 +1,252 @@
+//
+// af_slab.c -- size class allocator built on af_mempool
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define AF_LOG_MODULE "slab"
+#include "af_log.h"
+#include "af_mempool.h"
+#include "af_slab.h"
+
+#define ALIGN8(_x) (((_x) + 0x7) & ~(size_t)0x7)
+
+/* class number of allocations that came from malloc */
+#define LARGE_CLASS 0xffffffff
+
+static uint32_t s_slabMagic = 0xa5ab5ab5;
+static uint32_t s_slabPtrMagic = 0x5ab1a110;
+static uint32_t s_slabAlignedPtrMagic = 0x5ab1a164;  /* header padded to a cache line */
+
+static const uint32_t s_defaultClasses[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+
+/* immediately precedes every allocation; 8 bytes so the data stays 8 byte
+   aligned. With AF_MEMPOOL_FLAG_CACHE_ALIGN the header is at the end of a
+   cache line of padding, so the data starts on the next line */
+typedef struct {
+    uint32_t magic;
+    uint32_t classNum;
+} prv_slab_hdr_t;
+
+struct af_slab_struct {
+    uint32_t magic;
+    uint32_t numClasses;
+    uint32_t maxSize;                         /* size of the largest class */
+    uint32_t hdrSize;                         /* bytes from the unit to the data */
+    uint32_t ptrMagic;
+    uint32_t classSizes[AF_SLAB_MAX_CLASSES];
+    af_mempool_t *pools[AF_SLAB_MAX_CLASSES];
+    uint8_t *classLookup;                     /* class number by (size + 7) / 8 */
+    uint64_t numLargeAllocs;
+};
+
+/* returns -1 if pointer does not point to a slab allocator; each caller
+   passes its own rate limit so that a flood of errors from one function
+   doesn't hide the errors from the others */
+static int check_slab(const char *function, af_slab_t *slab, af_log_ratelimit_t *rl)
+{
+    const char *problem = NULL;
+    if (slab == NULL) {
+        problem = "slab_null";
+    } else if (slab->magic != s_slabMagic) {
+        problem = "slab_magic";
+    }
+    if (problem == NULL) {
+        return 0;
+    }
+
+    uint32_t suppressed;
+    if (af_log_ratelimit(rl, AF_LOG_RATELIMIT_BURST, AF_LOG_RATELIMIT_INTERVAL_MS, &suppressed)) {
+        if (suppressed) {
+            AFLOG_ERR("%s_%s:suppressed=%u", function, problem, suppressed);
+        }
+        AFLOG_ERR("%s_%s", function, problem);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+af_slab_t *af_slab_create(const uint32_t *classSizes, uint32_t numClasses, uint32_t unitsPerBlock, uint32_t flags)
+{
+    if (classSizes == NULL) {
+        classSizes = s_defaultClasses;
+        numClasses = sizeof(s_defaultClasses) / sizeof(s_defaultClasses[0]);
+    }
+
+    /* check parameters */
+    if (numClasses == 0 || numClasses > AF_SLAB_MAX_CLASSES || unitsPerBlock == 0) {
+        AFLOG_ERR("af_slab_create_param:numClasses=%d,unitsPerBlock=%d", numClasses, unitsPerBlock);
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t i;
+    for (i = 0; i < numClasses; i++) {
+        if (classSizes[i] == 0 || classSizes[i] > UINT32_MAX - AF_MEMPOOL_CACHE_LINE_SIZE ||
+            (i > 0 && classSizes[i] <= classSizes[i - 1])) {
+            AFLOG_ERR("af_slab_create_class:class=%d,size=%d", i, classSizes[i]);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    af_slab_t *slab = (af_slab_t *)calloc(1, sizeof(af_slab_t));
+    if (slab == NULL) {
+        AFLOG_ERR("af_slab_create_alloc:errno=%d", errno);
+        return NULL;
+    }
+    slab->magic = s_slabMagic;
+    slab->numClasses = numClasses;
+    slab->maxSize = classSizes[numClasses - 1];
+    if (flags & AF_MEMPOOL_FLAG_CACHE_ALIGN) {
+        slab->hdrSize = AF_MEMPOOL_CACHE_LINE_SIZE;
+        slab->ptrMagic = s_slabAlignedPtrMagic;
+    } else {
+        slab->hdrSize = sizeof(prv_slab_hdr_t);
+        slab->ptrMagic = s_slabPtrMagic;
+    }
+
+    slab->classLookup = (uint8_t *)malloc(ALIGN8(slab->maxSize) / 8 + 1);
+    if (slab->classLookup == NULL) {
+        AFLOG_ERR("af_slab_create_lookup:errno=%d", errno);
+        free(slab);
+        return NULL;
+    }
+
+    for (i = 0; i < numClasses; i++) {
+        slab->classSizes[i] = classSizes[i];
+        slab->pools[i] = af_mempool_create(unitsPerBlock, slab->hdrSize + classSizes[i],
+                                           flags | AF_MEMPOOL_FLAG_EXPAND);
+        if (slab->pools[i] == NULL) {
+            AFLOG_ERR("af_slab_create_pool:class=%d,errno=%d", i, errno);
+            af_slab_destroy(slab);
+            return NULL;
+        }
+    }
+
+    /* slot n covers sizes (n - 1) * 8 + 1 to n * 8; map it to the smallest
+       class that fits the smallest size in the slot */
+    uint32_t classNum = 0, slot;
+    for (slot = 0; slot <= ALIGN8(slab->maxSize) / 8; slot++) {
+        uint32_t minSize = (slot == 0 ? 0 : (slot - 1) * 8 + 1);
+        while (classNum < numClasses - 1 && slab->classSizes[classNum] < minSize) {
+            classNum++;
+        }
+        slab->classLookup[slot] = classNum;
+    }
+
+    AFLOG_DEBUG3("af_slab_create:slab=%p,numClasses=%d,maxSize=%d,flags=%d", slab, numClasses, slab->maxSize, flags);
+    return slab;
+}
+
+void *af_slab_alloc(af_slab_t *slab, size_t size)
+{
+    static af_log_ratelimit_t rl;
+    if (check_slab(__func__, slab, &rl) < 0) {
+        return NULL;
+    }
+
+    uint8_t *unit;
+    uint32_t classNum;
+    if (size <= slab->maxSize) {
+        /* the lookup can only undershoot when class sizes aren't multiples
+           of 8, and then by the classes that share the size's 8 byte slot */
+        classNum = slab->classLookup[(size + 7) >> 3];
+        while (slab->classSizes[classNum] < size) {
+            classNum++;
+        }
+        unit = (uint8_t *)af_mempool_alloc(slab->pools[classNum]);
+    } else {
+        if (size > SIZE_MAX - slab->hdrSize) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        classNum = LARGE_CLASS;
+        if (slab->hdrSize == sizeof(prv_slab_hdr_t)) {
+            unit = (uint8_t *)malloc(slab->hdrSize + size);
+        } else {
+            void *p;
+            int err = posix_memalign(&p, AF_MEMPOOL_CACHE_LINE_SIZE, slab->hdrSize + size);
+            unit = (err == 0 ? (uint8_t *)p : NULL);
+            if (err != 0) {
+                errno = err;
+            }
+        }
+        __atomic_fetch_add(&slab->numLargeAllocs, 1, __ATOMIC_RELAXED);
+    }
+    if (unit == NULL) {
+        AFLOG_ERR_RL("af_slab_alloc_failed:size=%zu,errno=%d", size, errno);
+        return NULL;
+    }
+
+    prv_slab_hdr_t *hdr = (prv_slab_hdr_t *)(unit + slab->hdrSize) - 1;
+    hdr->magic = slab->ptrMagic;
+    hdr->classNum = classNum;
+    return (void *)(hdr + 1);
+}
+
+void af_slab_free(void *ptr)
+{
+    if (ptr == NULL) {
+        AFLOG_ERR_RL("af_slab_free_ptr_null");
+        return;
+    }
+
+    prv_slab_hdr_t *hdr = (prv_slab_hdr_t *)ptr - 1;
+    size_t hdrSize;
+    if (hdr->magic == s_slabPtrMagic) {
+        hdrSize = sizeof(prv_slab_hdr_t);
+    } else if (hdr->magic == s_slabAlignedPtrMagic) {
+        hdrSize = AF_MEMPOOL_CACHE_LINE_SIZE;
+    } else {
+        AFLOG_ERR_RL("af_slab_free_ptr_magic");
+        return;
+    }
+    hdr->magic = 0;
+
+    void *unit = (uint8_t *)ptr - hdrSize;
+    if (hdr->classNum == LARGE_CLASS) {
+        free(unit);
+    } else {
+        /* the pool unit knows which pool it came from */
+        af_mempool_free(unit);
+    }
+}
+
+void af_slab_destroy(af_slab_t *slab)
+{
+    static af_log_ratelimit_t rl;
+    if (check_slab(__func__, slab, &rl) < 0) {
+        return;
+    }
+
+    uint32_t i;
+    for (i = 0; i < slab->numClasses; i++) {
+        if (slab->pools[i]) {
+            af_mempool_destroy(slab->pools[i]);
+        }
+    }
+    free(slab->classLookup);
+    slab->magic = 0;
+    free(slab);
+}
+
+void af_slab_log_stats(af_slab_t *slab)
+{
+    static af_log_ratelimit_t rl;
+    if (check_slab(__func__, slab, &rl) < 0) {
+        return;
+    }
+
+    uint32_t i;
+    for (i = 0; i < slab->numClasses; i++) {
+        AFLOG_DEBUG2("af_slab_log_stats:slab=%p,class=%d,size=%d", slab, i, slab->classSizes[i]);
+        af_mempool_log_stats(slab->pools[i]);
+    }
+    AFLOG_DEBUG2("af_slab_log_stats:slab=%p,numLargeAllocs=%llu", slab,
+                 (unsigned long long)__atomic_load_n(&slab->numLargeAllocs, __ATOMIC_RELAXED));
+}
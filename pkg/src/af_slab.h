@@ -0,0 +1,43 @@
+//
+// af_slab.h -- size class allocator built on af_mempool
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __AF_SLAB_H__
+#define __AF_SLAB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A slab allocator owns one memory pool per size class. af_slab_alloc
+   picks the smallest class that fits the request with a table lookup, and
+   requests larger than the largest class fall back to malloc. Every
+   allocation carries a small header naming its class, so af_slab_free
+   needs only the pointer.
+
+   The flags are passed to af_mempool_create for each class pool;
+   AF_MEMPOOL_FLAG_EXPAND is always added. Use AF_MEMPOOL_FLAG_THREAD_SAFE
+   or AF_MEMPOOL_FLAG_LOCK_FREE if the allocator is shared by threads.
+   With AF_MEMPOOL_FLAG_CACHE_ALIGN the header is padded to a cache line,
+   so every pointer returned, including those from malloc, starts a cache
+   line; each allocation then takes a line more than its class size. */
+
+#define AF_SLAB_MAX_CLASSES 32
+
+typedef struct af_slab_struct af_slab_t;
+
+/* classSizes lists the size classes in increasing order; pass NULL to use
+   the default classes of 16, 32, 64, 128, 256, 512, 1024, and 2048 bytes.
+   unitsPerBlock is the number of units each class pool allocates at a time.
+   returns NULL with errno set on failure */
+af_slab_t *af_slab_create(const uint32_t *classSizes, uint32_t numClasses, uint32_t unitsPerBlock, uint32_t flags);
+
+/* returns NULL with errno set on failure */
+void *af_slab_alloc(af_slab_t *slab, size_t size);
+
+void af_slab_free(void *ptr);
+void af_slab_destroy(af_slab_t *slab);
+void af_slab_log_stats(af_slab_t *slab);
+
+#endif // __AF_SLAB_H__
@@ -0,0 +1,195 @@
+//
+// af_spawn.c -- runs commands without a shell or a fork of the caller
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define AF_LOG_MODULE "util"
+#include "af_log.h"
+#include "af_spawn.h"
+
+extern char **environ;
+
+struct af_spawn_struct {
+    pid_t pid;
+    int fd;          /* pidfd or -1 */
+    int exited;
+    int status;
+};
+
+void af_spawn_options_init(af_spawn_options_t *options)
+{
+    if (options) {
+        memset(options, 0, sizeof(*options));
+        options->stdinFd = AF_SPAWN_FD_INHERIT;
+        options->stdoutFd = AF_SPAWN_FD_INHERIT;
+        options->stderrFd = AF_SPAWN_FD_INHERIT;
+    }
+}
+
+static int add_fd_action(posix_spawn_file_actions_t *actions, int fd, int target)
+{
+    if (fd == AF_SPAWN_FD_NULL) {
+        return posix_spawn_file_actions_addopen(actions, target, "/dev/null", (target == 0 ? O_RDONLY : O_WRONLY), 0);
+    }
+    if (fd >= 0 && fd != target) {
+        return posix_spawn_file_actions_adddup2(actions, fd, target);
+    }
+    return 0;
+}
+
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+af_spawn_t *af_spawn(char *const argv[], const af_spawn_options_t *options)
+{
+    if (argv == NULL || argv[0] == NULL) {
+        AFLOG_ERR("af_spawn_param:argv_NULL=%d", argv == NULL);
+        errno = EINVAL;
+        return NULL;
+    }
+    af_spawn_options_t defaults;
+    if (options == NULL) {
+        af_spawn_options_init(&defaults);
+        options = &defaults;
+    }
+
+    af_spawn_t *spawn = (af_spawn_t *)calloc(1, sizeof(af_spawn_t));
+    if (spawn == NULL) {
+        AFLOG_ERR("af_spawn_calloc:errno=%d", errno);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    /* the caller's threads may block or catch signals the program expects */
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigfillset(&mask);
+    sigdelset(&mask, SIGKILL);
+    sigdelset(&mask, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    err = add_fd_action(&actions, options->stdinFd, 0);
+    if (err == 0) {
+        err = add_fd_action(&actions, options->stdoutFd, 1);
+    }
+    if (err == 0) {
+        err = add_fd_action(&actions, options->stderrFd, 2);
+    }
+    if (err == 0) {
+        char *const *envp = (options->envp ? options->envp : environ);
+        if (options->path) {
+            err = posix_spawn(&spawn->pid, options->path, &actions, &attr, argv, envp);
+        } else {
+            err = posix_spawnp(&spawn->pid, argv[0], &actions, &attr, argv, envp);
+        }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        AFLOG_ERR("af_spawn_spawn:errno=%d,program=%s", err, options->path ? options->path : argv[0]);
+        free(spawn);
+        errno = err;
+        return NULL;
+    }
+
+    spawn->fd = pidfd_open(spawn->pid);
+    AFLOG_DEBUG2("af_spawn:pid=%d,fd=%d,program=%s", spawn->pid, spawn->fd, options->path ? options->path : argv[0]);
+    return spawn;
+}
+
+pid_t af_spawn_pid(af_spawn_t *spawn)
+{
+    return (spawn ? spawn->pid : -1);
+}
+
+int af_spawn_fd(af_spawn_t *spawn)
+{
+    return (spawn ? spawn->fd : -1);
+}
+
+int af_spawn_wait(af_spawn_t *spawn, int *status, int noHang)
+{
+    if (spawn == NULL) {
+        AFLOG_ERR("af_spawn_wait_param");
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (!spawn->exited) {
+        pid_t pid = waitpid(spawn->pid, &spawn->status, noHang ? WNOHANG : 0);
+        if (pid == spawn->pid) {
+            spawn->exited = 1;
+        } else if (pid == 0) {
+            return 0;
+        } else if (errno != EINTR) {
+            int err = errno;
+            AFLOG_ERR("af_spawn_wait_waitpid:pid=%d,errno=%d", spawn->pid, err);
+            errno = err;
+            return -1;
+        }
+    }
+
+    if (status) {
+        *status = spawn->status;
+    }
+    return 1;
+}
+
+void af_spawn_destroy(af_spawn_t *spawn)
+{
+    if (spawn) {
+        if (!spawn->exited) {
+            af_spawn_wait(spawn, NULL, 0);
+        }
+        if (spawn->fd >= 0) {
+            close(spawn->fd);
+        }
+        free(spawn);
+    }
+}
+
+int af_spawn_run(char *const argv[], const af_spawn_options_t *options)
+{
+    af_spawn_t *spawn = af_spawn(argv, options);
+    if (spawn == NULL) {
+        return -1;
+    }
+    int status = -1;
+    int ret = af_spawn_wait(spawn, &status, 0);
+    int err = errno;
+    af_spawn_destroy(spawn);
+    if (ret < 0) {
+        errno = err;
+        return -1;
+    }
+    return status;
+}
@@ -0,0 +1,66 @@
+//
+// af_spawn.h -- runs commands without a shell or a fork of the caller
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __AF_SPAWN_H__
+#define __AF_SPAWN_H__
+
+#include <sys/types.h>
+
+/* af_spawn starts a program with posix_spawn, which shares the caller's
+   memory with the child until it execs, so starting a command costs the
+   same however large the caller is. The program gets argv as is; nothing
+   is interpreted by a shell.
+
+   The child starts with all signals unblocked and at their default
+   action. Descriptors that aren't close-on-exec are inherited, as they
+   are with system(3).
+
+   The child must be waited for with af_spawn_wait, either by blocking or
+   by polling after af_spawn_fd becomes readable, for example in an epoll
+   loop. */
+
+#define AF_SPAWN_FD_INHERIT -1   /* the child uses the caller's descriptor */
+#define AF_SPAWN_FD_NULL    -2   /* the child uses /dev/null */
+
+typedef struct {
+    const char *path;        /* program to run; NULL to look argv[0] up in PATH */
+    char *const *envp;       /* environment; NULL to inherit the caller's */
+    int stdinFd;             /* descriptor for the child's standard input, or AF_SPAWN_FD_... */
+    int stdoutFd;
+    int stderrFd;
+} af_spawn_options_t;
+
+typedef struct af_spawn_struct af_spawn_t;
+
+/* sets the options to inherit everything */
+void af_spawn_options_init(af_spawn_options_t *options);
+
+/* starts argv[0] with the arguments in argv, which ends with NULL. options
+   may be NULL. returns NULL with errno set if the program couldn't be
+   started, including ENOENT if it doesn't exist */
+af_spawn_t *af_spawn(char *const argv[], const af_spawn_options_t *options);
+
+pid_t af_spawn_pid(af_spawn_t *spawn);
+
+/* returns a descriptor that becomes readable when the child exits, or -1
+   if the kernel doesn't support pidfds. The descriptor is closed by
+   af_spawn_destroy */
+int af_spawn_fd(af_spawn_t *spawn);
+
+/* waits for the child to exit and sets *status, if status isn't NULL, to
+   its wait status. If noHang is nonzero and the child is still running,
+   returns 0 right away. returns 1 once the child has exited, or -1 with
+   errno set on failure. Later calls return 1 with the same status */
+int af_spawn_wait(af_spawn_t *spawn, int *status, int noHang);
+
+/* frees the handle, first waiting for the child if it hasn't been */
+void af_spawn_destroy(af_spawn_t *spawn);
+
+/* starts argv like af_spawn and waits for it. returns the wait status, or
+   -1 with errno set if the program couldn't be started */
+int af_spawn_run(char *const argv[], const af_spawn_options_t *options);
+
+#endif // __AF_SPAWN_H__
@@ -14,18 +14,176 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <ctype.h>
 
+#define AF_LOG_MODULE "util"
 #include "af_log.h"
 #include "af_util.h"
+#include "af_metrics.h"
+#include "af_spawn.h"
+#include "af_exec.h"
+#include "file_cache.h"
+#include "kvp_file.h"
+#include "hex_kernel.h"
 #include "build_info.h"
 
-#define CMD_BUF_SIZE 256
+#define CMD_BUF_SIZE  256
+#define READ_BUF_SIZE 4096
+#define CMD_MAX_WORDS 32
+
+/* characters that mean the shell has work to do beyond splitting words */
+static const char s_shellChars[] = "|&;<>()$`\\\"'*?[]{}#~=%!\n";
+
+/* builtins with no program of the same name, or whose program would do
+   nothing useful in a child */
+static const char *s_shellBuiltins[] = {
+    ".", "alias", "break", "cd", "command", "continue", "eval", "exec", "exit",
+    "export", "hash", "local", "read", "readonly", "return", "set", "shift",
+    "source", "times", "trap", "type", "ulimit", "umask", "unalias", "unset",
+    "wait", NULL
+};
+
+static int needs_shell(const char *cmd)
+{
+    if (strpbrk(cmd, s_shellChars)) {
+        return 1;
+    }
+
+    cmd += strspn(cmd, " \t");
+    size_t len = strcspn(cmd, " \t");
+    if (len == 0) {
+        return 1;
+    }
+    int i;
+    for (i = 0; s_shellBuiltins[i]; i++) {
+        if (strlen(s_shellBuiltins[i]) == len && strncmp(cmd, s_shellBuiltins[i], len) == 0) {
+            return 1;
+        }
+    }
+
+    int numWords = 0;
+    while (*cmd) {
+        if (++numWords > CMD_MAX_WORDS) {
+            return 1;
+        }
+        cmd += strcspn(cmd, " \t");
+        cmd += strspn(cmd, " \t");
+    }
+    return 0;
+}
+
+/* commands running in any thread; SIGINT and SIGQUIT are ignored while
+   there are any */
+static pthread_mutex_t s_sigLock = PTHREAD_MUTEX_INITIALIZER;
+static int s_numCommands;
+static struct sigaction s_oldInt, s_oldQuit;
+
+/* handles signals around a command as system() does: SIGINT and SIGQUIT
+   go to the command rather than the caller, and SIGCHLD is blocked so a
+   handler that reaps any child can't take the command's status. The
+   child gets the default handlers and an empty mask from af_spawn */
+static void command_signals_begin(sigset_t *oldMask)
+{
+    struct sigaction ignore;
+    sigset_t mask;
+
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+
+    pthread_mutex_lock(&s_sigLock);
+    if (s_numCommands++ == 0) {
+        sigaction(SIGINT, &ignore, &s_oldInt);
+        sigaction(SIGQUIT, &ignore, &s_oldQuit);
+    }
+    pthread_mutex_unlock(&s_sigLock);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, oldMask);
+}
+
+static void command_signals_end(const sigset_t *oldMask)
+{
+    int err = errno;
+
+    pthread_mutex_lock(&s_sigLock);
+    if (--s_numCommands == 0) {
+        sigaction(SIGINT, &s_oldInt, NULL);
+        sigaction(SIGQUIT, &s_oldQuit, NULL);
+    }
+    pthread_mutex_unlock(&s_sigLock);
+
+    pthread_sigmask(SIG_SETMASK, oldMask, NULL);
+    errno = err;
+}
+
+static int spawn_command(char *cmd)
+{
+    char *argv[CMD_MAX_WORDS + 1];
+    af_spawn_options_t options;
+
+    af_spawn_options_init(&options);
+    if (needs_shell(cmd)) {
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = cmd;
+        argv[3] = NULL;
+        options.path = "/bin/sh";
+        return af_spawn_run(argv, &options);
+    }
+
+    int n = 0;
+    char *save, *word;
+    for (word = strtok_r(cmd, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        argv[n++] = word;
+    }
+    argv[n] = NULL;
+
+    int status = af_spawn_run(argv, &options);
+    if (status == -1 && (errno == ENOENT || errno == EACCES)) {
+        /* what the shell returns when it can't run the program */
+        status = (errno == ENOENT ? 127 : 126) << 8;
+    }
+    return status;
+}
+
+/* runs the command the way system() does and returns the wait status, or
+   -1 if it couldn't be started or timed out in the af_exec helper. A
+   command the shell would only split into words is run directly, saving
+   the start of the shell; cmd is modified in that case */
+static int run_command(char *cmd)
+{
+    if (af_exec_used_for_system()) {
+        af_exec_result_t result;
+        if (af_exec_run(cmd, 0, NULL, 0, &result) < 0) {
+            return -1;
+        }
+        if (result.timedOut) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return result.status;
+    }
+
+    sigset_t oldMask;
+    command_signals_begin(&oldMask);
+    int status = spawn_command(cmd);
+    command_signals_end(&oldMask);
+    return status;
+}
 
 /* af_util_system
  *
- * Helper function for sending system commands
+ * Helper function for sending system commands. The command is started
+ * with af_spawn, so the caller isn't forked, and through /bin/sh only if
+ * it uses shell syntax or builtins. If the af_exec helper is running with
+ * useForSystem set, the helper runs the command instead.
  *
  * return
  *  -1     - on error  (please see 'system' return vlaue)
@@ -36,6 +194,7 @@ int af_util_system(const char *format, ...)
     va_list args;
     int nwritten, rc;
     char buf[CMD_BUF_SIZE];
+    char *cmd = buf;
     static short s_executed = 0;
 
     if (!s_executed)
@@ -48,13 +207,30 @@ int af_util_system(const char *format, ...)
     nwritten = vsnprintf(buf, sizeof(buf), format, args);
     va_end(args);
 
-    if (nwritten >= sizeof(buf) || nwritten < 0) {
+    if (nwritten < 0) {
+        cmd = NULL;
+    } else if (nwritten >= (int)sizeof(buf)) {
+        cmd = (char *)malloc(nwritten + 1);
+        if (cmd != NULL) {
+            va_start(args, format);
+            vsnprintf(cmd, nwritten + 1, format, args);
+            va_end(args);
+        }
+    }
+    if (cmd == NULL) {
         AFLOG_ERR("af_util_system::failed to prepare command");
         return -1;
     }
-    AFLOG_DEBUG2("af_util_system::%s", buf);
-    rc = system(buf);
+    AFLOG_DEBUG2("af_util_system::%s", cmd);
+    AF_METRIC_INC(AF_METRIC_SYSTEM);
+    AF_METRIC_TIMER_START(start);
+    rc = run_command(cmd);
+    AF_METRIC_TIMER_STOP(AF_METRIC_SYSTEM_NS, start);
+    if (cmd != buf) {
+        free(cmd);
+    }
     if (rc != 0) {
+        AF_METRIC_INC(AF_METRIC_SYSTEM_FAILED);
         if (rc == -1) {
             AFLOG_ERR("system:returned -1; errno=%d", errno);
         } else {
@@ -76,6 +252,10 @@ int af_util_system(const char *format, ...)
  */
 int8_t af_util_file_exists(const char *filename)
 {
+    int cached = file_cache_exists(filename);
+    if (cached >= 0) {
+        return (cached);
+    }
     if (filename != NULL) {
         if (access(filename, R_OK ) != -1 ) {
             // file exists
@@ -86,6 +266,32 @@ int8_t af_util_file_exists(const char *filename)
 }
 
 
+/* reads until n bytes or the end of the file. With atStart the read
+   starts at offset 0 wherever the file offset is, except on pipes,
+   sockets, and terminals, which can only be read from where they are */
+static ssize_t read_fd(int fd, char *buf, size_t n, int atStart)
+{
+    size_t nread = 0;
+    while (nread < n) {
+        ssize_t ret = (atStart ? pread(fd, buf + nread, n - nread, nread) : read(fd, buf + nread, n - nread));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ESPIPE && atStart) {
+                atStart = 0;
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        nread += ret;
+    }
+    return nread;
+}
+
 /* af_util_read_file
  *
  * read n size of data from the given file
@@ -98,7 +304,6 @@ int8_t af_util_file_exists(const char *filename)
  */
 uint32_t af_util_read_file(const char *fname, char *buf, size_t  n)
 {
-    FILE  *fp = NULL;
     uint32_t  nread = 0;
 
     if (buf == NULL) {
@@ -106,10 +311,16 @@ uint32_t af_util_read_file(const char *fname, char *buf, size_t  n)
         return (nread);
     }
 
-    fp = fopen(fname, "r");
-    if (fp) {
-        nread = fread(buf, 1, n, fp);
-        fclose (fp);
+    ssize_t cached = file_cache_read(fname, buf, n);
+    if (cached >= 0) {
+        return (cached);
+    }
+
+    int fd = (fname ? open(fname, O_RDONLY | O_CLOEXEC) : -1);
+    if (fd >= 0) {
+        ssize_t ret = read_fd(fd, buf, n, 0);
+        nread = (ret < 0 ? 0 : ret);
+        close(fd);
     }
     else {
         AFLOG_ERR("af_util_read_file:: Unable to open the file (%s)", ((fname==NULL) ? "--":fname));
@@ -118,9 +329,121 @@ uint32_t af_util_read_file(const char *fname, char *buf, size_t  n)
     return (nread);
 }
 
-char *af_util_buffer_to_hex(char *dest, size_t dest_len, const uint8_t *source, size_t source_len) {
-    static const char HEX[] = "0123456789abcdef";
+struct af_util_file_struct {
+    int fd;
+};
+
+af_util_file_t *af_util_file_open(const char *filename)
+{
+    if (filename == NULL) {
+        AFLOG_ERR("af_util_file_open_param");
+        errno = EINVAL;
+        return NULL;
+    }
 
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int err = errno;
+        AFLOG_ERR("af_util_file_open_open:errno=%d,file=%s", err, filename);
+        errno = err;
+        return NULL;
+    }
+    af_util_file_t *file = (af_util_file_t *)malloc(sizeof(af_util_file_t));
+    if (file == NULL) {
+        AFLOG_ERR("af_util_file_open_malloc");
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->fd = fd;
+    return file;
+}
+
+ssize_t af_util_file_read(af_util_file_t *file, char *buf, size_t n)
+{
+    if (file == NULL || buf == NULL) {
+        AFLOG_ERR("af_util_file_read_param:file_NULL=%d,buf_NULL=%d", file == NULL, buf == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t nread = read_fd(file->fd, buf, n, 1);
+    if (nread < 0) {
+        int err = errno;
+        AFLOG_ERR("af_util_file_read_read:errno=%d", err);
+        errno = err;
+    }
+    return nread;
+}
+
+void af_util_file_close(af_util_file_t *file)
+{
+    if (file) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+ssize_t af_util_read_whole_file(const char *filename, char **buf)
+{
+    if (filename == NULL || buf == NULL) {
+        AFLOG_ERR("af_util_read_whole_file_param:filename_NULL=%d,buf_NULL=%d", filename == NULL, buf == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int err = errno;
+        AFLOG_ERR("af_util_read_whole_file_open:errno=%d,file=%s", err, filename);
+        errno = err;
+        return -1;
+    }
+
+    /* /proc files report a size of 0 and /sys files a page, so the buffer
+       grows as needed. For a regular file it has room for one byte more
+       than the size, so the read that finds the end needs no realloc */
+    struct stat st;
+    size_t size = READ_BUF_SIZE;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size + 2;
+    }
+
+    char *data = (char *)malloc(size);
+    size_t len = 0;
+    int err = (data ? 0 : ENOMEM);
+    while (err == 0) {
+        if (len == size - 1) {
+            char *d = (char *)realloc(data, size * 2);
+            if (d == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            data = d;
+            size *= 2;
+        }
+        ssize_t ret = read(fd, data + len, size - 1 - len);
+        if (ret > 0) {
+            len += ret;
+        } else if (ret == 0) {
+            break;
+        } else if (errno != EINTR) {
+            err = errno;
+        }
+    }
+    close(fd);
+
+    if (err) {
+        AFLOG_ERR("af_util_read_whole_file_read:errno=%d,file=%s", err, filename);
+        free(data);
+        errno = err;
+        return -1;
+    }
+    data[len] = '\0';
+    *buf = data;
+    return len;
+}
+
+char *af_util_buffer_to_hex(char *dest, size_t dest_len, const uint8_t *source, size_t source_len) {
     size_t needed = source_len * 2 + 1;
     if (dest_len < needed) {
         AFLOG_ERR("af_util_buffer_to_hex: insufficient space (got %zi, need %zi)", dest_len, needed);
@@ -128,26 +451,11 @@ char *af_util_buffer_to_hex(char *dest, size_t dest_len, const uint8_t *source,
         return dest;
     }
 
-    int i;
-    for (i = 0; i < source_len; i++) {
-        dest[i * 2 + 0] = HEX[source[i] >> 4];
-        dest[i * 2 + 1] = HEX[source[i] & 0x0f];
-    }
-    dest[i * 2] = 0;
+    af_hex_kernel_encode(dest, source, source_len);
+    dest[source_len * 2] = 0;
     return dest;
 }
 
-static uint8_t UNHEX[] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 0, 0, 0, 0, 0,
-    0, 10, 11, 12, 13, 14, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 10, 11, 12, 13, 14, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
 size_t af_util_hex_to_buffer(uint8_t *dest, size_t dest_len, const char *source, size_t source_len) {
     size_t needed = source_len / 2;
     if (dest_len < needed) {
@@ -155,133 +463,232 @@ size_t af_util_hex_to_buffer(uint8_t *dest, size_t dest_len, const char *source,
         return 0;
     }
 
-    int i;
-    for (i = 0; i < source_len / 2; i++) {
-        dest[i] = (UNHEX[source[i * 2] & 0x7f] << 4) + UNHEX[source[i * 2 + 1] & 0x7f];
-    }
+    af_hex_kernel_decode(dest, source, needed, 0);
     return needed;
 }
 
-int af_util_parse_key_value_pair_file(char *path, af_key_value_pair_t *pairs, int numPairs)
-{
-    /* check params */
-    if (path == NULL || pairs == NULL || numPairs < 0) {
-        AFLOG_ERR("parse_kvp_param:path_NULL=%d,pair_NULL=%d,numPairs=%d", path==NULL, pairs==NULL, numPairs);
+ssize_t af_util_hex_to_buffer_strict(uint8_t *dest, size_t dest_len, const char *source, size_t source_len, size_t *bad_pos) {
+    if (dest == NULL || source == NULL) {
+        AFLOG_ERR("af_util_hex_to_buffer_strict_param:dest_NULL=%d,source_NULL=%d", dest == NULL, source == NULL);
         errno = EINVAL;
         return -1;
     }
 
-    /* open the key value pair file */
-    FILE *f = fopen(path, "r");
-    if (f == NULL) {
-        AFLOG_ERR("parse_kvp_open:errno=%d", errno);
+    size_t needed = source_len / 2;
+    if (dest_len < needed) {
+        AFLOG_ERR("af_util_hex_to_buffer_strict: insufficient space (got %zi, need %zi)", dest_len, needed);
+        errno = ENOSPC;
         return -1;
     }
 
-    int pairNum, line = 0;
+    size_t pos = af_hex_kernel_decode(dest, source, needed, 1);
+    if (pos == needed * 2 && (source_len & 1)) {
+        /* the last character has no partner */
+        pos = source_len - 1;
+    }
+    if (pos < source_len) {
+        if (bad_pos != NULL) {
+            *bad_pos = pos;
+        }
+        errno = EINVAL;
+        return -1;
+    }
+    return needed;
+}
 
-    char buf[AF_PARSE_MAX_KEY_SIZE + AF_PARSE_MAX_VALUE_SIZE + 4];
-    while (fgets(buf, sizeof(buf), f) != NULL) {
-        char *c = buf, *key, *value;
-        line++;
-        while(isblank(*c)) c++;  /* skip over any leading spaces */
-        if (*c == '#') {          /* skip over comments */
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+void af_util_hex_encoder_init(af_hex_encoder_t *enc)
+{
+    if (enc != NULL) {
+        memset(enc, 0, sizeof(af_hex_encoder_t));
+    }
+}
+
+size_t af_util_hex_encode_chunk(af_hex_encoder_t *enc, char *dest, size_t dest_len,
+                                const uint8_t *source, size_t source_len, size_t *source_used)
+{
+    if (enc == NULL || dest == NULL || (source == NULL && source_len != 0)) {
+        AFLOG_ERR("af_util_hex_encode_chunk_param:enc_NULL=%d,dest_NULL=%d,source_NULL=%d", enc == NULL, dest == NULL, source == NULL);
+        if (source_used != NULL) {
+            *source_used = 0;
         }
-        if (*c == '\n') continue; /* blank line */
-        if (*c == '\0') break;    /* empty file */
+        return 0;
+    }
 
-        key = c;
+    size_t written = 0, used;
+    if (enc->hasPending && dest_len > 0) {
+        dest[written++] = enc->pending;
+        enc->hasPending = 0;
+    }
 
-        /* make sure the key starts right */
-        if (!isalpha(*c) && *c != '_') {
-            AFLOG_ERR("parse_kvp_bad_key_start:line=%d:key must start with an alphabetic character or '_'", line);
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+    if (enc->hasPending) {
+        used = 0;
+    } else {
+        used = (dest_len - written) / 2;
+        if (used > source_len) {
+            used = source_len;
         }
-        c++;
-
-        /* make sure key contains the right characters */
-        while (isalnum(*c) || *c == '_') c++;
-        if (*c != '=' && !isblank(*c)) {
-            AFLOG_ERR("parse_kvp_bad_key_body:line=%d:key must contain only alphanumeric characters and '_'", line);
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+        af_hex_kernel_encode(dest + written, source, used);
+        written += used * 2;
+
+        /* split a byte across windows if there's one character of room */
+        if (written < dest_len && used < source_len) {
+            char pair[2];
+            af_hex_kernel_encode(pair, source + used, 1);
+            dest[written++] = pair[0];
+            enc->pending = pair[1];
+            enc->hasPending = 1;
+            used++;
         }
+    }
 
-        /* at this point c points to the first character past the key */
-        /* find the key */
-        char last = *c;
-        *c = '\0';
-        int i;
-        for (i = 0; i < numPairs; i++) {
-            if (!strncmp(key, pairs[i].key, sizeof(pairs[i].key))) {
-                pairNum = i;
-                break;
-            }
+    if (source_used != NULL) {
+        *source_used = used;
+    }
+    return written;
+}
+
+size_t af_util_hex_encode_finish(af_hex_encoder_t *enc, char *dest, size_t dest_len)
+{
+    if (enc == NULL || dest == NULL || dest_len < 1 || !enc->hasPending) {
+        return 0;
+    }
+    dest[0] = enc->pending;
+    enc->hasPending = 0;
+    return 1;
+}
+
+void af_util_hex_decoder_init(af_hex_decoder_t *dec, int strict)
+{
+    if (dec != NULL) {
+        memset(dec, 0, sizeof(af_hex_decoder_t));
+        dec->strict = (strict != 0);
+    }
+}
+
+ssize_t af_util_hex_decode_chunk(af_hex_decoder_t *dec, uint8_t *dest, size_t dest_len,
+                                 const char *source, size_t source_len, size_t *source_used)
+{
+    if (source_used != NULL) {
+        *source_used = 0;
+    }
+    if (dec == NULL || dest == NULL || (source == NULL && source_len != 0)) {
+        AFLOG_ERR("af_util_hex_decode_chunk_param:dec_NULL=%d,dest_NULL=%d,source_NULL=%d", dec == NULL, dest == NULL, source == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t written = 0, used = 0, pos;
+
+    /* finish a pair split across chunks */
+    if (dec->hasPending && source_len > 0 && dest_len > 0) {
+        char pair[2] = { dec->pending, source[0] };
+        pos = af_hex_kernel_decode(dest, pair, 1, dec->strict);
+        if (pos < 2) {
+            /* the carried character was consumed in the previous call */
+            dec->badPos = dec->offset - 1 + pos;
+            errno = EINVAL;
+            return -1;
         }
-        if (i >= numPairs) {
-            AFLOG_WARNING("parse_kvp_key_not_found:line=%d,key=%s:key not found; ignoring", line, key);
-            *c = last;
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+        dec->hasPending = 0;
+        written = used = 1;
+    }
+
+    if (!dec->hasPending) {
+        size_t numBytes = (source_len - used) / 2;
+        if (numBytes > dest_len - written) {
+            numBytes = dest_len - written;
         }
-        *c = last;   /* restore the character after the key */
-
-        /* check for equals sign */
-        if (*c != '=') {
-            AFLOG_ERR("parse_kvp_expected_eq:line=%d:expected \"=\" character", line);
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+        pos = af_hex_kernel_decode(dest + written, source + used, numBytes, dec->strict);
+        if (pos < numBytes * 2) {
+            dec->badPos = dec->offset + used + pos;
+            errno = EINVAL;
+            return -1;
         }
-        c++;
-
-        /* check for single quote */
-        if (*c != '\'') {
-            AFLOG_ERR("parse_kvp_expected_quote:line=%d:expected single quote", line);
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
-            if (*c == '\0') break;
-            continue;
+        used += numBytes * 2;
+        written += numBytes;
+
+        /* carry an odd last character to the next chunk */
+        if (source_len - used == 1) {
+            dec->pending = source[used++];
+            dec->hasPending = 1;
         }
-        c++;
-
-        value = c;
-        /* move to the closing single quote */
-        while (*c != '\'' && *c != '\n' && *c != '\0') c++;
-        if (*c != '\'') {
-            AFLOG_ERR("parse_kvp_unmatched_quotes:line=%d",line);
-            if (*c == '\0') break;
-            continue;
+    }
+
+    dec->offset += used;
+    if (source_used != NULL) {
+        *source_used = used;
+    }
+    return written;
+}
+
+int af_util_hex_decode_finish(af_hex_decoder_t *dec)
+{
+    if (dec == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (dec->hasPending) {
+        dec->hasPending = 0;
+        if (dec->strict) {
+            dec->badPos = dec->offset - 1;
+            errno = EINVAL;
+            return -1;
         }
+    }
+    return 0;
+}
+
+int af_util_parse_key_value_pair_file(char *path, af_key_value_pair_t *pairs, int numPairs)
+{
+    /* check params */
+    if (path == NULL || pairs == NULL || numPairs < 0) {
+        AFLOG_ERR("parse_kvp_param:path_NULL=%d,pair_NULL=%d,numPairs=%d", path==NULL, pairs==NULL, numPairs);
+        errno = EINVAL;
+        return -1;
+    }
 
-        /* change the single quote to a '\0' to terminate the value string */
-        *c = '\0';
-        strncpy(pairs[pairNum].value, value, sizeof(pairs[pairNum].value));
-        pairs[pairNum].value[sizeof(pairs[pairNum].value) - 1] = '\0';
-        c++;
-
-        /* skip any trailing spaces */
-        while (isblank(*c)) c++;
-        if (*c != '\n' && *c != '\0') {
-            AFLOG_ERR("parse_kvp_unexpected_char_end:line=%d:unexpected character after quote", line);
-            while (*c != '\n' && *c != '\0') c++; /* skip until the end of the line or file */
+    /* the keys are copied because a key may fill its array without a NUL */
+    af_kvp_view_t *views = NULL;
+    int i;
+    if (numPairs > 0) {
+        views = (af_kvp_view_t *)malloc(numPairs * (sizeof(af_kvp_view_t) + AF_PARSE_MAX_KEY_SIZE + 1));
+        if (views == NULL) {
+            AFLOG_ERR("parse_kvp_malloc");
+            errno = ENOMEM;
+            return -1;
+        }
+        char *keys = (char *)(views + numPairs);
+        for (i = 0; i < numPairs; i++) {
+            char *key = keys + i * (AF_PARSE_MAX_KEY_SIZE + 1);
+            size_t len = strnlen(pairs[i].key, sizeof(pairs[i].key));
+            memcpy(key, pairs[i].key, len);
+            key[len] = '\0';
+            views[i].key = key;
         }
-        if (*c == '\0') break;
     }
 
-    /* print an error if one has occurred */
-    if (ferror(f)) {
-        AFLOG_ERR("parse_kvp_fgets:errno=%d", errno);
-        fclose(f);
+    /* the file is read rather than mapped so it can be truncated meanwhile */
+    af_kvp_file_t *file = kvp_file_open(path, views, numPairs, 0);
+    if (file == NULL) {
+        int err = errno;
+        free(views);
+        errno = err;
         return -1;
     }
 
-    fclose(f);
+    /* keys not in the file keep their old values */
+    for (i = 0; i < numPairs; i++) {
+        if (views[i].value != NULL) {
+            size_t len = views[i].valueLen;
+            if (len > sizeof(pairs[i].value) - 1) {
+                len = sizeof(pairs[i].value) - 1;
+            }
+            memcpy(pairs[i].value, views[i].value, len);
+            pairs[i].value[len] = '\0';
+        }
+    }
+
+    af_util_kvp_close(file);
+    free(views);
     return 0;
 }
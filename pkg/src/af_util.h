@@ -10,15 +10,143 @@
 #ifndef __AF_UTIL_H__
 #define __AF_UTIL_H__
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/wait.h>
 
 extern int af_util_system(const char *format, ...);
 
 extern int8_t af_util_file_exists(const char *filename);
 extern uint32_t af_util_read_file(const char *filename, char *buf, size_t  n);
+
+/* Caching for af_util_file_exists and af_util_read_file. While the cache
+   is enabled, their answers for absolute paths are kept in memory, up to
+   maxEntries files, and given again until the file changes. Changes are
+   followed with inotify watches on the files' directories, and the
+   events queued are handled before each answer, so a change made before
+   the call, by this process or another, is always seen.
+
+   Files larger than AF_UTIL_CACHE_MAX_FILE, files in /proc, /sys, and
+   other file systems that inotify doesn't follow, and files that don't
+   exist are read each time. A change isn't seen if it happens above the
+   file's directory, such as a parent directory being renamed, or to the
+   target of a symbolic link in another directory. */
+#define AF_UTIL_CACHE_MAX_FILE    4096
+#define AF_UTIL_CACHE_MAX_ENTRIES 65536
+
+/* returns -1 with errno set on failure */
+int af_util_cache_enable(uint32_t maxEntries);
+void af_util_cache_disable(void);
+
+/* File handles for reading the same file over and over, such as a /sys or
+   /proc attribute that is polled. The file is opened once and each read
+   starts again at offset 0 with pread, so a read costs no open, close, or
+   allocation. */
+typedef struct af_util_file_struct af_util_file_t;
+
+/* returns NULL with errno set on failure */
+af_util_file_t *af_util_file_open(const char *filename);
+
+/* reads up to n bytes from the start of the file into buf; buf is not
+   NUL terminated. Pipes, sockets, and terminals are read from where they
+   are. returns the number of bytes read, which is 0 for an empty file, or
+   -1 with errno set on failure */
+ssize_t af_util_file_read(af_util_file_t *file, char *buf, size_t n);
+
+void af_util_file_close(af_util_file_t *file);
+
+/* reads the whole file into a buffer allocated with malloc, which the
+   caller frees, and NUL terminates it. Works for /proc files, which
+   report a size of 0. returns the length without the NUL, or -1 with
+   errno set on failure */
+ssize_t af_util_read_whole_file(const char *filename, char **buf);
+
+/* Batched reads. Each file is read from the start with a single read of
+   up to size bytes, which gets the whole of a /sys attribute or small
+   /proc file. Files under /proc and /sys are read one after another,
+   which is faster for them than io_uring. The other files in a batch are
+   opened, read, and closed with io_uring in a single system call where
+   the kernel supports it (Linux 5.15 or later), which saves about a tenth
+   of the time for regular files in the page cache. */
+typedef struct {
+    const char *filename;
+    char *buf;                /* not NUL terminated */
+    size_t size;
+    ssize_t result;           /* set to the bytes read, or -1 */
+    int err;                  /* set to the errno if result is -1 */
+} af_util_read_request_t;
+
+typedef struct af_util_file_batch_struct af_util_file_batch_t;
+
+/* sets up for reading up to maxFiles files at once, at most 4096. Keep
+   the batch to reuse it for every cycle of a polling loop; a batch may be
+   used by one thread at a time. returns NULL with errno set on failure */
+af_util_file_batch_t *af_util_file_batch_create(uint32_t maxFiles);
+
+/* reads the files, maxFiles at a time, setting result and err in each
+   request. returns 0, or -1 with errno set if the parameters are bad;
+   files that can't be read don't make it fail */
+int af_util_file_batch_read(af_util_file_batch_t *batch, af_util_read_request_t *reqs, uint32_t numReqs);
+
+void af_util_file_batch_destroy(af_util_file_batch_t *batch);
+
+/* reads the files one after another; setting up io_uring for a single
+   batch costs more than it saves. Keep a batch to use io_uring */
+int af_util_read_files(af_util_read_request_t *reqs, uint32_t numReqs);
+
 char *af_util_buffer_to_hex(char *dest, size_t dest_len, const uint8_t *source, size_t source_len);
 size_t af_util_hex_to_buffer(uint8_t *dest, size_t dest_len, const char *source, size_t source_len);
 
+/* Same as af_util_hex_to_buffer but every character must be a hex digit
+   and source_len must be even. Returns the number of bytes written to
+   dest, or -1 with errno set to ENOSPC if dest is too small or EINVAL if
+   the source is invalid. In the EINVAL case *bad_pos, if bad_pos isn't
+   NULL, is set to the index of the first character that isn't a hex
+   digit, or to the index of the unpaired last character. */
+ssize_t af_util_hex_to_buffer_strict(uint8_t *dest, size_t dest_len, const char *source, size_t source_len, size_t *bad_pos);
+
+/* Streaming hex conversion. The encoder and decoder take their input in
+   chunks of any size and write into output windows of any size, so large
+   data can be converted as it's read without staging it in memory.
+
+   Each chunk call converts as much of source as fits in dest, sets
+   *source_used to the number of bytes or characters it consumed, and
+   returns the number written to dest. Input that wasn't consumed must be
+   passed again in the next call. A byte whose second hex digit didn't fit
+   in dest, or a character whose partner is in the next chunk, is carried
+   in the context. */
+typedef struct {
+    char pending;             /* second digit of the last byte consumed */
+    uint8_t hasPending;
+} af_hex_encoder_t;
+
+typedef struct {
+    uint64_t offset;          /* characters consumed so far */
+    uint64_t badPos;          /* offset of the first bad character after an error */
+    char pending;             /* first digit of a pair split across chunks */
+    uint8_t hasPending;
+    uint8_t strict;
+} af_hex_decoder_t;
+
+void af_util_hex_encoder_init(af_hex_encoder_t *enc);
+size_t af_util_hex_encode_chunk(af_hex_encoder_t *enc, char *dest, size_t dest_len,
+                                const uint8_t *source, size_t source_len, size_t *source_used);
+
+/* writes the digit still carried, if any; returns the number of characters written */
+size_t af_util_hex_encode_finish(af_hex_encoder_t *enc, char *dest, size_t dest_len);
+
+/* if strict is nonzero, af_util_hex_decode_chunk fails with EINVAL at the
+   first character that isn't a hex digit and sets dec->badPos to its
+   offset in the stream; otherwise characters are decoded the way
+   af_util_hex_to_buffer decodes them */
+void af_util_hex_decoder_init(af_hex_decoder_t *dec, int strict);
+ssize_t af_util_hex_decode_chunk(af_hex_decoder_t *dec, uint8_t *dest, size_t dest_len,
+                                 const char *source, size_t source_len, size_t *source_used);
+
+/* ends the stream; an unpaired last character is an error (EINVAL) for
+   strict decoders and ignored otherwise. returns 0 or -1 */
+int af_util_hex_decode_finish(af_hex_decoder_t *dec);
+
 #define AF_PARSE_MAX_KEY_SIZE   64
 #define AF_PARSE_MAX_VALUE_SIZE 64
 
@@ -39,7 +167,34 @@ Keys can contain the characters [A-Z] | [a-z] | [0-9] | _ but cannot start with
 This file can be included in bash scripts.
 
 Returns -1 if failure. errno contains the error code.
+
+Values longer than AF_PARSE_MAX_VALUE_SIZE - 1 are truncated; use
+af_util_kvp_open to get them whole.
  */
 extern int af_util_parse_key_value_pair_file(char *path, af_key_value_pair_t *pairs, int numPairs);
 
+/* Parses a key value pair file in the format above without copying it.
+   The file is mapped and scanned once, and each key found is looked up in
+   a hash index of the wanted keys, so parsing takes time proportional to
+   the file's length however many keys are wanted. There are no limits on
+   the length of keys, values, or lines.
+
+   Each view's value is set to point at the value in the mapped file, or
+   to NULL if the key isn't in the file. Values are not NUL terminated.
+   If a key appears more than once, the last value wins. The values stay
+   valid until af_util_kvp_close; the file must not be truncated before
+   then. */
+typedef struct {
+    const char *key;          /* key to look for, NUL terminated */
+    const char *value;        /* set to the value, or NULL if not found */
+    size_t valueLen;
+} af_kvp_view_t;
+
+typedef struct af_kvp_file_struct af_kvp_file_t;
+
+/* returns NULL with errno set if the file can't be read */
+af_kvp_file_t *af_util_kvp_open(const char *path, af_kvp_view_t *views, int numViews);
+
+void af_util_kvp_close(af_kvp_file_t *file);
+
 #endif // __AF_UTIL_H__
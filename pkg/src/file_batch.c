@@ -0,0 +1,390 @@
+//
+// file_batch.c -- reads a batch of files with io_uring
+//
+// Each file gets a chain of three requests: an open into a slot of the
+// ring's registered file table, a read from that slot, and a close of the
+// slot. All the chains are submitted and waited for with one
+// io_uring_enter. The ring is driven with the raw system calls, so
+// liburing isn't needed.
+//
+// Files under /proc and /sys are read one after another with open, read,
+// and close instead. Their reads can't be done without blocking, so
+// io_uring hands each one to a worker thread, which makes a batch of them
+// slower than reading them in turn. The ring is only set up once a batch
+// has a file it suits. Without io_uring, when built against kernel headers
+// older than 5.19, or on kernels older than 5.15 that can't open into the
+// file table, every file is read in turn.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+/* opening into and closing a file table slot came with 5.15 headers, and
+   IORING_SETUP_COOP_TASKRUN and IORING_FILE_INDEX_ALLOC with 5.19 */
+#if defined(IORING_SETUP_COOP_TASKRUN) && defined(IORING_FILE_INDEX_ALLOC)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#define AF_LOG_MODULE "util"
+#include "af_log.h"
+#include "af_util.h"
+
+#define MAX_BATCH_FILES 4096
+#define OPS_PER_FILE    3   /* open, read, close */
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;               /* same as sqRing with IORING_FEAT_SINGLE_MMAP */
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    uint32_t *sqHead;
+    uint32_t *sqTail;
+    uint32_t *sqMask;
+    uint32_t *sqArray;
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t *cqMask;
+    struct io_uring_cqe *cqes;
+} prv_ring_t;
+#endif
+
+struct af_util_file_batch_struct {
+    uint32_t maxFiles;
+#ifdef HAVE_IO_URING
+    int haveRing;
+    int triedRing;              /* the ring has been set up, or failed to be */
+    prv_ring_t ring;
+#endif
+};
+
+/* reads until size bytes or the end of the file */
+static void read_one(af_util_read_request_t *req)
+{
+    int fd = open(req->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        req->result = -1;
+        req->err = errno;
+        return;
+    }
+    size_t nread = 0;
+    while (nread < req->size) {
+        ssize_t ret = read(fd, req->buf + nread, req->size - nread);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            req->result = -1;
+            req->err = errno;
+            close(fd);
+            return;
+        }
+        if (ret == 0) {
+            break;
+        }
+        nread += ret;
+    }
+    close(fd);
+    req->result = nread;
+    req->err = 0;
+}
+
+#ifdef HAVE_IO_URING
+
+/* procfs and sysfs files are read faster one by one; see above */
+static int ring_suits(const char *filename)
+{
+    return filename != NULL && strncmp(filename, "/proc/", 6) != 0 && strncmp(filename, "/sys/", 5) != 0;
+}
+
+static void ring_free(prv_ring_t *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+/* returns -1 if io_uring isn't available */
+static int ring_init(prv_ring_t *ring, uint32_t maxFiles)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    /* completions are only wanted when we wait for them (Linux 5.19) */
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, maxFiles * OPS_PER_FILE, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, maxFiles * OPS_PER_FILE, &p);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            goto error;
+        }
+    }
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sqRing, *cq = (uint8_t *)ring->cqRing;
+    ring->sqHead = (uint32_t *)(sq + p.sq_off.head);
+    ring->sqTail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sqMask = (uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sqArray = (uint32_t *)(sq + p.sq_off.array);
+    ring->cqHead = (uint32_t *)(cq + p.cq_off.head);
+    ring->cqTail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cqMask = (uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* an empty file table for the opens to fill */
+    int *files = (int *)malloc(maxFiles * sizeof(int));
+    if (files == NULL) {
+        goto error;
+    }
+    memset(files, 0xff, maxFiles * sizeof(int));
+    int ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, maxFiles);
+    free(files);
+    if (ret < 0) {
+        goto error;
+    }
+    return 0;
+
+error:
+    ring_free(ring);
+    return -1;
+}
+
+static struct io_uring_sqe *ring_sqe(prv_ring_t *ring, uint32_t tail, uint8_t opcode, uint64_t userData)
+{
+    uint32_t index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    return sqe;
+}
+
+/* reads the files the ring suits; returns -1 with errno set if the ring
+   can't do it, in which case the requests must be read another way */
+static int ring_read(prv_ring_t *ring, af_util_read_request_t *reqs, uint32_t numReqs)
+{
+    uint32_t tail = *ring->sqTail, numQueued = 0, i;
+    for (i = 0; i < numReqs; i++) {
+        if (!ring_suits(reqs[i].filename)) {
+            continue;
+        }
+        numQueued++;
+        struct io_uring_sqe *sqe = ring_sqe(ring, tail++, IORING_OP_OPENAT, i * OPS_PER_FILE);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)reqs[i].filename;
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        /* hard linked so the close runs even if the read fails */
+        sqe = ring_sqe(ring, tail++, IORING_OP_READ, i * OPS_PER_FILE + 1);
+        sqe->fd = i;
+        sqe->addr = (uintptr_t)reqs[i].buf;
+        sqe->len = reqs[i].size;
+        sqe->off = (uint64_t)-1;     /* the file position, which works for pipes too */
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+        sqe = ring_sqe(ring, tail++, IORING_OP_CLOSE, i * OPS_PER_FILE + 2);
+        sqe->file_index = i + 1;
+    }
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+    uint32_t toSubmit = numQueued * OPS_PER_FILE, toComplete = toSubmit;
+    int openUnsupported = 0;
+    while (toComplete > 0) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, toComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* the ring may still hold requests; the caller drops it */
+            return -1;
+        }
+        toSubmit -= (ret < toSubmit ? ret : toSubmit);
+
+        uint32_t head = *ring->cqHead;
+        uint32_t cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cqTail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            uint32_t file = cqe->user_data / OPS_PER_FILE, op = cqe->user_data % OPS_PER_FILE;
+            af_util_read_request_t *req = &reqs[file];
+            if (op == 0) {
+                if (cqe->res < 0) {
+                    req->result = -1;
+                    req->err = -cqe->res;
+                    openUnsupported |= (cqe->res == -EINVAL);
+                }
+            } else if (op == 1 && cqe->res != -ECANCELED) {
+                req->result = (cqe->res < 0 ? -1 : cqe->res);
+                req->err = (cqe->res < 0 ? -cqe->res : 0);
+            }
+            toComplete--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (openUnsupported) {
+        /* a kernel that can't open into the file table rejects the
+           request as invalid */
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+#endif // HAVE_IO_URING
+
+af_util_file_batch_t *af_util_file_batch_create(uint32_t maxFiles)
+{
+    if (maxFiles == 0 || maxFiles > MAX_BATCH_FILES) {
+        AFLOG_ERR("af_util_file_batch_create_param:maxFiles=%u", maxFiles);
+        errno = EINVAL;
+        return NULL;
+    }
+    af_util_file_batch_t *batch = (af_util_file_batch_t *)calloc(1, sizeof(af_util_file_batch_t));
+    if (batch == NULL) {
+        AFLOG_ERR("af_util_file_batch_create_calloc");
+        errno = ENOMEM;
+        return NULL;
+    }
+    batch->maxFiles = maxFiles;
+    return batch;
+}
+
+int af_util_file_batch_read(af_util_file_batch_t *batch, af_util_read_request_t *reqs, uint32_t numReqs)
+{
+    if (batch == NULL || (reqs == NULL && numReqs > 0)) {
+        AFLOG_ERR("af_util_file_batch_read_param:batch_NULL=%d,reqs_NULL=%d", batch == NULL, reqs == NULL);
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t start, i;
+    for (start = 0; start < numReqs; start += batch->maxFiles) {
+        uint32_t n = numReqs - start;
+        if (n > batch->maxFiles) {
+            n = batch->maxFiles;
+        }
+        uint32_t numForRing = 0;
+        for (i = start; i < start + n; i++) {
+            reqs[i].result = 0;
+            reqs[i].err = 0;
+#ifdef HAVE_IO_URING
+            if (ring_suits(reqs[i].filename)) {
+                numForRing++;
+                continue;
+            }
+#endif
+            read_one(&reqs[i]);
+        }
+        if (numForRing == 0) {
+            continue;
+        }
+#ifdef HAVE_IO_URING
+        if (!batch->triedRing) {
+            batch->triedRing = 1;
+            batch->haveRing = (ring_init(&batch->ring, batch->maxFiles) == 0);
+            AFLOG_DEBUG2("af_util_file_batch_ring:maxFiles=%u,ring=%d", batch->maxFiles, batch->haveRing);
+        }
+        if (batch->haveRing) {
+            if (ring_read(&batch->ring, &reqs[start], n) == 0) {
+                continue;
+            }
+            /* read the rest of this batch, and all later ones, one by one */
+            AFLOG_WARNING("af_util_file_batch_ring_failed:errno=%d", errno);
+            batch->haveRing = 0;
+            ring_free(&batch->ring);
+        }
+        for (i = start; i < start + n; i++) {
+            if (ring_suits(reqs[i].filename)) {
+                read_one(&reqs[i]);
+            }
+        }
+#endif
+    }
+    return 0;
+}
+
+void af_util_file_batch_destroy(af_util_file_batch_t *batch)
+{
+    if (batch) {
+#ifdef HAVE_IO_URING
+        if (batch->haveRing) {
+            ring_free(&batch->ring);
+        }
+#endif
+        free(batch);
+    }
+}
+
+int af_util_read_files(af_util_read_request_t *reqs, uint32_t numReqs)
+{
+    if (reqs == NULL && numReqs > 0) {
+        AFLOG_ERR("af_util_read_files_param");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* setting up a ring costs more than it saves on one batch */
+    uint32_t i;
+    for (i = 0; i < numReqs; i++) {
+        read_one(&reqs[i]);
+    }
+    return 0;
+}
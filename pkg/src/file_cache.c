@@ -0,0 +1,612 @@
+//
+// file_cache.c -- cache behind af_util_file_exists and af_util_read_file
+//
+// Entries are kept in a hash table and an LRU list. Each cached file's
+// directory is watched with inotify, and the entries of files that change
+// are dropped. Watching the directory rather than the file also catches
+// files being created, replaced by rename, or having their permissions
+// changed; a change to the directory's own permissions drops all of its
+// entries.
+//
+// The kernel queues an event before the write or close that caused it
+// returns, so each lookup reads the queued events before serving a hit,
+// which makes a change made before the call, including the caller's own,
+// always seen. A thread also reads them, so the queue doesn't overflow
+// while the cache isn't used. Events are only read with the lock held.
+//
+// A file is read without the lock held, so an event can arrive between
+// reading it and inserting the entry. Every event bumps s_cache.gen; an
+// entry is only inserted if gen hasn't changed since before the read,
+// with the events queued meanwhile read first.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/magic.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+
+#define AF_LOG_MODULE "util"
+#include "af_log.h"
+#include "af_util.h"
+#include "file_cache.h"
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                      IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+#define DATA_UNKNOWN   0
+#define DATA_CACHED    1
+#define DATA_UNCACHED  2   /* missing or too large */
+
+typedef struct prv_dir_struct {
+    struct prv_dir_struct *next;
+    int wd;
+    uint32_t numEntries;
+    size_t len;
+    char path[];
+} prv_dir_t;
+
+typedef struct prv_entry_struct {
+    struct prv_entry_struct *hashNext;
+    struct prv_entry_struct *lruPrev;
+    struct prv_entry_struct *lruNext;
+    prv_dir_t *dir;
+    uint32_t hash;
+    int8_t exists;          /* -1 if not checked yet */
+    uint8_t dataState;
+    uint16_t dataLen;
+    char *data;
+    char path[];
+} prv_entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;            /* read without the lock to skip it when off */
+    uint32_t maxEntries;
+    uint32_t numEntries;
+    uint32_t mask;
+    prv_entry_t **table;
+    prv_entry_t *lruHead;   /* most recently used */
+    prv_entry_t *lruTail;
+    prv_dir_t *dirs;
+    uint64_t gen;
+    int inotifyFd;
+    int stopFd;
+    pthread_t thread;
+} s_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotifyFd = -1, .stopFd = -1 };
+
+/* file systems whose changes inotify doesn't report */
+static const uint32_t s_uncachedFs[] = {
+    PROC_SUPER_MAGIC, SYSFS_MAGIC, DEBUGFS_MAGIC, SECURITYFS_MAGIC, TRACEFS_MAGIC,
+    CGROUP_SUPER_MAGIC, CGROUP2_SUPER_MAGIC, DEVPTS_SUPER_MAGIC, BPF_FS_MAGIC,
+    FUSE_SUPER_MAGIC, NFS_SUPER_MAGIC, SMB_SUPER_MAGIC, CIFS_SUPER_MAGIC,
+    SMB2_SUPER_MAGIC, V9FS_MAGIC
+};
+
+static uint32_t hash_path(const char *path)
+{
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h = (h ^ (uint8_t)*path) * 16777619u;
+    }
+    return h;
+}
+
+static void lru_remove(prv_entry_t *e)
+{
+    if (e->lruPrev) {
+        e->lruPrev->lruNext = e->lruNext;
+    } else {
+        s_cache.lruHead = e->lruNext;
+    }
+    if (e->lruNext) {
+        e->lruNext->lruPrev = e->lruPrev;
+    } else {
+        s_cache.lruTail = e->lruPrev;
+    }
+}
+
+static void lru_add_head(prv_entry_t *e)
+{
+    e->lruPrev = NULL;
+    e->lruNext = s_cache.lruHead;
+    if (s_cache.lruHead) {
+        s_cache.lruHead->lruPrev = e;
+    } else {
+        s_cache.lruTail = e;
+    }
+    s_cache.lruHead = e;
+}
+
+static prv_entry_t *entry_find(const char *path, uint32_t hash)
+{
+    prv_entry_t *e;
+    for (e = s_cache.table[hash & s_cache.mask]; e; e = e->hashNext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void dir_release(prv_dir_t *dir)
+{
+    if (--dir->numEntries > 0) {
+        return;
+    }
+    prv_dir_t **pd;
+    for (pd = &s_cache.dirs; *pd; pd = &(*pd)->next) {
+        if (*pd == dir) {
+            *pd = dir->next;
+            break;
+        }
+    }
+    if (dir->wd >= 0) {
+        inotify_rm_watch(s_cache.inotifyFd, dir->wd);
+    }
+    free(dir);
+}
+
+static void entry_remove(prv_entry_t *e)
+{
+    prv_entry_t **pe;
+    for (pe = &s_cache.table[e->hash & s_cache.mask]; *pe; pe = &(*pe)->hashNext) {
+        if (*pe == e) {
+            *pe = e->hashNext;
+            break;
+        }
+    }
+    lru_remove(e);
+    dir_release(e->dir);
+    s_cache.numEntries--;
+    free(e->data);
+    free(e);
+}
+
+static void remove_dir_entries(prv_dir_t *dir, int watchGone)
+{
+    /* if the watch is gone, don't remove it again */
+    if (watchGone) {
+        dir->wd = -1;
+    }
+    dir->numEntries++;
+    prv_entry_t *e, *next;
+    for (e = s_cache.lruHead; e; e = next) {
+        next = e->lruNext;
+        if (e->dir == dir) {
+            entry_remove(e);
+        }
+    }
+    dir_release(dir);
+}
+
+static void remove_all(void)
+{
+    while (s_cache.lruHead) {
+        entry_remove(s_cache.lruHead);
+    }
+}
+
+static void handle_event(const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        remove_all();
+        return;
+    }
+
+    prv_dir_t *dir;
+    for (dir = s_cache.dirs; dir; dir = dir->next) {
+        if (dir->wd == ev->wd) {
+            break;
+        }
+    }
+    if (dir == NULL) {
+        return;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+        remove_dir_entries(dir, 1);
+        return;
+    }
+    if (ev->len == 0) {
+        /* the directory's own permissions decide whether its files can be read */
+        if (ev->mask & IN_ATTRIB) {
+            remove_dir_entries(dir, 0);
+        }
+        return;
+    }
+
+    size_t nameLen = strlen(ev->name);
+    char path[dir->len + nameLen + 2];
+    memcpy(path, dir->path, dir->len);
+    path[dir->len] = '/';
+    memcpy(path + dir->len + 1, ev->name, nameLen + 1);
+    prv_entry_t *e = entry_find(path, hash_path(path));
+    if (e) {
+        entry_remove(e);
+    }
+}
+
+/* returns whether events are queued. Lookups check before taking the
+   lock, so a hit with nothing queued makes its one system call unlocked.
+   The caller's own changes are queued by the time it looks up the file */
+static int events_queued(void)
+{
+    struct pollfd fd = { __atomic_load_n(&s_cache.inotifyFd, __ATOMIC_RELAXED), POLLIN, 0 };
+    return (poll(&fd, 1, 0) > 0);
+}
+
+/* reads and handles the queued events without blocking. Called with the
+   lock held */
+static void drain_events(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(s_cache.inotifyFd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        s_cache.gen++;
+        char *p;
+        for (p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+static void *watch_thread(void *arg)
+{
+    struct pollfd fds[2] = {
+        { s_cache.inotifyFd, POLLIN, 0 },
+        { s_cache.stopFd, POLLIN, 0 }
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            AFLOG_ERR("file_cache_poll:errno=%d", errno);
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        pthread_mutex_lock(&s_cache.lock);
+        drain_events();
+        pthread_mutex_unlock(&s_cache.lock);
+    }
+    return NULL;
+}
+
+/* returns the directory of path, watching it if it isn't already; NULL
+   if it can't be watched. Called with the lock held */
+static prv_dir_t *dir_get(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash - path;
+    prv_dir_t *dir;
+    for (dir = s_cache.dirs; dir; dir = dir->next) {
+        if (dir->len == len && strncmp(dir->path, path, len) == 0) {
+            return dir;
+        }
+    }
+
+    dir = (prv_dir_t *)malloc(sizeof(prv_dir_t) + len + 2);
+    if (dir == NULL) {
+        return NULL;
+    }
+    memcpy(dir->path, path, len);
+    /* the root directory is watched as "/" but joined as "" */
+    strcpy(dir->path + len, len ? "" : "/");
+
+    struct statfs fs;
+    if (statfs(dir->path, &fs) < 0) {
+        free(dir);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < sizeof(s_uncachedFs) / sizeof(s_uncachedFs[0]); i++) {
+        if ((uint32_t)fs.f_type == s_uncachedFs[i]) {
+            free(dir);
+            return NULL;
+        }
+    }
+    dir->wd = inotify_add_watch(s_cache.inotifyFd, dir->path, WATCH_EVENTS);
+    if (dir->wd < 0) {
+        free(dir);
+        return NULL;
+    }
+    dir->path[len] = '\0';
+    dir->len = len;
+    dir->numEntries = 0;
+
+    /* inotify returns the same watch for another path to the directory */
+    prv_dir_t *d;
+    for (d = s_cache.dirs; d; d = d->next) {
+        if (d->wd == dir->wd) {
+            free(dir);
+            return NULL;
+        }
+    }
+    dir->next = s_cache.dirs;
+    s_cache.dirs = dir;
+    return dir;
+}
+
+/* returns the entry for path, creating it if needed and moving it to the
+   head of the LRU list; NULL if path can't be cached. Called with the
+   lock held */
+static prv_entry_t *entry_get(const char *path, uint32_t hash)
+{
+    prv_entry_t *e = entry_find(path, hash);
+    if (e) {
+        if (e != s_cache.lruHead) {
+            lru_remove(e);
+            lru_add_head(e);
+        }
+        return e;
+    }
+
+    prv_dir_t *dir = dir_get(path);
+    if (dir == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(path);
+    e = (prv_entry_t *)calloc(1, sizeof(prv_entry_t) + len + 1);
+    if (e == NULL) {
+        if (dir->numEntries == 0) {
+            dir->numEntries++;
+            dir_release(dir);
+        }
+        return NULL;
+    }
+    memcpy(e->path, path, len + 1);
+    e->hash = hash;
+    e->exists = -1;
+    e->dir = dir;
+    dir->numEntries++;
+
+    if (s_cache.numEntries >= s_cache.maxEntries) {
+        entry_remove(s_cache.lruTail);
+    }
+    e->hashNext = s_cache.table[hash & s_cache.mask];
+    s_cache.table[hash & s_cache.mask] = e;
+    lru_add_head(e);
+    s_cache.numEntries++;
+    return e;
+}
+
+/* only absolute paths to regular locations are cached; a relative path
+   changes meaning with the working directory */
+static int cacheable(const char *path)
+{
+    return (path && path[0] == '/' && strstr(path, "/./") == NULL && strstr(path, "/../") == NULL);
+}
+
+int file_cache_exists(const char *filename)
+{
+    if (!__atomic_load_n(&s_cache.enabled, __ATOMIC_RELAXED) || !cacheable(filename)) {
+        return -1;
+    }
+
+    uint32_t hash = hash_path(filename);
+    int queued = events_queued();
+    pthread_mutex_lock(&s_cache.lock);
+    prv_entry_t *e = NULL;
+    if (s_cache.enabled) {
+        if (queued) {
+            drain_events();
+        }
+        e = entry_find(filename, hash);
+    }
+    if (e && e->exists >= 0) {
+        int exists = e->exists;
+        pthread_mutex_unlock(&s_cache.lock);
+        return exists;
+    }
+    uint64_t gen = s_cache.gen;
+    /* watch the directory before looking at the file */
+    e = (s_cache.enabled ? entry_get(filename, hash) : NULL);
+    pthread_mutex_unlock(&s_cache.lock);
+    if (e == NULL) {
+        return -1;
+    }
+
+    int exists = (access(filename, R_OK) == 0);
+
+    /* the entry may have been evicted meanwhile, so look it up again */
+    queued = events_queued();
+    pthread_mutex_lock(&s_cache.lock);
+    if (s_cache.enabled && queued) {
+        drain_events();
+    }
+    if (s_cache.enabled && s_cache.gen == gen && (e = entry_find(filename, hash)) != NULL) {
+        e->exists = exists;
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+    return exists;
+}
+
+ssize_t file_cache_read(const char *filename, char *buf, size_t n)
+{
+    if (!__atomic_load_n(&s_cache.enabled, __ATOMIC_RELAXED) || !cacheable(filename)) {
+        return -1;
+    }
+
+    uint32_t hash = hash_path(filename);
+    int queued = events_queued();
+    pthread_mutex_lock(&s_cache.lock);
+    prv_entry_t *e = NULL;
+    if (s_cache.enabled) {
+        if (queued) {
+            drain_events();
+        }
+        e = entry_find(filename, hash);
+    }
+    if (e && e->dataState != DATA_UNKNOWN) {
+        ssize_t len = -1;
+        if (e->dataState == DATA_CACHED) {
+            len = (e->dataLen < n ? e->dataLen : n);
+            memcpy(buf, e->data, len);
+        }
+        pthread_mutex_unlock(&s_cache.lock);
+        return len;
+    }
+    uint64_t gen = s_cache.gen;
+    e = (s_cache.enabled ? entry_get(filename, hash) : NULL);
+    pthread_mutex_unlock(&s_cache.lock);
+    if (e == NULL) {
+        return -1;
+    }
+
+    /* one byte more than is cached tells a file that's too large */
+    char *data = (char *)malloc(AF_UTIL_CACHE_MAX_FILE + 1);
+    if (data == NULL) {
+        return -1;
+    }
+    ssize_t len = -1;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        size_t nread = 0;
+        while (nread <= AF_UTIL_CACHE_MAX_FILE) {
+            ssize_t ret = pread(fd, data + nread, AF_UTIL_CACHE_MAX_FILE + 1 - nread, nread);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                len = (ret < 0 ? -1 : nread);
+                break;
+            }
+            nread += ret;
+        }
+        close(fd);
+    }
+    if (len > AF_UTIL_CACHE_MAX_FILE) {
+        len = -1;
+    }
+    if (len >= 0) {
+        memcpy(buf, data, (len < n ? len : n));
+    }
+
+    queued = events_queued();
+    pthread_mutex_lock(&s_cache.lock);
+    if (s_cache.enabled && queued) {
+        drain_events();
+    }
+    if (s_cache.enabled && s_cache.gen == gen && (e = entry_find(filename, hash)) != NULL && e->dataState == DATA_UNKNOWN) {
+        if (len >= 0) {
+            char *d = (char *)realloc(data, len ? len : 1);
+            e->data = (d ? d : data);
+            e->dataLen = len;
+            e->dataState = DATA_CACHED;
+            data = NULL;
+        } else {
+            e->dataState = DATA_UNCACHED;
+        }
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+    free(data);
+    return (len >= 0 && len > n ? (ssize_t)n : len);
+}
+
+int af_util_cache_enable(uint32_t maxEntries)
+{
+    if (maxEntries == 0 || maxEntries > AF_UTIL_CACHE_MAX_ENTRIES) {
+        AFLOG_ERR("af_util_cache_enable_param:maxEntries=%u", maxEntries);
+        errno = EINVAL;
+        return -1;
+    }
+    if (s_cache.inotifyFd >= 0) {
+        AFLOG_ERR("af_util_cache_enable_enabled");
+        errno = EALREADY;
+        return -1;
+    }
+
+    uint32_t size = 1;
+    while (size < maxEntries * 2) {
+        size <<= 1;
+    }
+    prv_entry_t **table = (prv_entry_t **)calloc(size, sizeof(prv_entry_t *));
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int stopFd = eventfd(0, EFD_CLOEXEC);
+    if (table == NULL || inotifyFd < 0 || stopFd < 0) {
+        AFLOG_ERR("af_util_cache_enable_init:errno=%d", errno);
+        goto error;
+    }
+
+    pthread_mutex_lock(&s_cache.lock);
+    s_cache.table = table;
+    s_cache.mask = size - 1;
+    s_cache.maxEntries = maxEntries;
+    s_cache.inotifyFd = inotifyFd;
+    s_cache.stopFd = stopFd;
+    pthread_mutex_unlock(&s_cache.lock);
+
+    int err = pthread_create(&s_cache.thread, NULL, watch_thread, NULL);
+    if (err != 0) {
+        AFLOG_ERR("af_util_cache_enable_thread:err=%d", err);
+        pthread_mutex_lock(&s_cache.lock);
+        s_cache.table = NULL;
+        s_cache.inotifyFd = -1;
+        s_cache.stopFd = -1;
+        pthread_mutex_unlock(&s_cache.lock);
+        errno = err;
+        goto error;
+    }
+    __atomic_store_n(&s_cache.enabled, 1, __ATOMIC_RELEASE);
+    AFLOG_DEBUG1("af_util_cache_enabled:maxEntries=%u", maxEntries);
+    return 0;
+
+error:
+    err = errno;
+    free(table);
+    if (inotifyFd >= 0) {
+        close(inotifyFd);
+    }
+    if (stopFd >= 0) {
+        close(stopFd);
+    }
+    errno = err;
+    return -1;
+}
+
+void af_util_cache_disable(void)
+{
+    if (s_cache.inotifyFd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_cache.lock);
+    s_cache.enabled = 0;
+    pthread_mutex_unlock(&s_cache.lock);
+
+    uint64_t one = 1;
+    if (write(s_cache.stopFd, &one, sizeof(one)) != sizeof(one)) {
+        AFLOG_ERR("af_util_cache_disable_write:errno=%d", errno);
+    }
+    pthread_join(s_cache.thread, NULL);
+
+    pthread_mutex_lock(&s_cache.lock);
+    remove_all();
+    close(s_cache.inotifyFd);
+    close(s_cache.stopFd);
+    free(s_cache.table);
+    s_cache.table = NULL;
+    s_cache.inotifyFd = -1;
+    s_cache.stopFd = -1;
+    s_cache.gen++;
+    pthread_mutex_unlock(&s_cache.lock);
+}
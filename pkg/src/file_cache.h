@@ -0,0 +1,22 @@
+//
+// file_cache.h -- cache behind af_util_file_exists and af_util_read_file;
+// not installed
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <sys/types.h>
+
+/* returns whether the file exists and is readable, as 1 or 0, or -1 if
+   the cache is off or can't follow changes to the file */
+int file_cache_exists(const char *filename);
+
+/* copies up to n bytes of the file to buf and returns the number copied,
+   or returns -1 if the cache is off or doesn't hold the file because it's
+   missing, too large, or its changes can't be followed */
+ssize_t file_cache_read(const char *filename, char *buf, size_t n);
+
+#endif // __FILE_CACHE_H__
@@ -0,0 +1,356 @@
+//
+// hex_kernel.c -- hex conversion kernels
+//
+// The scalar kernels work on any target. On x86 the SSE2 and AVX2 kernels
+// are picked at run time from what the CPU supports; on ARM the NEON
+// kernels are used when the library is built for a target with NEON.
+// Every vector kernel converts whole chunks and leaves the rest of the
+// buffer to the scalar kernel.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "af_log.h"
+#include "hex_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HEX_KERNEL_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HEX_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+#define HEX_INVALID 0x10
+
+/* value of each hex digit; everything else has HEX_INVALID set and its low
+   nibble clear so non-strict decoding turns it into 0. The ranges don't
+   overlap, so the table builds cleanly with -Woverride-init */
+static const uint8_t s_hexValue[256] = {
+    [0 ... '0' - 1] = HEX_INVALID,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['9' + 1 ... 'A' - 1] = HEX_INVALID,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['F' + 1 ... 'a' - 1] = HEX_INVALID,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['f' + 1 ... 255] = HEX_INVALID
+};
+
+/* the two hex digits of every byte value */
+#define HEX_ROW(_h) _h "0" _h "1" _h "2" _h "3" _h "4" _h "5" _h "6" _h "7" \
+                    _h "8" _h "9" _h "a" _h "b" _h "c" _h "d" _h "e" _h "f"
+static const char s_hexPairs[513] =
+    HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b") HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+static void encode_scalar(char *dest, const uint8_t *source, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        memcpy(dest + i * 2, &s_hexPairs[source[i] * 2], 2);
+    }
+}
+
+static size_t decode_scalar(uint8_t *dest, const char *source, size_t len, int strict)
+{
+    const uint8_t *s = (const uint8_t *)source;
+    size_t i;
+
+    if (!strict) {
+        for (i = 0; i < len; i++) {
+            dest[i] = ((s_hexValue[s[i * 2] & 0x7f] & 0x0f) << 4) | (s_hexValue[s[i * 2 + 1] & 0x7f] & 0x0f);
+        }
+        return len * 2;
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t hi = s_hexValue[s[i * 2]];
+        uint8_t lo = s_hexValue[s[i * 2 + 1]];
+        if ((hi | lo) & HEX_INVALID) {
+            return i * 2 + ((hi & HEX_INVALID) ? 0 : 1);
+        }
+        dest[i] = (hi << 4) | lo;
+    }
+    return len * 2;
+}
+
+#ifdef HEX_KERNEL_X86
+
+/* SSE2 has no byte shuffle, so nibbles are turned into characters with
+   compares; each kernel converts 16 bytes or 32 characters at a time */
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_hex_chars(__m128i n)
+{
+    __m128i c = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    return _mm_add_epi8(c, _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("sse2")))
+static void encode_sse2(char *dest, const uint8_t *source, size_t len)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(source + i));
+        __m128i hi = sse2_hex_chars(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = sse2_hex_chars(_mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *)(dest + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dest + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    encode_scalar(dest + i * 2, source + i, len - i);
+}
+
+/* converts 16 characters to nibble values and sets valid to 0xff for each
+   character that is a hex digit; characters with the top bit set compare
+   as negative and are never valid */
+__attribute__((target("sse2")))
+static inline __m128i sse2_nibbles(__m128i v, __m128i *valid)
+{
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    *valid = _mm_or_si128(digit, alpha);
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+                        _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+/* combines the nibble pairs of 16 characters into the low bytes of 8 words */
+__attribute__((target("sse2")))
+static inline __m128i sse2_pairs(__m128i n)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(n, 8));
+}
+
+__attribute__((target("sse2")))
+static size_t decode_sse2(uint8_t *dest, const char *source, size_t len, int strict)
+{
+    const __m128i top = _mm_set1_epi8(strict ? 0xff : 0x7f);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i valid0, valid1;
+        __m128i v0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(source + i * 2)), top);
+        __m128i v1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(source + i * 2 + 16)), top);
+        __m128i n0 = sse2_nibbles(v0, &valid0);
+        __m128i n1 = sse2_nibbles(v1, &valid1);
+        if (strict && _mm_movemask_epi8(_mm_and_si128(valid0, valid1)) != 0xffff) {
+            /* let the scalar kernel find the bad character */
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(sse2_pairs(n0), sse2_pairs(n1)));
+    }
+    return i * 2 + decode_scalar(dest + i, source + i * 2, len - i, strict);
+}
+
+/* the AVX2 kernels work like the SSE2 ones on 32 bytes or 64 characters;
+   unpack and pack work within 128 bit lanes, so the results are permuted
+   back into order */
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_hex_chars(__m256i n)
+{
+    __m256i c = _mm256_add_epi8(n, _mm256_set1_epi8('0'));
+    __m256i letter = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+    return _mm256_add_epi8(c, _mm256_and_si256(letter, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(char *dest, const uint8_t *source, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(source + i));
+        __m256i hi = avx2_hex_chars(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = avx2_hex_chars(_mm256_and_si256(v, mask));
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);   /* bytes 0-7 and 16-23 */
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);   /* bytes 8-15 and 24-31 */
+        _mm256_storeu_si256((__m256i *)(dest + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    encode_scalar(dest + i * 2, source + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_nibbles(__m256i v, __m256i *valid)
+{
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    *valid = _mm256_or_si256(digit, alpha);
+    return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+                           _mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_pairs(__m256i n)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)), 4),
+                           _mm256_srli_epi16(n, 8));
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(uint8_t *dest, const char *source, size_t len, int strict)
+{
+    const __m256i top = _mm256_set1_epi8(strict ? 0xff : 0x7f);
+    size_t i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i valid0, valid1;
+        __m256i v0 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(source + i * 2)), top);
+        __m256i v1 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(source + i * 2 + 32)), top);
+        __m256i n0 = avx2_nibbles(v0, &valid0);
+        __m256i n1 = avx2_nibbles(v1, &valid1);
+        if (strict && _mm256_movemask_epi8(_mm256_and_si256(valid0, valid1)) != -1) {
+            break;
+        }
+        /* the pack leaves the 64 bit quarters in the order 0, 2, 1, 3 */
+        __m256i packed = _mm256_packus_epi16(avx2_pairs(n0), avx2_pairs(n1));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    return i * 2 + decode_scalar(dest + i, source + i * 2, len - i, strict);
+}
+
+#endif // HEX_KERNEL_X86
+
+#ifdef HEX_KERNEL_NEON
+
+/* the NEON kernels use interleaving loads and stores, so each one handles
+   16 bytes or 32 characters at a time without shuffling */
+
+static inline uint8x16_t neon_hex_chars(uint8x16_t n)
+{
+    uint8x16_t c = vaddq_u8(n, vdupq_n_u8('0'));
+    return vaddq_u8(c, vandq_u8(vcgtq_u8(n, vdupq_n_u8(9)), vdupq_n_u8('a' - '0' - 10)));
+}
+
+static void encode_neon(char *dest, const uint8_t *source, size_t len)
+{
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(source + i);
+        uint8x16x2_t out;
+        out.val[0] = neon_hex_chars(vshrq_n_u8(v, 4));
+        out.val[1] = neon_hex_chars(vandq_u8(v, vdupq_n_u8(0x0f)));
+        vst2q_u8((uint8_t *)dest + i * 2, out);
+    }
+    encode_scalar(dest + i * 2, source + i, len - i);
+}
+
+/* unsigned compares after subtracting the start of each range catch
+   characters on either side of it */
+static inline uint8x16_t neon_nibbles(uint8x16_t v, uint8x16_t *valid)
+{
+    uint8x16_t d = vsubq_u8(v, vdupq_n_u8('0'));
+    uint8x16_t a = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t digit = vcleq_u8(d, vdupq_n_u8(9));
+    uint8x16_t alpha = vcleq_u8(a, vdupq_n_u8(5));
+    *valid = vorrq_u8(digit, alpha);
+    return vorrq_u8(vandq_u8(digit, d), vandq_u8(alpha, vaddq_u8(a, vdupq_n_u8(10))));
+}
+
+static size_t decode_neon(uint8_t *dest, const char *source, size_t len, int strict)
+{
+    const uint8x16_t top = vdupq_n_u8(strict ? 0xff : 0x7f);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16x2_t in = vld2q_u8((const uint8_t *)source + i * 2);
+        uint8x16_t validHi, validLo;
+        uint8x16_t hi = neon_nibbles(vandq_u8(in.val[0], top), &validHi);
+        uint8x16_t lo = neon_nibbles(vandq_u8(in.val[1], top), &validLo);
+        if (strict) {
+            uint64x2_t valid = vreinterpretq_u64_u8(vandq_u8(validHi, validLo));
+            if ((vgetq_lane_u64(valid, 0) & vgetq_lane_u64(valid, 1)) != UINT64_MAX) {
+                break;
+            }
+        }
+        vst1q_u8(dest + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    }
+    return i * 2 + decode_scalar(dest + i, source + i * 2, len - i, strict);
+}
+
+#endif // HEX_KERNEL_NEON
+
+size_t af_hex_kernel_encode_spaced(char *dest, const uint8_t *source, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    char *d = dest;
+    size_t i;
+    for (i = 0; i < len - 1; i++) {
+        memcpy(d, &s_hexPairs[source[i] * 2], 2);
+        d[2] = ' ';
+        d += 3;
+    }
+    memcpy(d, &s_hexPairs[source[i] * 2], 2);
+    return len * 3 - 1;
+}
+
+typedef struct {
+    const char *name;
+    void (*encode)(char *dest, const uint8_t *source, size_t len);
+    size_t (*decode)(uint8_t *dest, const char *source, size_t len, int strict);
+} prv_kernel_t;
+
+static const prv_kernel_t s_scalarKernel = { "scalar", encode_scalar, decode_scalar };
+#ifdef HEX_KERNEL_X86
+static const prv_kernel_t s_sse2Kernel = { "sse2", encode_sse2, decode_sse2 };
+static const prv_kernel_t s_avx2Kernel = { "avx2", encode_avx2, decode_avx2 };
+#endif
+#ifdef HEX_KERNEL_NEON
+static const prv_kernel_t s_neonKernel = { "neon", encode_neon, decode_neon };
+#endif
+
+static const prv_kernel_t *s_kernel;
+
+/* picks the kernels on first use; threads racing here pick the same ones */
+static const prv_kernel_t *get_kernel(void)
+{
+    const prv_kernel_t *k = __atomic_load_n(&s_kernel, __ATOMIC_ACQUIRE);
+    if (k != NULL) {
+        return k;
+    }
+
+    k = &s_scalarKernel;
+#ifdef HEX_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        k = &s_avx2Kernel;
+    } else if (__builtin_cpu_supports("sse2")) {
+        k = &s_sse2Kernel;
+    }
+#endif
+#ifdef HEX_KERNEL_NEON
+    k = &s_neonKernel;
+#endif
+    AFLOG_DEBUG3("hex_kernel:name=%s", k->name);
+
+    __atomic_store_n(&s_kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+void af_hex_kernel_encode(char *dest, const uint8_t *source, size_t len)
+{
+    get_kernel()->encode(dest, source, len);
+}
+
+size_t af_hex_kernel_decode(uint8_t *dest, const char *source, size_t len, int strict)
+{
+    return get_kernel()->decode(dest, source, len, strict);
+}
+
+const char *af_hex_kernel_name(void)
+{
+    return get_kernel()->name;
+}
@@ -0,0 +1,36 @@
+//
+// hex_kernel.h -- hex conversion kernels shared by the af_util hex and
+// log buffer functions; not installed
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __HEX_KERNEL_H__
+#define __HEX_KERNEL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* writes the 2 * len lower case hex characters for source to dest; dest
+   is not NUL terminated */
+void af_hex_kernel_encode(char *dest, const uint8_t *source, size_t len);
+
+/* decodes the 2 * len hex characters in source into len bytes in dest.
+   If strict is 0, characters that are not hex digits are treated the way
+   af_util_hex_to_buffer always has: the top bit is ignored and anything
+   that still isn't a hex digit decodes as 0. If strict is nonzero,
+   decoding stops at the first character that isn't a hex digit and the
+   bytes from that pair on are undefined.
+   returns the index of the first invalid character, or 2 * len if there
+   is none */
+size_t af_hex_kernel_decode(uint8_t *dest, const char *source, size_t len, int strict);
+
+/* writes source to dest as lower case hex bytes separated by spaces, as in
+   "01 ab ff"; returns the number of characters written, which is
+   3 * len - 1 for len > 0. dest is not NUL terminated */
+size_t af_hex_kernel_encode_spaced(char *dest, const uint8_t *source, size_t len);
+
+/* returns the name of the kernels in use: "avx2", "sse2", "neon", or "scalar" */
+const char *af_hex_kernel_name(void);
+
+#endif // __HEX_KERNEL_H__
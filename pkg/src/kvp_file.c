@@ -0,0 +1,320 @@
+//
+// kvp_file.c -- key value pair file parser that maps the file and returns
+// views of the values
+//
+// af_util_parse_key_value_pair_file reads the file instead, because a
+// mapped file that's truncated while it's parsed raises SIGBUS.
+//
+// Lines are found with memchr, which the C library vectorizes, and keys
+// are looked up in an open addressing table of the wanted keys. The
+// errors logged are the same as the old fgets based parser's.
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AF_LOG_MODULE "util"
+#include "af_log.h"
+#include "af_util.h"
+#include "kvp_file.h"
+
+#define INDEX_STACK_SIZE 64
+#define READ_BUF_SIZE    4096
+
+struct af_kvp_file_struct {
+    char *data;
+    size_t size;
+    int mapped;     /* data is mapped rather than allocated */
+};
+
+typedef struct {
+    af_kvp_view_t *views;
+    uint32_t *slots;        /* view index plus one; 0 is empty */
+    uint32_t mask;
+} prv_index_t;
+
+static uint32_t hash_key(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* the first view asking for a key wins, as it did with the old parser */
+static void index_add(prv_index_t *index, int view)
+{
+    const char *key = index->views[view].key;
+    size_t len = strlen(key);
+    uint32_t slot = hash_key(key, len) & index->mask;
+    while (index->slots[slot]) {
+        if (strcmp(index->views[index->slots[slot] - 1].key, key) == 0) {
+            return;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot] = view + 1;
+}
+
+static af_kvp_view_t *index_find(prv_index_t *index, const char *key, size_t len)
+{
+    uint32_t slot = hash_key(key, len) & index->mask;
+    while (index->slots[slot]) {
+        af_kvp_view_t *v = &index->views[index->slots[slot] - 1];
+        if (strncmp(v->key, key, len) == 0 && v->key[len] == '\0') {
+            return v;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static void parse(prv_index_t *index, const char *data, size_t size)
+{
+    const char *c = data, *end = data + size;
+    int line = 0;
+
+    while (c < end) {
+        const char *eol = (const char *)memchr(c, '\n', end - c);
+        if (eol == NULL) {
+            eol = end;
+        }
+        line++;
+
+        while (c < eol && isblank(*c)) c++;   /* skip over any leading spaces */
+        if (c == eol || *c == '#') {          /* blank line or comment */
+            c = eol + 1;
+            continue;
+        }
+
+        /* make sure the key starts right */
+        const char *key = c;
+        if (!isalpha(*c) && *c != '_') {
+            AFLOG_ERR("parse_kvp_bad_key_start:line=%d:key must start with an alphabetic character or '_'", line);
+            c = eol + 1;
+            continue;
+        }
+        c++;
+
+        /* make sure key contains the right characters */
+        while (c < eol && (isalnum(*c) || *c == '_')) c++;
+        if (c == eol || (*c != '=' && !isblank(*c))) {
+            AFLOG_ERR("parse_kvp_bad_key_body:line=%d:key must contain only alphanumeric characters and '_'", line);
+            c = eol + 1;
+            continue;
+        }
+
+        af_kvp_view_t *view = index_find(index, key, c - key);
+        if (view == NULL) {
+            AFLOG_WARNING("parse_kvp_key_not_found:line=%d,key=%.*s:key not found; ignoring", line, (int)(c - key), key);
+            c = eol + 1;
+            continue;
+        }
+
+        /* check for equals sign and single quote */
+        if (*c != '=') {
+            AFLOG_ERR("parse_kvp_expected_eq:line=%d:expected \"=\" character", line);
+            c = eol + 1;
+            continue;
+        }
+        c++;
+        if (c == eol || *c != '\'') {
+            AFLOG_ERR("parse_kvp_expected_quote:line=%d:expected single quote", line);
+            c = eol + 1;
+            continue;
+        }
+        c++;
+
+        /* find the closing single quote */
+        const char *quote = (const char *)memchr(c, '\'', eol - c);
+        if (quote == NULL) {
+            AFLOG_ERR("parse_kvp_unmatched_quotes:line=%d", line);
+            c = eol + 1;
+            continue;
+        }
+        view->value = c;
+        view->valueLen = quote - c;
+        c = quote + 1;
+
+        /* skip any trailing spaces */
+        while (c < eol && isblank(*c)) c++;
+        if (c != eol) {
+            AFLOG_ERR("parse_kvp_unexpected_char_end:line=%d:unexpected character after quote", line);
+        }
+        c = eol + 1;
+    }
+}
+
+/* reads fd to the end into a NUL terminated buffer that starts with room
+   for size - 1 bytes and grows as needed. returns the length, or -1 with
+   errno set */
+static ssize_t read_fd(int fd, size_t size, char **buf)
+{
+    char *data = (char *)malloc(size);
+    size_t len = 0;
+    int err = (data ? 0 : ENOMEM);
+    while (err == 0) {
+        if (len == size - 1) {
+            char *d = (char *)realloc(data, size * 2);
+            if (d == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            data = d;
+            size *= 2;
+        }
+        ssize_t ret = read(fd, data + len, size - 1 - len);
+        if (ret > 0) {
+            len += ret;
+        } else if (ret == 0) {
+            break;
+        } else if (errno != EINTR) {
+            err = errno;
+        }
+    }
+    if (err) {
+        free(data);
+        errno = err;
+        return -1;
+    }
+    data[len] = '\0';
+    *buf = data;
+    return len;
+}
+
+/* maps a regular file if map is set, or reads the file, which works for
+   files such as those in /proc whose size isn't known */
+static int load(af_kvp_file_t *file, const char *path, int map)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AFLOG_ERR("parse_kvp_open:errno=%d", errno);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        AFLOG_ERR("parse_kvp_fstat:errno=%d", err);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    if (map && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            AFLOG_ERR("parse_kvp_mmap:errno=%d", err);
+            errno = err;
+            return -1;
+        }
+        file->data = (char *)data;
+        file->size = st.st_size;
+        file->mapped = 1;
+        return 0;
+    }
+
+    /* a regular file's buffer has room for one byte more than its size,
+       so the read that finds the end needs no realloc */
+    size_t size = (S_ISREG(st.st_mode) && st.st_size > 0 ? (size_t)st.st_size + 2 : READ_BUF_SIZE);
+    ssize_t len = read_fd(fd, size, &file->data);
+    int err = errno;
+    close(fd);
+    if (len < 0) {
+        AFLOG_ERR("parse_kvp_read:errno=%d", err);
+        errno = err;
+        return -1;
+    }
+    file->size = len;
+    return 0;
+}
+
+af_kvp_file_t *kvp_file_open(const char *path, af_kvp_view_t *views, int numViews, int map)
+{
+    if (path == NULL || (views == NULL && numViews > 0) || numViews < 0) {
+        AFLOG_ERR("parse_kvp_param:path_NULL=%d,views_NULL=%d,numViews=%d", path == NULL, views == NULL, numViews);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < numViews; i++) {
+        if (views[i].key == NULL) {
+            AFLOG_ERR("parse_kvp_param:key_NULL=%d", i);
+            errno = EINVAL;
+            return NULL;
+        }
+        views[i].value = NULL;
+        views[i].valueLen = 0;
+    }
+
+    af_kvp_file_t *file = (af_kvp_file_t *)calloc(1, sizeof(af_kvp_file_t));
+    if (file == NULL) {
+        AFLOG_ERR("parse_kvp_calloc");
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (load(file, path, map) < 0) {
+        int err = errno;
+        free(file);
+        errno = err;
+        return NULL;
+    }
+
+    /* the index is at most half full */
+    uint32_t stackSlots[INDEX_STACK_SIZE];
+    uint32_t size = 2;
+    while (size < (uint32_t)numViews * 2) {
+        size <<= 1;
+    }
+    prv_index_t index = { views, stackSlots, size - 1 };
+    if (size > INDEX_STACK_SIZE) {
+        index.slots = (uint32_t *)malloc(size * sizeof(uint32_t));
+        if (index.slots == NULL) {
+            AFLOG_ERR("parse_kvp_index_malloc");
+            af_util_kvp_close(file);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    memset(index.slots, 0, size * sizeof(uint32_t));
+    for (i = 0; i < numViews; i++) {
+        index_add(&index, i);
+    }
+
+    parse(&index, file->data, file->size);
+
+    if (index.slots != stackSlots) {
+        free(index.slots);
+    }
+    return file;
+}
+
+af_kvp_file_t *af_util_kvp_open(const char *path, af_kvp_view_t *views, int numViews)
+{
+    return kvp_file_open(path, views, numViews, 1);
+}
+
+void af_util_kvp_close(af_kvp_file_t *file)
+{
+    if (file) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+        free(file);
+    }
+}
@@ -0,0 +1,17 @@
+//
+// kvp_file.h -- key value pair file parser behind af_util_kvp_open and
+// af_util_parse_key_value_pair_file; not installed
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __KVP_FILE_H__
+#define __KVP_FILE_H__
+
+#include "af_util.h"
+
+/* same as af_util_kvp_open, but if map is 0 the file is read into memory
+   rather than mapped, so it can be truncated while it's parsed */
+af_kvp_file_t *kvp_file_open(const char *path, af_kvp_view_t *views, int numViews, int map);
+
+#endif // __KVP_FILE_H__
@@ -0,0 +1,154 @@
+//
+// log_binary.c -- format string parsing shared by the binary log writer
+// in af_log.c and the af_logdecode tool
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <string.h>
+
+#include "log_binary.h"
+
+int log_binary_arg_size(uint8_t type)
+{
+    switch (LOG_BINARY_ARG_BASE(type)) {
+        case LOG_BINARY_ARG_INT :
+            return 4;
+        case LOG_BINARY_ARG_STRING :
+            return 2;
+        default :
+            return 8;
+    }
+}
+
+int log_binary_parse_format(const char *format, uint8_t *types, int maxArgs, log_binary_conv_t *convs, int *numConvs)
+{
+    const char *p = format;
+    int numArgs = 0, nc = 0;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        const char *start = p++;
+        int firstArg = numArgs, precision = 0;
+
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        /* flags, width, and precision */
+        p += strspn(p, "-+ #0'I");
+        while (1) {
+            if (*p == '*') {
+                if (numArgs >= maxArgs) {
+                    return -1;
+                }
+                types[numArgs++] = LOG_BINARY_ARG_INT;
+                p++;
+            } else if (*p >= '0' && *p <= '9') {
+                p += strspn(p, "0123456789");
+                if (*p == '$') {
+                    return -1;
+                }
+            } else if (*p == '.' && !precision) {
+                precision = 1;
+                p++;
+            } else {
+                break;
+            }
+        }
+
+        /* length modifier */
+        uint8_t type = LOG_BINARY_ARG_INT;
+        switch (*p) {
+            case 'h' :
+                p += (p[1] == 'h' ? 2 : 1);
+                break;
+            case 'l' :
+                if (p[1] == 'l') {
+                    type = LOG_BINARY_ARG_LLONG;
+                    p += 2;
+                } else {
+                    type = LOG_BINARY_ARG_LONG;
+                    p++;
+                }
+                break;
+            case 'q' :
+                type = LOG_BINARY_ARG_LLONG;
+                p++;
+                break;
+            case 'z' :
+                type = LOG_BINARY_ARG_SIZE;
+                p++;
+                break;
+            case 'j' :
+                type = LOG_BINARY_ARG_INTMAX;
+                p++;
+                break;
+            case 't' :
+                type = LOG_BINARY_ARG_PTRDIFF;
+                p++;
+                break;
+            case 'L' :
+                return -1;
+        }
+
+        switch (*p) {
+            case 'd' :
+            case 'i' :
+                break;
+            case 'o' :
+            case 'u' :
+            case 'x' :
+            case 'X' :
+                type |= LOG_BINARY_ARG_UNSIGNED;
+                break;
+            case 'c' :
+                if (type != LOG_BINARY_ARG_INT) {
+                    return -1;
+                }
+                break;
+            case 'e' :
+            case 'E' :
+            case 'f' :
+            case 'F' :
+            case 'g' :
+            case 'G' :
+            case 'a' :
+            case 'A' :
+                type = LOG_BINARY_ARG_DOUBLE;
+                break;
+            case 'p' :
+                type = LOG_BINARY_ARG_PTR;
+                break;
+            case 's' :
+                /* a precision lets the caller pass characters that aren't
+                   NUL terminated, which can't be copied without knowing it */
+                if (type != LOG_BINARY_ARG_INT || precision) {
+                    return -1;
+                }
+                type = LOG_BINARY_ARG_STRING;
+                break;
+            default :
+                /* %n, %m, wide strings, or a malformed conversion */
+                return -1;
+        }
+        p++;
+
+        if (numArgs >= maxArgs) {
+            return -1;
+        }
+        types[numArgs++] = type;
+        if (convs) {
+            convs[nc].start = start - format;
+            convs[nc].len = p - start;
+            convs[nc].firstArg = firstArg;
+            convs[nc].numArgs = numArgs - firstArg;
+        }
+        nc++;
+    }
+
+    if (numConvs) {
+        *numConvs = nc;
+    }
+    return numArgs;
+}
@@ -0,0 +1,83 @@
+//
+// log_binary.h -- layout of the binary log files written by af_log.c in
+// binary mode and read back by af_logdecode; not installed
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#ifndef __LOG_BINARY_H__
+#define __LOG_BINARY_H__
+
+#include <stdint.h>
+
+/* A file is a series of sessions, one for each time binary logging was
+   started or the file was rotated. Each session starts with a file header
+   followed by records. Integers are in the byte order of the machine that
+   wrote the file; the decoder works it out from byteOrder. */
+#define LOG_BINARY_MAGIC      "AFLOGBIN"
+#define LOG_BINARY_MAGIC_LEN  8
+#define LOG_BINARY_BYTE_ORDER 0x01020304
+#define LOG_BINARY_VERSION    1
+
+typedef struct {
+    char magic[LOG_BINARY_MAGIC_LEN];
+    uint32_t byteOrder;
+    uint32_t version;
+} log_binary_file_header_t;
+
+#define LOG_BINARY_KIND_SITE  1   /* payload is the site's format, NUL terminated */
+#define LOG_BINARY_KIND_EVENT 2   /* payload is the arguments as packed by af_log_binary */
+#define LOG_BINARY_KIND_TEXT  3   /* payload is the formatted message, not terminated */
+
+typedef struct {
+    uint16_t len;         /* record length including this header */
+    uint8_t kind;
+    uint8_t priority;
+    uint32_t siteId;      /* 0 for text records */
+    uint64_t timestamp;   /* nanoseconds since the epoch; 0 for site records */
+} log_binary_record_t;
+
+/* the longest format a site may have; sites with longer formats are
+   logged as text. Together with the slot size this keeps every record
+   length below the first two bytes of the magic, so the decoder can tell
+   a file header from a record. */
+#define LOG_BINARY_MAX_FORMAT 1024
+
+/* argument types. Integers are packed as 4 bytes if they are passed as
+   int and 8 bytes otherwise, so files don't depend on the size of long on
+   the machine that wrote them. Strings are packed as a 2 byte length
+   followed by the characters. */
+#define LOG_BINARY_ARG_INT      1
+#define LOG_BINARY_ARG_LONG     2
+#define LOG_BINARY_ARG_LLONG    3
+#define LOG_BINARY_ARG_SIZE     4
+#define LOG_BINARY_ARG_INTMAX   5
+#define LOG_BINARY_ARG_PTRDIFF  6
+#define LOG_BINARY_ARG_DOUBLE   7
+#define LOG_BINARY_ARG_PTR      8
+#define LOG_BINARY_ARG_STRING   9
+#define LOG_BINARY_ARG_UNSIGNED 0x80   /* or'ed into the integer types */
+
+#define LOG_BINARY_ARG_BASE(_t) ((_t) & ~LOG_BINARY_ARG_UNSIGNED)
+
+/* one conversion in a format */
+typedef struct {
+    uint16_t start;      /* offset of the '%' */
+    uint16_t len;        /* length up to and including the conversion character */
+    uint8_t firstArg;    /* index of the first argument it uses */
+    uint8_t numArgs;     /* arguments it uses: '*' widths and precisions, then the value */
+} log_binary_conv_t;
+
+/* returns the number of bytes an argument of type takes when packed, or
+   2 for strings, which take 2 bytes plus their length */
+int log_binary_arg_size(uint8_t type);
+
+/* finds the conversions in format and fills types with the type of each
+   argument. If convs is not NULL it's filled with the conversions, not
+   counting "%%"; there are never more conversions than arguments.
+   returns the number of arguments, or -1 if there are more than maxArgs
+   or the format uses something that can't be packed: %n, %m, positional
+   arguments, long double, wide characters, or a precision on %s */
+int log_binary_parse_format(const char *format, uint8_t *types, int maxArgs, log_binary_conv_t *convs, int *numConvs);
+
+#endif // __LOG_BINARY_H__
@@ -7,32 +7,54 @@
 //
 
 #include "af_log.h"
+#include "hex_kernel.h"
 #include <string.h>
 
 #define BYTES_PER_ROW 32
 
 void af_log_buffer(uint32_t level, char *name, uint8_t *buffer, int bufLen)
 {
-    char outBuf[BYTES_PER_ROW * 3];
-    int pos = 0, i = 0, row = 0;
+    af_log_buffer_wide(level, name, buffer, bufLen, BYTES_PER_ROW);
+}
+
+void af_log_buffer_wide(uint32_t level, char *name, uint8_t *buffer, int bufLen, int bytesPerRecord)
+{
+    char outBuf[AF_LOG_BUFFER_MAX_BYTES_PER_RECORD * 3];
+    int row;
 
     if (name == NULL || buffer == NULL || bufLen < 0) {
         return;
     }
+    if (bytesPerRecord <= 0) {
+        bytesPerRecord = BYTES_PER_ROW;
+    } else if (bytesPerRecord > AF_LOG_BUFFER_MAX_BYTES_PER_RECORD) {
+        bytesPerRecord = AF_LOG_BUFFER_MAX_BYTES_PER_RECORD;
+    }
 
     if (g_debugLevel >= level) {
-        while (bufLen--) {
-            pos += sprintf(outBuf + pos, (i == 0 ? "%02x" : " %02x"), *buffer++);
-            i++;
-            if (i >= BYTES_PER_ROW) {
-                syslog(LOG_DEBUG, "%s:%03x:%s", name, row, outBuf);
-                pos = 0;
-                i = 0;
-                row += BYTES_PER_ROW;
+        /* keep each record whole if it has to fit in an async slot */
+        uint32_t maxLen = af_log_max_msg_len();
+        if (maxLen) {
+            int rowDigits = 3;
+            while (rowDigits < 8 && (bufLen - 1) >> (rowDigits * 4)) {
+                rowDigits++;
+            }
+            /* "<name>:<row>:" then three characters per byte less one */
+            int room = (int)maxLen - (int)strlen(name) - rowDigits - 2;
+            int maxBytes = (room + 1) / 3;
+            if (maxBytes < 1) {
+                maxBytes = 1;
+            }
+            if (bytesPerRecord > maxBytes) {
+                bytesPerRecord = maxBytes;
             }
         }
-        if (i) {
-            syslog(LOG_DEBUG, "%s:%03x:%s", name, row, outBuf);
+
+        for (row = 0; row < bufLen; row += bytesPerRecord) {
+            int n = (bufLen - row < bytesPerRecord ? bufLen - row : bytesPerRecord);
+            size_t len = af_hex_kernel_encode_spaced(outBuf, buffer + row, n);
+            outBuf[len] = '\0';
+            af_log_printf(LOG_DEBUG, "%s:%03x:%s", name, row, outBuf);
         }
     }
 }
@@ -50,15 +72,33 @@ void af_log_buffer(uint32_t level, char *name, uint8_t *buffer, int bufLen)
 #define COPY_ERROR_AND_RETURN(_msg) \
     strncpy(buf, _msg, bufLen); \
     buf[bufLen - 1] = '\0'; \
-    return
+    return -1
+
+/* writes n in decimal without a terminator; returns the number of digits */
+static int format_decimal(char *dest, uint32_t n)
+{
+    char digits[10];
+    int len = 0, i;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    for (i = 0; i < len; i++) {
+        dest[i] = digits[len - 1 - i];
+    }
+    return len;
+}
 
 void af_util_convert_data_to_hex_with_name(char *name, uint8_t *data, int dataLen, char *buf, int bufLen)
 {
-    static char hexNybble[16] = "0123456789abcdef";
+    af_util_format_hex_with_name(name, data, dataLen, buf, bufLen);
+}
 
+int af_util_format_hex_with_name(const char *name, const uint8_t *data, int dataLen, char *buf, int bufLen)
+{
     /* check if we can't do anything */
     if (buf == NULL || bufLen < 1) {
-        return;
+        return -1;
     }
 
     /* check if we have other parameter errors */
@@ -75,7 +115,9 @@ void af_util_convert_data_to_hex_with_name(char *name, uint8_t *data, int dataLe
     }
 
     char lengthBuf[16];
-    int messageLen = strlen(name) + 3 + sprintf(lengthBuf, "%d", dataLen);
+    int nameLen = strlen(name);
+    int lengthLen = format_decimal(lengthBuf, dataLen);
+    int messageLen = nameLen + 3 + lengthLen;
     int truncated = 0, pos;
     int outputLen = dataLen;
     if (bufLen < messageLen + dataLen * 2 + 1) {
@@ -89,19 +131,21 @@ void af_util_convert_data_to_hex_with_name(char *name, uint8_t *data, int dataLe
         truncated = 1;
     }
 
+    memcpy(buf, name, nameLen);
+    pos = nameLen;
+    buf[pos++] = '[';
+    memcpy(buf + pos, lengthBuf, lengthLen);
+    pos += lengthLen;
+    buf[pos++] = ']';
+    buf[pos++] = '=';
     if (truncated) {
-        pos = sprintf(buf, "%s[%d]=" TRUNCATED_MSG, name, dataLen);
-    } else {
-        pos = sprintf(buf, "%s[%d]=", name, dataLen);
+        memcpy(buf + pos, TRUNCATED_MSG, sizeof(TRUNCATED_MSG) - 1);
+        pos += sizeof(TRUNCATED_MSG) - 1;
     }
 
-    int i;
-    for (i = 0; i < outputLen; i++) {
-        buf[pos++] = hexNybble[data[i] >> 4];
-        buf[pos++] = hexNybble[data[i] & 0x0f];
-    }
+    af_hex_kernel_encode(buf + pos, data, outputLen);
+    pos += outputLen * 2;
     buf[pos] = '\0';
 
-    return;
+    return pos;
 }
-
@@ -0,0 +1,342 @@
+//
+// af_logdecode.c -- prints the messages in binary log files written by
+// af_log in binary mode
+//
+// Each message is printed on its own line after its local timestamp. The
+// files may come from a machine with a different byte order. Site
+// definitions can appear after the first message from the site, so each
+// session in a file is read twice: once to collect the sites and once to
+// print the messages.
+//
+// usage: af_logdecode [file ...]
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "af_log.h"
+#include "log_binary.h"
+
+#define MAX_SITE_ID (1 << 20)
+
+typedef struct {
+    const char *format;   /* NULL if the site hasn't been defined */
+    int numArgs;
+    int numConvs;
+    uint8_t types[AF_LOG_BINARY_MAX_ARGS];
+    log_binary_conv_t convs[AF_LOG_BINARY_MAX_ARGS];
+} prv_site_t;
+
+static prv_site_t *s_sites;
+static uint32_t s_numSites;
+static int s_swap;
+
+static uint16_t get16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return (s_swap ? __builtin_bswap16(v) : v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (s_swap ? __builtin_bswap32(v) : v);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (s_swap ? __builtin_bswap64(v) : v);
+}
+
+static int read_record(const uint8_t *p, size_t left, log_binary_record_t *rec)
+{
+    if (left < sizeof(*rec)) {
+        return -1;
+    }
+    rec->len = get16(p);
+    rec->kind = p[2];
+    rec->priority = p[3];
+    rec->siteId = get32(p + 4);
+    rec->timestamp = get64(p + 8);
+    return (rec->len < sizeof(*rec) || rec->len > left ? -1 : 0);
+}
+
+static int is_header(const uint8_t *p, size_t left)
+{
+    return (left >= sizeof(log_binary_file_header_t) && memcmp(p, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN) == 0);
+}
+
+static void add_site(uint32_t id, const char *format, size_t len)
+{
+    if (id == 0 || id >= MAX_SITE_ID || len == 0 || format[len - 1] != '\0') {
+        fprintf(stderr, "af_logdecode: bad site record %u\n", id);
+        return;
+    }
+    if (id >= s_numSites) {
+        uint32_t n = (id + 1 > s_numSites * 2 ? id + 1 : s_numSites * 2);
+        prv_site_t *sites = (prv_site_t *)realloc(s_sites, n * sizeof(prv_site_t));
+        if (sites == NULL) {
+            perror("af_logdecode");
+            exit(1);
+        }
+        memset(sites + s_numSites, 0, (n - s_numSites) * sizeof(prv_site_t));
+        s_sites = sites;
+        s_numSites = n;
+    }
+
+    prv_site_t *site = &s_sites[id];
+    site->format = format;
+    site->numArgs = log_binary_parse_format(format, site->types, AF_LOG_BINARY_MAX_ARGS, site->convs, &site->numConvs);
+}
+
+/* appends the literal text in format[start, end), where "%%" stands for '%' */
+static void append_literal(char **out, char *end, const char *format, size_t start, size_t stop)
+{
+    size_t i;
+    for (i = start; i < stop && *out < end; i++) {
+        *(*out)++ = format[i];
+        if (format[i] == '%') {
+            i++;
+        }
+    }
+}
+
+/* the conversion with its length modifier replaced by mod */
+static void make_spec(char *spec, const char *format, const log_binary_conv_t *conv, const char *mod)
+{
+    const char *s = format + conv->start;
+    size_t n = strcspn(s + 1, "hlqzjtL") + 1;
+    if (n > conv->len - 1) {
+        n = conv->len - 1;
+    }
+    memcpy(spec, s, n);
+    strcpy(spec + n, mod);
+    n += strlen(mod);
+    spec[n] = s[conv->len - 1];
+    spec[n + 1] = '\0';
+}
+
+#define FORMAT_ARG(_v) \
+    (numStars == 0 ? snprintf(out, size, spec, _v) : \
+     numStars == 1 ? snprintf(out, size, spec, stars[0], _v) : \
+                     snprintf(out, size, spec, stars[0], stars[1], _v))
+
+static void decode_event(const prv_site_t *site, const uint8_t *p, const uint8_t *end, char *msg, size_t msgSize)
+{
+    char *out = msg, *outEnd = msg + msgSize - 1;
+    size_t pos = 0;
+    int c, a = 0;
+
+    for (c = 0; c < site->numConvs && out < outEnd; c++) {
+        const log_binary_conv_t *conv = &site->convs[c];
+        int stars[2], numStars = 0;
+        char spec[64];
+        size_t size = outEnd - out + 1;
+        int n = 0;
+
+        append_literal(&out, outEnd, site->format, pos, conv->start);
+        pos = conv->start + conv->len;
+        if (conv->len + 3 > sizeof(spec)) {
+            break;
+        }
+        size = outEnd - out + 1;
+
+        for (; a < conv->firstArg + conv->numArgs; a++) {
+            uint8_t type = site->types[a];
+            int argSize = log_binary_arg_size(type);
+            if (end - p < argSize) {
+                goto truncated;
+            }
+            if (a < conv->firstArg + conv->numArgs - 1) {
+                stars[numStars++] = (int)get32(p);
+                p += argSize;
+                continue;
+            }
+
+            switch (LOG_BINARY_ARG_BASE(type)) {
+                case LOG_BINARY_ARG_INT :
+                    make_spec(spec, site->format, conv, "");
+                    n = FORMAT_ARG((int)get32(p));
+                    break;
+                case LOG_BINARY_ARG_DOUBLE : {
+                    uint64_t bits = get64(p);
+                    double d;
+                    memcpy(&d, &bits, sizeof(d));
+                    make_spec(spec, site->format, conv, "");
+                    n = FORMAT_ARG(d);
+                    break;
+                }
+                case LOG_BINARY_ARG_PTR : {
+                    uint64_t v = get64(p);
+                    n = (v ? snprintf(out, size, "0x%llx", (unsigned long long)v) : snprintf(out, size, "(nil)"));
+                    break;
+                }
+                case LOG_BINARY_ARG_STRING : {
+                    uint16_t len = get16(p);
+                    char str[AF_LOG_ASYNC_MSG_SIZE + 1];
+                    if (end - p - argSize < len || len > AF_LOG_ASYNC_MSG_SIZE) {
+                        goto truncated;
+                    }
+                    memcpy(str, p + argSize, len);
+                    str[len] = '\0';
+                    argSize += len;
+                    make_spec(spec, site->format, conv, "");
+                    n = FORMAT_ARG(str);
+                    break;
+                }
+                default :
+                    make_spec(spec, site->format, conv, "ll");
+                    n = FORMAT_ARG((long long)get64(p));
+                    break;
+            }
+            p += argSize;
+        }
+        if (n > 0) {
+            out += ((size_t)n < size ? (size_t)n : size - 1);
+        }
+    }
+    append_literal(&out, outEnd, site->format, pos, strlen(site->format));
+    *out = '\0';
+    return;
+
+truncated:
+    snprintf(out, outEnd - out + 1, "<truncated record>");
+}
+
+static void print_message(uint64_t timestamp, const char *msg, int len)
+{
+    time_t secs = timestamp / 1000000000;
+    struct tm tm;
+    char when[32];
+
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u %.*s\n", when, (unsigned)(timestamp % 1000000000 / 1000), len, msg);
+}
+
+/* decodes the session starting at data, which points at a file header;
+   returns the length of the session */
+static size_t decode_session(const uint8_t *data, size_t size, const char *name)
+{
+    uint32_t byteOrder;
+    memcpy(&byteOrder, data + LOG_BINARY_MAGIC_LEN, sizeof(byteOrder));
+    s_swap = (byteOrder != LOG_BINARY_BYTE_ORDER);
+    if (s_swap && __builtin_bswap32(byteOrder) != LOG_BINARY_BYTE_ORDER) {
+        fprintf(stderr, "af_logdecode: %s: bad byte order marker\n", name);
+        return size;
+    }
+    if (get32(data + LOG_BINARY_MAGIC_LEN + 4) != LOG_BINARY_VERSION) {
+        fprintf(stderr, "af_logdecode: %s: unsupported version %u\n", name, get32(data + LOG_BINARY_MAGIC_LEN + 4));
+        return size;
+    }
+
+    /* sites are numbered per process, so each session starts afresh */
+    if (s_numSites) {
+        memset(s_sites, 0, s_numSites * sizeof(prv_site_t));
+    }
+
+    size_t start = sizeof(log_binary_file_header_t), end = start;
+    log_binary_record_t rec;
+    while (!is_header(data + end, size - end) && read_record(data + end, size - end, &rec) == 0) {
+        if (rec.kind == LOG_BINARY_KIND_SITE) {
+            add_site(rec.siteId, (const char *)data + end + sizeof(rec), rec.len - sizeof(rec));
+        }
+        end += rec.len;
+    }
+
+    size_t pos;
+    for (pos = start; pos < end; pos += rec.len) {
+        read_record(data + pos, end - pos, &rec);
+        const uint8_t *payload = data + pos + sizeof(rec);
+        if (rec.kind == LOG_BINARY_KIND_TEXT) {
+            print_message(rec.timestamp, (const char *)payload, rec.len - sizeof(rec));
+        } else if (rec.kind == LOG_BINARY_KIND_EVENT) {
+            char msg[4096];
+            if (rec.siteId < s_numSites && s_sites[rec.siteId].format && s_sites[rec.siteId].numArgs >= 0) {
+                decode_event(&s_sites[rec.siteId], payload, data + pos + rec.len, msg, sizeof(msg));
+            } else {
+                snprintf(msg, sizeof(msg), "<unknown site %u>", rec.siteId);
+            }
+            print_message(rec.timestamp, msg, strlen(msg));
+        }
+    }
+
+    if (end < size && !is_header(data + end, size - end)) {
+        fprintf(stderr, "af_logdecode: %s: bad record at offset %zu\n", name, end);
+        return size;
+    }
+    return end;
+}
+
+static int decode_file(FILE *f, const char *name)
+{
+    uint8_t *data = NULL;
+    size_t size = 0, cap = 0;
+
+    while (1) {
+        if (size == cap) {
+            cap = (cap ? cap * 2 : 65536);
+            uint8_t *d = (uint8_t *)realloc(data, cap);
+            if (d == NULL) {
+                perror("af_logdecode");
+                free(data);
+                return -1;
+            }
+            data = d;
+        }
+        size_t n = fread(data + size, 1, cap - size, f);
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "af_logdecode: %s: read error\n", name);
+        free(data);
+        return -1;
+    }
+
+    size_t pos = 0;
+    int ret = 0;
+    while (pos < size) {
+        if (!is_header(data + pos, size - pos)) {
+            fprintf(stderr, "af_logdecode: %s: not a binary log file\n", name);
+            ret = -1;
+            break;
+        }
+        pos += decode_session(data + pos, size - pos, name);
+    }
+    free(data);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (argc < 2) {
+        return (decode_file(stdin, "stdin") < 0 ? 1 : 0);
+    }
+    for (i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            perror(argv[i]);
+            ret = 1;
+            continue;
+        }
+        if (decode_file(f, argv[i]) < 0) {
+            ret = 1;
+        }
+        fclose(f);
+    }
+    return ret;
+}
@@ -0,0 +1,128 @@
+//
+// af_metricsdump.c -- prints the metrics a process exported with
+// af_metrics_export
+//
+// Counters are printed as totals over all threads. Histograms are printed
+// with their count, mean, and percentiles; a percentile is the upper end
+// of the bucket it falls in, so it's only accurate to a factor of two.
+//
+// usage: af_metricsdump <pid | file>
+//
+// Copyright (c) 2018 Afero, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "af_metrics.h"
+
+static uint64_t bucket_max(int bucket)
+{
+    return (bucket == 0 ? 0 : (1ULL << bucket) - 1);
+}
+
+static uint64_t percentile(const af_metrics_histogram_t *h, uint64_t count, int pct)
+{
+    uint64_t want = (count * pct + 99) / 100, seen = 0;
+    int i;
+    for (i = 0; i < AF_METRICS_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            break;
+        }
+    }
+    return (i == AF_METRICS_NUM_BUCKETS - 1 ? bucket_max(i - 1) + 1 : bucket_max(i));
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: af_metricsdump <pid | file>\n");
+        return 1;
+    }
+
+    char path[256];
+    if (strspn(argv[1], "0123456789") == strlen(argv[1])) {
+        snprintf(path, sizeof(path), "/dev/shm/af_metrics.%s", argv[1]);
+    } else {
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(af_metrics_region_t)) {
+        fprintf(stderr, "af_metricsdump: %s: not a metrics file\n", path);
+        close(fd);
+        return 1;
+    }
+    const af_metrics_region_t *r = (const af_metrics_region_t *)mmap(NULL, sizeof(*r), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        perror("af_metricsdump");
+        return 1;
+    }
+    if (r->magic != AF_METRICS_MAGIC || r->version != AF_METRICS_VERSION) {
+        fprintf(stderr, "af_metricsdump: %s: not a metrics file\n", path);
+        return 1;
+    }
+
+    /* the names can be added to while we read */
+    uint32_t numCounters = r->numCounters, numHistograms = r->numHistograms;
+    if (numCounters > AF_METRICS_MAX_COUNTERS) {
+        numCounters = AF_METRICS_MAX_COUNTERS;
+    }
+    if (numHistograms > AF_METRICS_MAX_HISTOGRAMS) {
+        numHistograms = AF_METRICS_MAX_HISTOGRAMS;
+    }
+
+    static af_metrics_thread_t totals;
+    int numThreads = 0, t, i, j;
+    for (t = 0; t < AF_METRICS_MAX_THREADS; t++) {
+        const af_metrics_thread_t *th = &r->threads[t];
+        numThreads += (th->inUse != 0);
+        for (i = 0; i < numCounters; i++) {
+            totals.counters[i] += th->counters[i];
+        }
+        for (i = 0; i < numHistograms; i++) {
+            totals.histograms[i].count += th->histograms[i].count;
+            totals.histograms[i].sum += th->histograms[i].sum;
+            for (j = 0; j < AF_METRICS_NUM_BUCKETS; j++) {
+                totals.histograms[i].buckets[j] += th->histograms[i].buckets[j];
+            }
+        }
+    }
+
+    printf("pid %d, %d thread slots in use\n\n", r->pid, numThreads);
+    for (i = 0; i < numCounters; i++) {
+        printf("%-*.*s %llu\n", AF_METRICS_NAME_SIZE, AF_METRICS_NAME_SIZE - 1, r->counterNames[i], (unsigned long long)totals.counters[i]);
+    }
+    printf("\n%-*s %12s %12s %12s %12s %12s\n", AF_METRICS_NAME_SIZE, "histogram", "count", "mean", "p50", "p90", "p99");
+    for (i = 0; i < numHistograms; i++) {
+        const af_metrics_histogram_t *h = &totals.histograms[i];
+        /* use the bucket total; count may be ahead of it */
+        uint64_t count = 0;
+        for (j = 0; j < AF_METRICS_NUM_BUCKETS; j++) {
+            count += h->buckets[j];
+        }
+        printf("%-*.*s %12llu", AF_METRICS_NAME_SIZE, AF_METRICS_NAME_SIZE - 1, r->histogramNames[i], (unsigned long long)count);
+        if (count == 0) {
+            printf(" %12s %12s %12s %12s\n", "-", "-", "-", "-");
+            continue;
+        }
+        printf(" %12llu %12llu %12llu %12llu\n", (unsigned long long)(h->sum / count),
+               (unsigned long long)percentile(h, count, 50),
+               (unsigned long long)percentile(h, count, 90),
+               (unsigned long long)percentile(h, count, 99));
+    }
+    return 0;
+}